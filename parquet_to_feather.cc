@@ -0,0 +1,99 @@
+#include "partvwap.hh"
+#include "partvwap_feather.hh"
+#include "partvwap_parquet.hh"
+
+#include <absl/cleanup/cleanup.h>
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/strings/str_cat.h>
+#include <absl/time/time.h>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+ABSL_FLAG(int, prefetch_files, 2,
+          "Number of parquet files to decode ahead on background threads");
+ABSL_FLAG(int, parquet_row_group_threads, 0,
+          "Number of row groups of a parquet file to decode concurrently");
+ABSL_FLAG(bool, parquet_use_threads, false,
+          "Decode the columns of a parquet row group on Arrow's thread pool");
+ABSL_FLAG(int64_t, parquet_batch_size, 64 * 1024,
+          "Rows per record batch read from parquet, and so per record batch "
+          "of the feather file");
+
+int main(int argc, char **argv) {
+  std::vector<char *> args = absl::ParseCommandLine(argc, argv);
+
+  if (args.size() != 3) {
+    std::cerr << "Usage: " << args[0] << " <input_dir> <output_feather_file>"
+              << std::endl;
+    std::cerr << "This program reads parquet files from <input_dir> and "
+                 "writes their rows to one uncompressed Arrow IPC (feather) "
+                 "file, for partvwap_feather_io to read without decoding."
+              << std::endl;
+    return 1;
+  }
+
+  std::string input_dir = args[1];
+  std::string output_feather_file = args[2];
+
+  if (!std::filesystem::exists(input_dir) ||
+      !std::filesystem::is_directory(input_dir)) {
+    std::cerr << "Error: Input directory does not exist or is not a directory: "
+              << input_dir << std::endl;
+    return 1;
+  }
+
+  std::vector<std::string> parquet_files = FindAndSortParquetFiles(input_dir);
+
+  if (parquet_files.empty()) {
+    std::cerr << "Error: No files found in directory: " << input_dir
+              << std::endl;
+    return 1;
+  }
+
+  ParquetReadOptions read_options{
+      .prefetch_files = absl::GetFlag(FLAGS_prefetch_files),
+      .row_group_threads = absl::GetFlag(FLAGS_parquet_row_group_threads),
+      .use_threads = absl::GetFlag(FLAGS_parquet_use_threads),
+      .batch_size = absl::GetFlag(FLAGS_parquet_batch_size)};
+  // The feather file is written under a temporary name and only renamed into
+  // place once closed, so a failed conversion never leaves a truncated file
+  // that partvwap_feather_io would fail to open
+  const std::string temp_feather_file =
+      absl::StrCat(output_feather_file, ".tmp");
+  absl::Cleanup temp_feather_file_remover = [&] {
+    std::error_code ignored;
+    std::filesystem::remove(temp_feather_file, ignored);
+  };
+  absl::Time start_time = absl::Now();
+  auto status = WriteFeatherFromParquetFiles(parquet_files, temp_feather_file,
+                                             read_options);
+  if (!status.ok()) {
+    std::cerr << "Error converting parquet files from directory '"
+              << input_dir << "' to '" << output_feather_file
+              << "': " << status.ToString() << std::endl;
+    return 1;
+  }
+  std::error_code rename_error;
+  std::filesystem::rename(temp_feather_file, output_feather_file,
+                          rename_error);
+  if (rename_error) {
+    std::cerr << "Error renaming '" << temp_feather_file << "' to '"
+              << output_feather_file << "': " << rename_error.message()
+              << std::endl;
+    return 1;
+  }
+  absl::Time end_time = absl::Now();
+
+  std::cout << "Successfully converted " << parquet_files.size()
+            << " parquet files to feather file " << output_feather_file
+            << " of " << std::filesystem::file_size(output_feather_file)
+            << " bytes" << std::endl;
+  std::cout << "Time taken to convert to feather file: "
+            << absl::FormatDuration(end_time - start_time) << std::endl;
+
+  return 0;
+}
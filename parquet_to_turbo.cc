@@ -1,20 +1,80 @@
 #include "partvwap.hh"
+#include "partvwap_parallel.hh"
 #include "partvwap_parquet.hh"
 #include "partvwap_turbo.hh"
 #include "perf_counter_scope.hh"
 
+#include <absl/cleanup/cleanup.h>
 #include <absl/flags/flag.h>
 #include <absl/flags/parse.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
 #include <absl/time/time.h>
 #include <arrow/api.h>
 #include <arrow/io/api.h>
 #include <filesystem>
 #include <iostream>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
 #include <vector>
 
 ABSL_FLAG(absl::Duration, repeat_turbo_decode_duration, absl::ZeroDuration(),
           "Duration to keep repreating the turbo decode so a profile can be "
           "collected");
+ABSL_FLAG(int64_t, max_idle_windows, std::numeric_limits<int64_t>::max(),
+          "Number of windows without input to report after a window with "
+          "input; the rest of an idle gap is skipped");
+ABSL_FLAG(int, compute_threads, 1,
+          "Number of threads to partition the TWAP series over");
+ABSL_FLAG(absl::Time, query_begin, absl::InfinitePast(),
+          "Only compute over input rows at or after this time");
+ABSL_FLAG(absl::Time, query_end, absl::InfiniteFuture(),
+          "Only compute over input rows before this time");
+ABSL_FLAG(std::vector<std::string>, series, {},
+          "Comma separated provider/symbol series to compute; all series if "
+          "empty");
+ABSL_FLAG(int64_t, turbo_chunk_rows, 1024 * 1024,
+          "Rows per chunk of a new turbo file");
+ABSL_FLAG(std::string, turbo_timestamp_encoding, "delta",
+          "Encoding of timestamps in a new turbo file: raw, delta, "
+          "zigzag_delta or delta_of_delta");
+ABSL_FLAG(int64_t, turbo_max_price_decimals, 6,
+          "Store prices in a new turbo file as integers with up to this many "
+          "decimals where that is lossless; -1 always stores raw doubles");
+ABSL_FLAG(int, turbo_compress_threads, 4,
+          "Number of turbo chunks to compress concurrently when writing");
+ABSL_FLAG(int, turbo_decode_threads, 2,
+          "Number of turbo chunks to decompress ahead on background threads");
+ABSL_FLAG(std::string, turbo_io_strategy, "mmap",
+          "How to read the turbo file: mmap, mmap_sequential, mmap_populate, "
+          "mmap_huge_pages, read or direct_read");
+ABSL_FLAG(int64_t, turbo_readahead_bytes, 64 << 20,
+          "Bytes of turbo chunks to read ahead with mmap_sequential, or to "
+          "read at a time with read and direct_read");
+ABSL_FLAG(int, prefetch_files, 2,
+          "Number of parquet files to decode ahead on background threads");
+ABSL_FLAG(int, parquet_row_group_threads, 0,
+          "Number of row groups of a parquet file to decode concurrently");
+ABSL_FLAG(bool, parquet_use_threads, false,
+          "Decode the columns of a parquet row group on Arrow's thread pool");
+ABSL_FLAG(bool, parquet_pre_buffer, true,
+          "Coalesce the reads of a parquet row group's columns up front");
+ABSL_FLAG(int64_t, parquet_batch_size, 64 * 1024,
+          "Rows per record batch read from parquet");
+ABSL_FLAG(int64_t, parquet_buffer_size, 0,
+          "Read parquet column chunks through a buffer of this many bytes; 0 "
+          "reads them whole");
+ABSL_FLAG(std::string, output_compression, "uncompressed",
+          "Compression codec of the output parquet file, e.g. snappy or zstd "
+          "where Arrow was built with it");
+ABSL_FLAG(int64_t, output_row_group_rows, 1024 * 1024,
+          "Rows per row group of the output parquet file");
+ABSL_FLAG(int, output_queue_row_groups, 2,
+          "Number of output row groups queued for the background writer "
+          "before the computation waits for it");
 
 int main(int argc, char **argv) {
   std::vector<char *> args = absl::ParseCommandLine(argc, argv);
@@ -30,6 +90,10 @@ int main(int argc, char **argv) {
         << std::endl;
     return 1;
   }
+  if (absl::GetFlag(FLAGS_max_idle_windows) < 0) {
+    std::cerr << "Error: --max_idle_windows must not be negative" << std::endl;
+    return 1;
+  }
 
   std::string input_dir = args[1];
   const char *output_turbo_file = args[2];
@@ -52,11 +116,107 @@ int main(int argc, char **argv) {
 
   NameToId providers;
   NameToId symbols;
-  std::vector<InputRow> rows;
 
-  arrow::Status read_status = ReadManyParquetFiles(
-      parquet_files, [&](const InputRow &row) { rows.push_back(row); },
-      providers, symbols);
+  // Stream the parquet rows into a new turbo file. It is written under a
+  // temporary name and only renamed into place once closed, so a failed
+  // conversion never leaves a turbo file that reads as empty. If the file
+  // already exists, take the names from it, or just read the names from the
+  // parquet files if it was written without them.
+  std::optional<TurboPForWriter<decltype(&bitnpack128v64),
+                                decltype(&bitnxpack256v32)>>
+      turbo_writer;
+  const std::string temp_turbo_file = absl::StrCat(output_turbo_file, ".tmp");
+  absl::Cleanup temp_turbo_file_remover = [&] {
+    if (turbo_writer) {
+      std::error_code ignored;
+      std::filesystem::remove(temp_turbo_file, ignored);
+    }
+  };
+  bool read_parquet = true;
+  if (!std::filesystem::exists(output_turbo_file) ||
+      std::filesystem::file_size(output_turbo_file) == 0) {
+    auto timestamp_encoding = ParseTurboPForTimestampEncoding(
+        absl::GetFlag(FLAGS_turbo_timestamp_encoding));
+    if (!timestamp_encoding) {
+      std::cerr << "Error: Unknown --turbo_timestamp_encoding "
+                << absl::GetFlag(FLAGS_turbo_timestamp_encoding) << std::endl;
+      return 1;
+    }
+    if (absl::GetFlag(FLAGS_turbo_chunk_rows) <= 0) {
+      std::cerr << "Error: --turbo_chunk_rows must be positive, got "
+                << absl::GetFlag(FLAGS_turbo_chunk_rows) << std::endl;
+      return 1;
+    }
+    try {
+      turbo_writer.emplace(
+          bitnpack128v64, bitnxpack256v32, temp_turbo_file.c_str(),
+          TurboPForWriteOptions{
+              .chunk_rows = absl::GetFlag(FLAGS_turbo_chunk_rows),
+              .timestamp_encoding = *timestamp_encoding,
+              .max_price_decimals =
+                  absl::GetFlag(FLAGS_turbo_max_price_decimals),
+              .compress_threads =
+                  absl::GetFlag(FLAGS_turbo_compress_threads)});
+    } catch (const std::runtime_error &e) {
+      std::cerr << "Error creating turbo file: " << e.what() << std::endl;
+      return 1;
+    }
+  } else {
+    std::cout << "Turbo file already exists: " << output_turbo_file
+              << std::endl;
+    try {
+      // Only a file with a valid footer is known to have been closed
+      TurboPForFile turbo_file(output_turbo_file);
+      if (!turbo_file.HasIndex()) {
+        std::cerr << "Error: Turbo file '" << output_turbo_file
+                  << "' has no footer, so it may be incomplete; remove it to "
+                     "convert again"
+                  << std::endl;
+        return 1;
+      }
+      if (turbo_file.HasNames()) {
+        providers = turbo_file.Providers();
+        symbols = turbo_file.Symbols();
+        read_parquet = false;
+      }
+    } catch (const std::runtime_error &e) {
+      std::cerr << "Error reading turbo file: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  ParquetReadOptions read_parquet_options{
+      .prefetch_files = absl::GetFlag(FLAGS_prefetch_files),
+      .row_group_threads = absl::GetFlag(FLAGS_parquet_row_group_threads),
+      .use_threads = absl::GetFlag(FLAGS_parquet_use_threads),
+      .pre_buffer = absl::GetFlag(FLAGS_parquet_pre_buffer),
+      .batch_size = absl::GetFlag(FLAGS_parquet_batch_size),
+      .buffer_size = absl::GetFlag(FLAGS_parquet_buffer_size)};
+  absl::Time turbo_start_time = absl::Now();
+  arrow::Status read_status;
+  // The writer throws when compressing or writing fails, e.g. on a full
+  // disk; returning unwinds through the cleanup that removes the temporary
+  // file
+  try {
+    if (read_parquet) {
+      read_status = ReadManyParquetFileColumns(
+          parquet_files,
+          [&](const InputColumns &columns) {
+            if (turbo_writer) {
+              turbo_writer->AddColumns(columns);
+            }
+          },
+          providers, symbols, read_parquet_options);
+    }
+    if (read_status.ok() && turbo_writer) {
+      turbo_writer->SetNames(providers, symbols);
+      turbo_writer->Close();
+    }
+  } catch (const std::runtime_error &e) {
+    std::cerr << "Error writing turbo file '" << temp_turbo_file
+              << "': " << e.what() << std::endl;
+    return 1;
+  }
 
   if (!read_status.ok()) {
     std::cerr << "Error reading parquet files from directory '" << input_dir
@@ -64,23 +224,66 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  if (!std::filesystem::exists(output_turbo_file) ||
-      std::filesystem::file_size(output_turbo_file) == 0) {
-    absl::Time turbo_start_time = absl::Now();
-    WriteTurboPForFromInputRows(bitnpack128v64, bitnxpack256v32,
-                                output_turbo_file, rows, providers, symbols);
+  if (turbo_writer) {
+    std::error_code rename_error;
+    std::filesystem::rename(temp_turbo_file, output_turbo_file, rename_error);
+    if (rename_error) {
+      std::cerr << "Error renaming '" << temp_turbo_file << "' to '"
+                << output_turbo_file << "': " << rename_error.message()
+                << std::endl;
+      return 1;
+    }
     absl::Time turbo_end_time = absl::Now();
 
-    std::cout << "Successfully converted " << rows.size()
+    std::cout << "Successfully converted " << turbo_writer->NumRows()
               << " rows to turbo file " << output_turbo_file << std::endl;
-    std::cout << "Time taken to write turbo file: "
+    std::cout << "Time taken to convert to turbo file: "
               << absl::FormatDuration(turbo_end_time - turbo_start_time)
               << std::endl;
-  } else {
-    std::cout << "Turbo file already exists: " << output_turbo_file
-              << std::endl;
   }
 
+  TurboPForReadOptions read_options{
+      .begin_nanos = absl::ToUnixNanos(absl::GetFlag(FLAGS_query_begin)),
+      .end_nanos = absl::ToUnixNanos(absl::GetFlag(FLAGS_query_end)),
+      .decode_threads = absl::GetFlag(FLAGS_turbo_decode_threads),
+      .readahead_bytes =
+          size_t(absl::GetFlag(FLAGS_turbo_readahead_bytes))};
+  auto io_strategy =
+      ParseTurboPForIOStrategy(absl::GetFlag(FLAGS_turbo_io_strategy));
+  if (!io_strategy) {
+    std::cerr << "Error: Unknown --turbo_io_strategy "
+              << absl::GetFlag(FLAGS_turbo_io_strategy) << std::endl;
+    return 1;
+  }
+  read_options.io_strategy = *io_strategy;
+  TurboPForIOStrategy used_io_strategy = read_options.io_strategy;
+  if (!absl::GetFlag(FLAGS_series).empty()) {
+    std::vector<std::pair<uint32_t, uint32_t>> series;
+    for (const std::string &name : absl::GetFlag(FLAGS_series)) {
+      std::pair<std::string, std::string> provider_symbol =
+          absl::StrSplit(name, absl::MaxSplits('/', 1));
+      auto provider = providers.name_to_id.find(provider_symbol.first);
+      auto symbol = symbols.name_to_id.find(provider_symbol.second);
+      if (provider == providers.name_to_id.end() ||
+          symbol == symbols.name_to_id.end()) {
+        std::cerr << "Error: Unknown series '" << name << "'" << std::endl;
+        return 1;
+      }
+      series.emplace_back(provider->second, symbol->second);
+    }
+    read_options.series_filter = TWAPSeriesFilter::Only(series);
+  }
+
+  auto output_compression = arrow::util::Codec::GetCompressionType(
+      absl::GetFlag(FLAGS_output_compression));
+  if (!output_compression.ok()) {
+    std::cerr << "Error: Unknown --output_compression: "
+              << output_compression.status().ToString() << std::endl;
+    return 1;
+  }
+  ParquetWriteOptions write_options{
+      .row_group_rows = absl::GetFlag(FLAGS_output_row_group_rows),
+      .compression = *output_compression};
   absl::Time turbo_decode_start_time = absl::Now();
   absl::Time start_time;
   absl::Time end_time;
@@ -88,7 +291,9 @@ int main(int argc, char **argv) {
   int64_t output_rows;
   do {
 
-    ParquetOutputWriter writer(providers, symbols);
+    AsyncParquetOutputWriter writer(
+        providers, symbols, write_options,
+        absl::GetFlag(FLAGS_output_queue_row_groups));
 
     auto open_status = writer.OpenOutputFile(output_parquet_file);
     if (!open_status.ok()) {
@@ -103,19 +308,28 @@ int main(int argc, char **argv) {
     output_rows = 0;
     {
       PerfCounterScope perf_monitor("ComputeTWAP");
-      ComputeTWAP(
-          [&](auto &&row_acceptor) {
-            ReadTurboPForFromInputRows(bitnunpack128v64, bitnxunpack256v32,
-                                       output_turbo_file,
-                                       [&](const InputRow &row) {
-                                         row_acceptor(row);
-                                         input_rows++;
-                                       });
-          },
-          [&](const OutputRow &row) {
-            output_rows++;
-            write_status &= writer.AppendOutputRow(row);
-          });
+      auto input_row_provider = [&](auto &&row_acceptor) {
+        used_io_strategy = ReadTurboPForColumns(
+            bitnunpack128v64, bitnxunpack256v32, output_turbo_file,
+            [&](const InputColumns &columns) {
+              row_acceptor(columns);
+              input_rows += columns.size();
+            },
+            read_options);
+      };
+      auto output_row_sink = [&](const OutputRow &row) {
+        output_rows++;
+        write_status &= writer.AppendOutputRow(row);
+      };
+      TWAPOptions options{.max_idle_windows =
+                              absl::GetFlag(FLAGS_max_idle_windows),
+                          .series_filter = read_options.series_filter};
+      if (absl::GetFlag(FLAGS_compute_threads) > 1) {
+        ComputeTWAPParallel(input_row_provider, output_row_sink, options,
+                            absl::GetFlag(FLAGS_compute_threads));
+      } else {
+        ComputeTWAP(input_row_provider, output_row_sink, options);
+      }
       perf_monitor.IncrementNumRows(input_rows);
       end_time = absl::Now();
     }
@@ -142,6 +356,8 @@ int main(int argc, char **argv) {
             << std::endl
             << "Total seconds " << absl::ToDoubleSeconds(end_time - start_time)
             << std::endl;
+  std::cout << "Read turbo file with I/O strategy "
+            << TurboPForIOStrategyName(used_io_strategy) << std::endl;
 
   return 0;
 }
\ No newline at end of file
@@ -16,9 +16,11 @@
 #include <arrow/testing/gtest_util.h>
 #include <cstdlib>
 #include <filesystem>
+#include <fstream>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <iostream>
+#include <iterator>
 #include <parquet/arrow/reader.h>
 #include <parquet/arrow/writer.h>
 #include <string>
@@ -83,4 +85,42 @@ TEST(ParquetTurboIntegration, EndToEndTest) {
     EXPECT_EQ(rows_from_turbo[i], rows_from_parquet[i])
         << "Row " << i << " is different";
   }
-}
\ No newline at end of file
+}
+
+TEST(ParquetTurboIntegration, TurboOnlyComputeMatches) {
+  TempDirectoryForTest test_dir;
+
+  std::string cmd =
+      "./create_test_parquet " + std::string(test_dir.tmp_dirname) + " 3";
+  std::string cmd_output = RunCommandForTest(cmd.c_str());
+
+  TempFileForTest turbo_file;
+  TempFileForTest expected_output_file;
+  cmd = "./parquet_to_turbo " + std::string(test_dir.tmp_dirname) + " " +
+        turbo_file.tmp_filename + " " + expected_output_file.tmp_filename;
+  cmd_output = RunCommandForTest(cmd.c_str());
+
+  TurboPForFile file(turbo_file.tmp_filename.c_str());
+  ASSERT_TRUE(file.HasNames());
+  EXPECT_GT(file.Providers().id_to_name.size(), 0);
+  EXPECT_GT(file.Symbols().id_to_name.size(), 0);
+
+  auto read_file = [](const std::string &filename) {
+    std::ifstream in(filename, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+  };
+  // The turbo file alone is enough to compute the same output, however it
+  // is read
+  for (std::string io_strategy : {"mmap", "mmap_sequential", "direct_read"}) {
+    TempFileForTest output_file;
+    cmd = "./partvwap_turbo_io --turbo_io_strategy=" + io_strategy + " " +
+          turbo_file.tmp_filename + " " + output_file.tmp_filename;
+    cmd_output = RunCommandForTest(cmd.c_str());
+    std::cout << "Command output: " << cmd_output << std::endl;
+    EXPECT_THAT(cmd_output, testing::HasSubstr("Read turbo file with"));
+    EXPECT_EQ(read_file(output_file.tmp_filename),
+              read_file(expected_output_file.tmp_filename))
+        << io_strategy;
+  }
+}
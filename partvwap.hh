@@ -3,12 +3,22 @@
 #include <absl/container/flat_hash_map.h>
 #include <absl/strings/string_view.h>
 #include <absl/time/time.h>
+#include <algorithm>
+#include <bit>
+#include <cassert>
 #include <cmath>
 #include <cstdint>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <numeric>
+#include <optional>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 struct InputRow {
@@ -43,75 +53,882 @@ inline std::ostream &operator<<(std::ostream &os, const OutputRow &row) {
   return os;
 }
 
+// The part of a series' TWAP accumulated in one window. carry_nanos is the
+// time spent at the price carried in from before the window; the sums cover
+// the rest of the window after its first price update. Keeping them apart
+// lets a window be computed before the carried price is known, e.g. by a
+// worker that starts part way through the input.
+struct TWAPWindowPartial {
+  int64_t carry_nanos = 0;
+  double price_nanos_sum = 0;
+  int64_t nanos_sum = 0;
+
+  double PriceNanosSum(double carry_price) const {
+    return carry_price * carry_nanos + price_nanos_sum;
+  }
+};
+
 struct TWAPState {
   int64_t last_ts_nanos = 0;
   double last_price = std::nan("");
+  // Totals over closed windows
   double price_nanos_sum = 0;
   int64_t nanos_sum = 0;
+  // last_price when the previous window closed
+  double carry_price = 0;
+  TWAPWindowPartial window;
+  bool window_has_price = false;
 
   bool Empty() const { return last_ts_nanos == 0; }
 
   void AddPrice(int64_t ts_nanos, double price) {
-    if (!Empty()) {
-      int64_t time_delta_nanos = ts_nanos - last_ts_nanos;
-      price_nanos_sum += last_price * time_delta_nanos;
-      nanos_sum += time_delta_nanos;
-      last_ts_nanos = ts_nanos;
-    }
+    Accrue(ts_nanos);
+    window_has_price = true;
     last_price = price;
     last_ts_nanos = ts_nanos;
   }
 
-  double ComputeTWAP(int64_t ts_nanos) {
-    AddPrice(ts_nanos, last_price);
+  // Close the window at ts_nanos and return what it accumulated
+  TWAPWindowPartial CloseWindow(int64_t ts_nanos) {
+    Accrue(ts_nanos);
+    last_ts_nanos = ts_nanos;
+    TWAPWindowPartial closed = window;
+    window = TWAPWindowPartial{};
+    window_has_price = false;
+    return closed;
+  }
+
+  // Fold a closed window that ended at close_price into the totals, and
+  // return the TWAP up to its close. The window may come from a state that
+  // covered a later time slice of the same series.
+  double MergeWindow(const TWAPWindowPartial &closed, double close_price) {
+    price_nanos_sum += closed.PriceNanosSum(carry_price);
+    nanos_sum += closed.carry_nanos + closed.nanos_sum;
+    carry_price = close_price;
     return price_nanos_sum / nanos_sum;
   }
+
+  double ComputeTWAP(int64_t ts_nanos) {
+    return MergeWindow(CloseWindow(ts_nanos), last_price);
+  }
+
+private:
+  void Accrue(int64_t ts_nanos) {
+    if (Empty()) {
+      return;
+    }
+    int64_t time_delta_nanos = ts_nanos - last_ts_nanos;
+    if (window_has_price) {
+      window.price_nanos_sum += last_price * time_delta_nanos;
+      window.nanos_sum += time_delta_nanos;
+    } else {
+      window.carry_nanos += time_delta_nanos;
+    }
+  }
+};
+
+// Per-series TWAP state for every (provider, symbol) pair seen so far. Each
+// series gets a dense slot when it is first seen and the TWAPState fields are
+// kept in parallel arrays indexed by that slot. A flat index over
+// provider_id * symbol_capacity + symbol_id maps pairs to slots; it is only
+// rebuilt, with doubled capacity, when an id falls outside it. Reporting walks
+// a sorted list of the live series rather than the index.
+class TWAPSeriesTable {
+public:
+  static constexpr uint32_t kNoSeries = std::numeric_limits<uint32_t>::max();
+
+  uint32_t FindOrAddSeries(uint32_t provider_id, uint32_t symbol_id) {
+    if (provider_id >= provider_capacity || symbol_id >= symbol_capacity)
+        [[unlikely]] {
+      Grow(provider_id, symbol_id);
+    }
+    uint32_t &series =
+        series_index[size_t(provider_id) * symbol_capacity + symbol_id];
+    if (series == kNoSeries) [[unlikely]] {
+      series = AddSeries(provider_id, symbol_id);
+    }
+    return series;
+  }
+
+  uint32_t FindSeries(uint32_t provider_id, uint32_t symbol_id) const {
+    if (provider_id >= provider_capacity || symbol_id >= symbol_capacity) {
+      return kNoSeries;
+    }
+    return series_index[size_t(provider_id) * symbol_capacity + symbol_id];
+  }
+
+  size_t size() const { return last_ts_nanos.size(); }
+  uint32_t ProviderId(uint32_t series) const { return provider_ids[series]; }
+  uint32_t SymbolId(uint32_t series) const { return symbol_ids[series]; }
+  bool Empty(uint32_t series) const { return last_ts_nanos[series] == 0; }
+
+  // The methods below do the same arithmetic as TWAPState's
+
+  void AddPrice(uint32_t series, int64_t ts_nanos, double price) {
+    Accrue(series, ts_nanos);
+    window_has_price[series] = true;
+    last_price[series] = price;
+    last_ts_nanos[series] = ts_nanos;
+  }
+
+  TWAPWindowPartial CloseWindow(uint32_t series, int64_t ts_nanos) {
+    Accrue(series, ts_nanos);
+    last_ts_nanos[series] = ts_nanos;
+    TWAPWindowPartial closed{window_carry_nanos[series],
+                             window_price_nanos_sum[series],
+                             window_nanos_sum[series]};
+    window_carry_nanos[series] = 0;
+    window_price_nanos_sum[series] = 0;
+    window_nanos_sum[series] = 0;
+    window_has_price[series] = false;
+    return closed;
+  }
+
+  double MergeWindow(uint32_t series, const TWAPWindowPartial &closed,
+                     double close_price) {
+    price_nanos_sum[series] += closed.PriceNanosSum(carry_price[series]);
+    nanos_sum[series] += closed.carry_nanos + closed.nanos_sum;
+    carry_price[series] = close_price;
+    return price_nanos_sum[series] / nanos_sum[series];
+  }
+
+  double ComputeTWAP(uint32_t series, int64_t ts_nanos) {
+    return MergeWindow(series, CloseWindow(series, ts_nanos),
+                       last_price[series]);
+  }
+
+  double LastPrice(uint32_t series) const { return last_price[series]; }
+  double CarryPrice(uint32_t series) const { return carry_price[series]; }
+
+  TWAPState State(uint32_t series) const {
+    return TWAPState{
+        .last_ts_nanos = last_ts_nanos[series],
+        .last_price = last_price[series],
+        .price_nanos_sum = price_nanos_sum[series],
+        .nanos_sum = nanos_sum[series],
+        .carry_price = carry_price[series],
+        .window = {window_carry_nanos[series], window_price_nanos_sum[series],
+                   window_nanos_sum[series]},
+        .window_has_price = bool(window_has_price[series]),
+    };
+  }
+
+  // Series added from now on are treated as already open since ts_nanos,
+  // with an unknown price carried into their window. Used when computing a
+  // time slice that does not start at the beginning of the input.
+  void AssumeHistoryBefore(int64_t ts_nanos) { new_series_ts_nanos = ts_nanos; }
+
+  // Calls f(series) for every series in (provider, symbol) order. This
+  // walks the series seen so far, not the whole id space.
+  template <typename F> void ForEachSeries(F &&f) {
+    if (!new_series.empty()) [[unlikely]] {
+      MergeNewSeries();
+    }
+    for (uint32_t series : ordered_series) {
+      f(series);
+    }
+  }
+
+private:
+  std::vector<int64_t> last_ts_nanos;
+  std::vector<double> last_price;
+  std::vector<double> price_nanos_sum;
+  std::vector<int64_t> nanos_sum;
+  std::vector<double> carry_price;
+  std::vector<int64_t> window_carry_nanos;
+  std::vector<double> window_price_nanos_sum;
+  std::vector<int64_t> window_nanos_sum;
+  std::vector<uint8_t> window_has_price;
+  std::vector<uint32_t> provider_ids;
+  std::vector<uint32_t> symbol_ids;
+  int64_t new_series_ts_nanos = 0;
+
+  void Accrue(uint32_t series, int64_t ts_nanos) {
+    if (Empty(series)) {
+      return;
+    }
+    int64_t time_delta_nanos = ts_nanos - last_ts_nanos[series];
+    if (window_has_price[series]) {
+      window_price_nanos_sum[series] += last_price[series] * time_delta_nanos;
+      window_nanos_sum[series] += time_delta_nanos;
+    } else {
+      window_carry_nanos[series] += time_delta_nanos;
+    }
+  }
+
+  std::vector<uint32_t> series_index;
+  uint32_t provider_capacity = 0;
+  uint32_t symbol_capacity = 0;
+
+  // Series in (provider, symbol) order, plus those added since the last
+  // ForEachSeries, which are merged in lazily.
+  std::vector<uint32_t> ordered_series;
+  std::vector<uint32_t> new_series;
+
+  bool SeriesLess(uint32_t a, uint32_t b) const {
+    return std::pair(provider_ids[a], symbol_ids[a]) <
+           std::pair(provider_ids[b], symbol_ids[b]);
+  }
+
+  void MergeNewSeries() {
+    auto less = [this](uint32_t a, uint32_t b) { return SeriesLess(a, b); };
+    std::sort(new_series.begin(), new_series.end(), less);
+    size_t old_size = ordered_series.size();
+    ordered_series.insert(ordered_series.end(), new_series.begin(),
+                          new_series.end());
+    std::inplace_merge(ordered_series.begin(),
+                       ordered_series.begin() + old_size, ordered_series.end(),
+                       less);
+    new_series.clear();
+  }
+
+  uint32_t AddSeries(uint32_t provider_id, uint32_t symbol_id) {
+    uint32_t series = size();
+    last_ts_nanos.push_back(new_series_ts_nanos);
+    last_price.push_back(std::nan(""));
+    price_nanos_sum.push_back(0);
+    nanos_sum.push_back(0);
+    carry_price.push_back(0);
+    window_carry_nanos.push_back(0);
+    window_price_nanos_sum.push_back(0);
+    window_nanos_sum.push_back(0);
+    window_has_price.push_back(false);
+    provider_ids.push_back(provider_id);
+    symbol_ids.push_back(symbol_id);
+    new_series.push_back(series);
+    return series;
+  }
+
+  void Grow(uint32_t provider_id, uint32_t symbol_id) {
+    auto grown = [](uint32_t capacity, uint32_t id) {
+      return id < capacity ? capacity : std::max(id + 1, 2 * capacity);
+    };
+    uint32_t new_provider_capacity = grown(provider_capacity, provider_id);
+    uint32_t new_symbol_capacity = grown(symbol_capacity, symbol_id);
+    std::vector<uint32_t> new_index(
+        size_t(new_provider_capacity) * new_symbol_capacity, kNoSeries);
+    for (uint32_t series = 0; series < size(); ++series) {
+      new_index[size_t(provider_ids[series]) * new_symbol_capacity +
+                symbol_ids[series]] = series;
+    }
+    series_index = std::move(new_index);
+    provider_capacity = new_provider_capacity;
+    symbol_capacity = new_symbol_capacity;
+  }
+};
+
+// Views over the columns of a batch of consecutive input rows, e.g. a decoded
+// turbo chunk or an Arrow record batch. All spans have the same length.
+struct InputColumns {
+  std::span<const int64_t> ts_nanos;
+  std::span<const uint32_t> provider_ids;
+  std::span<const uint32_t> symbol_ids;
+  std::span<const double> prices;
+
+  size_t size() const { return ts_nanos.size(); }
+
+  InputRow operator[](size_t i) const {
+    return InputRow{ts_nanos[i], provider_ids[i], symbol_ids[i], prices[i]};
+  }
+
+  InputColumns subspan(size_t offset, size_t count) const {
+    return InputColumns{ts_nanos.subspan(offset, count),
+                        provider_ids.subspan(offset, count),
+                        symbol_ids.subspan(offset, count),
+                        prices.subspan(offset, count)};
+  }
+};
+
+// Owning storage for a batch of input rows in column form.
+struct InputColumnBuffer {
+  std::vector<int64_t> ts_nanos;
+  std::vector<uint32_t> provider_ids;
+  std::vector<uint32_t> symbol_ids;
+  std::vector<double> prices;
+
+  size_t size() const { return ts_nanos.size(); }
+
+  void resize(size_t n) {
+    ts_nanos.resize(n);
+    provider_ids.resize(n);
+    symbol_ids.resize(n);
+    prices.resize(n);
+  }
+
+  void clear() { resize(0); }
+
+  void push_back(const InputRow &row) {
+    ts_nanos.push_back(row.ts_nanos);
+    provider_ids.push_back(row.provider_id);
+    symbol_ids.push_back(row.symbol_id);
+    prices.push_back(row.price);
+  }
+
+  InputColumns View() const {
+    return InputColumns{ts_nanos, provider_ids, symbol_ids, prices};
+  }
+};
+
+// Which (provider, symbol) series to compute. The default selects every
+// series.
+struct TWAPSeriesFilter {
+  // Sorted keys of the selected series, when not selecting all of them
+  std::optional<std::vector<uint64_t>> keys;
+
+  static uint64_t Key(uint32_t provider_id, uint32_t symbol_id) {
+    return (uint64_t(provider_id) << 32) | symbol_id;
+  }
+
+  static TWAPSeriesFilter
+  Only(const std::vector<std::pair<uint32_t, uint32_t>> &series) {
+    std::vector<uint64_t> keys;
+    for (auto [provider_id, symbol_id] : series) {
+      keys.push_back(Key(provider_id, symbol_id));
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    return TWAPSeriesFilter{std::move(keys)};
+  }
+
+  bool SelectsAll() const { return !keys.has_value(); }
+
+  bool Matches(uint32_t provider_id, uint32_t symbol_id) const {
+    return !keys ||
+           std::binary_search(keys->begin(), keys->end(),
+                              Key(provider_id, symbol_id));
+  }
+};
+
+struct TWAPOptions {
+  int64_t window_nanos = 15ll * 1000 * 1000 * 1000;
+  // How many windows without any input to report after a window with input;
+  // must not be negative. Reports past this limit are skipped, but the time
+  // still counts towards the TWAP reported at the end of the next window
+  // with input.
+  int64_t max_idle_windows = std::numeric_limits<int64_t>::max();
+  // Rows of other series are dropped before they reach the window clock, so
+  // the output is as if the input held only the selected series
+  TWAPSeriesFilter series_filter;
+};
+
+// Decides which window boundaries are reported as input time advances.
+// Windows are aligned to multiples of window_nanos.
+struct TWAPWindowClock {
+  int64_t window_nanos;
+  int64_t max_idle_windows;
+  int64_t next_report_nanos = 0;
+  // Whether the window ending at next_report_nanos has any input
+  bool window_has_input = false;
+  // Idle windows reported since the last window with input
+  int64_t idle_windows_reported = 0;
+
+  explicit TWAPWindowClock(const TWAPOptions &options)
+      : window_nanos(options.window_nanos),
+        max_idle_windows(options.max_idle_windows) {
+    assert(max_idle_windows >= 0);
+  }
+
+  // Continue as though the last report was at report_nanos
+  void ResumeAfter(int64_t report_nanos) {
+    next_report_nanos = report_nanos + window_nanos;
+    window_has_input = false;
+    idle_windows_reported = 0;
+  }
+
+  // Calls report(boundary_nanos) for each boundary to report before a row at
+  // ts_nanos. Afterwards ts_nanos < next_report_nanos. An idle gap costs one
+  // call per reported boundary, and nothing for the skipped ones.
+  template <typename Report> void AdvanceTo(int64_t ts_nanos, Report &&report) {
+    if (next_report_nanos == 0) {
+      next_report_nanos =
+          ((ts_nanos + window_nanos) / window_nanos) * window_nanos;
+      window_has_input = true;
+      return;
+    }
+    CloseThrough(ts_nanos, report);
+    window_has_input = true;
+  }
+
+  // Calls report(boundary_nanos) for each boundary at or before ts_nanos, as
+  // AdvanceTo does, without counting ts_nanos as input. Idle windows closed
+  // over several calls still count towards max_idle_windows.
+  template <typename Report>
+  void CloseThrough(int64_t ts_nanos, Report &&report) {
+    if (next_report_nanos == 0 || ts_nanos < next_report_nanos) {
+      return;
+    }
+    if (window_has_input) {
+      report(next_report_nanos);
+      next_report_nanos += window_nanos;
+      window_has_input = false;
+      idle_windows_reported = 0;
+    }
+    if (ts_nanos >= next_report_nanos) {
+      // Every window ending at or before ts_nanos is empty
+      int64_t idle_windows = (ts_nanos - next_report_nanos) / window_nanos + 1;
+      int64_t reports =
+          std::min(idle_windows, max_idle_windows - idle_windows_reported);
+      for (int64_t i = 0; i < reports; ++i) {
+        report(next_report_nanos + i * window_nanos);
+      }
+      idle_windows_reported += reports;
+      next_report_nanos += idle_windows * window_nanos;
+    }
+  }
+};
+
+// Incremental TWAP computation. Rows must arrive in nondecreasing timestamp
+// order, either one at a time or as column batches. Finish() reports the
+// final window.
+template <typename OutputRowSink> class TWAPEngine {
+  OutputRowSink &output_row_sink;
+  TWAPWindowClock clock;
+  TWAPSeriesTable series_table;
+  const TWAPSeriesFilter series_filter;
+  // Only checked in debug builds; see ReorderBuffer for unordered input
+  int64_t last_ts_nanos = std::numeric_limits<int64_t>::min();
+
+  void Report(int64_t report_nanos) {
+    series_table.ForEachSeries([&](uint32_t series) {
+      if (series_table.Empty(series)) {
+        return;
+      }
+      output_row_sink(OutputRow{
+          report_nanos, series_table.ProviderId(series),
+          series_table.SymbolId(series),
+          series_table.ComputeTWAP(series, report_nanos)});
+    });
+  }
+
+  void AdvanceTo(int64_t ts_nanos) {
+    clock.AdvanceTo(ts_nanos,
+                    [&](int64_t report_nanos) { Report(report_nanos); });
+  }
+
+public:
+  TWAPEngine(OutputRowSink &output_row_sink, const TWAPOptions &options)
+      : output_row_sink(output_row_sink), clock(options),
+        series_filter(options.series_filter) {}
+
+  void AddRow(const InputRow &input_row) {
+    if (!series_filter.Matches(input_row.provider_id, input_row.symbol_id)) {
+      return;
+    }
+    assert(input_row.ts_nanos >= last_ts_nanos);
+    last_ts_nanos = input_row.ts_nanos;
+    AdvanceTo(input_row.ts_nanos);
+    series_table.AddPrice(
+        series_table.FindOrAddSeries(input_row.provider_id,
+                                     input_row.symbol_id),
+        input_row.ts_nanos, input_row.price);
+  }
+
+  void AddColumns(const InputColumns &columns) {
+    if (!series_filter.SelectsAll()) {
+      for (size_t i = 0; i < columns.size(); ++i) {
+        AddRow(columns[i]);
+      }
+      return;
+    }
+    const int64_t *ts_nanos = columns.ts_nanos.data();
+    const uint32_t *provider_ids = columns.provider_ids.data();
+    const uint32_t *symbol_ids = columns.symbol_ids.data();
+    const double *prices = columns.prices.data();
+    const size_t n = columns.size();
+    assert(std::is_sorted(ts_nanos, ts_nanos + n));
+    assert(n == 0 || ts_nanos[0] >= last_ts_nanos);
+    if (n > 0) {
+      last_ts_nanos = ts_nanos[n - 1];
+    }
+
+    for (size_t i = 0; i < n;) {
+      AdvanceTo(ts_nanos[i]);
+      // Rows before the next window boundary need no boundary check.
+      size_t window_end =
+          std::partition_point(
+              ts_nanos + i, ts_nanos + n,
+              [&](int64_t ts) { return ts < clock.next_report_nanos; }) -
+          ts_nanos;
+      for (; i < window_end; ++i) {
+        series_table.AddPrice(
+            series_table.FindOrAddSeries(provider_ids[i], symbol_ids[i]),
+            ts_nanos[i], prices[i]);
+      }
+    }
+  }
+
+  // Report the windows ending at or before ts_nanos without waiting for a
+  // row past them, once the input is known to hold no more rows before
+  // ts_nanos, e.g. a live stream that has been quiet
+  void CloseWindowsThrough(int64_t ts_nanos) {
+    clock.CloseThrough(ts_nanos,
+                       [&](int64_t report_nanos) { Report(report_nanos); });
+  }
+
+  // The end of the window open for input; 0 before any input
+  int64_t NextReportNanos() const { return clock.next_report_nanos; }
+
+  void Finish() {
+    // Windows closed by CloseWindowsThrough were already reported
+    if (clock.window_has_input) {
+      Report(clock.next_report_nanos);
+    }
+  }
 };
 
+// The input_row_provider is called with an acceptor that takes either an
+// InputRow or an InputColumns batch.
+template <typename InputRowProvider, typename OutputRowSink>
+void ComputeTWAP(InputRowProvider &&input_row_provider,
+                 OutputRowSink &&output_row_sink, const TWAPOptions &options) {
+  TWAPEngine<std::remove_reference_t<OutputRowSink>> engine(output_row_sink,
+                                                            options);
+  input_row_provider([&](const auto &input) {
+    if constexpr (std::is_same_v<std::remove_cvref_t<decltype(input)>,
+                                 InputColumns>) {
+      engine.AddColumns(input);
+    } else {
+      engine.AddRow(input);
+    }
+  });
+  engine.Finish();
+}
+
 template <typename InputRowProvider, typename OutputRowSink>
 void ComputeTWAP(InputRowProvider &&input_row_provider,
                  OutputRowSink &&output_row_sink,
                  int64_t window_nanos = 15ll * 1000 * 1000 * 1000) {
-  std::vector<std::vector<TWAPState>> provider_to_symbol_to_twap;
-  int64_t next_report_nanos = 0;
+  ComputeTWAP(std::forward<InputRowProvider>(input_row_provider),
+              std::forward<OutputRowSink>(output_row_sink),
+              TWAPOptions{.window_nanos = window_nanos});
+}
 
-  auto Report = [&]() {
-    for (uint32_t provider = 0; provider < provider_to_symbol_to_twap.size();
-         ++provider) {
-      for (uint32_t symbol = 0;
-           symbol < provider_to_symbol_to_twap[provider].size(); ++symbol) {
-        auto &twap_state = provider_to_symbol_to_twap[provider][symbol];
-        if (twap_state.Empty()) {
-          continue;
+// Most window lengths in one MultiWindowTWAPEngine, one bit each in a
+// schedule entry
+inline constexpr size_t kMaxTWAPWindows = 64;
+// Most boundaries in the schedule of one period of a MultiWindowTWAPEngine
+inline constexpr int64_t kMaxTWAPScheduleBoundaries = 1 << 20;
+
+// Throws std::invalid_argument unless window_nanos can be computed together
+// by a MultiWindowTWAPEngine, e.g. so that a caller can check them before
+// opening any output. Returns the period over which their boundaries repeat.
+inline int64_t
+CheckTWAPWindowLengths(const std::vector<int64_t> &window_nanos) {
+  if (window_nanos.empty() || window_nanos.size() > kMaxTWAPWindows) {
+    throw std::invalid_argument(
+        "MultiWindowTWAPEngine needs between 1 and 64 window lengths");
+  }
+  int64_t period_nanos = 1;
+  for (int64_t nanos : window_nanos) {
+    if (nanos <= 0) {
+      throw std::invalid_argument("Window lengths must be positive");
+    }
+    int64_t factor = nanos / std::gcd(period_nanos, nanos);
+    if (period_nanos > std::numeric_limits<int64_t>::max() / factor) {
+      throw std::invalid_argument(
+          "Window lengths have no common period that fits in int64");
+    }
+    period_nanos *= factor;
+  }
+  std::vector<int64_t> sorted_nanos = window_nanos;
+  std::sort(sorted_nanos.begin(), sorted_nanos.end());
+  if (std::adjacent_find(sorted_nanos.begin(), sorted_nanos.end()) !=
+      sorted_nanos.end()) {
+    throw std::invalid_argument("Window lengths must be distinct");
+  }
+  int64_t boundaries = 0;
+  for (int64_t nanos : window_nanos) {
+    boundaries += period_nanos / nanos;
+    if (boundaries > kMaxTWAPScheduleBoundaries) {
+      throw std::invalid_argument(
+          "Window lengths have too many boundaries in their common period");
+    }
+  }
+  return period_nanos;
+}
+
+// Incremental TWAP computation over several window lengths in one pass. The
+// series state is shared, so a row is added once however many lengths there
+// are. The TWAP reported at a boundary covers everything up to it, so the
+// series' windows are closed and their partial sums folded in once per
+// boundary, with the result going to every length that reports there. Where
+// the lengths divide one another, the coarser boundaries are among the
+// finest ones and cost no extra close: a 1m report is the roll-up of its 15s
+// windows. Lengths that do not divide each other add their own boundaries.
+//
+// The boundaries of all the lengths repeat with a period of their least
+// common multiple, so they are merged once, up front, into a schedule of
+// the boundaries in one period and which lengths end a window at each.
+// Moving to the next boundary is then a step along the schedule. Each
+// length follows the max_idle_windows policy of TWAPWindowClock on its own.
+//
+// output_row_sink(window, row) gets the reports of window_nanos[window],
+// each in the order TWAPEngine with that window length would report them.
+template <typename OutputRowSink> class MultiWindowTWAPEngine {
+public:
+  MultiWindowTWAPEngine(OutputRowSink &output_row_sink,
+                        const std::vector<int64_t> &window_nanos,
+                        const TWAPOptions &options)
+      : output_row_sink(output_row_sink),
+        max_idle_windows(options.max_idle_windows),
+        window_has_input(window_nanos.size(), false),
+        idle_windows_reported(window_nanos.size(), 0),
+        series_filter(options.series_filter) {
+    assert(max_idle_windows >= 0);
+    BuildSchedule(window_nanos);
+    reporting.reserve(window_nanos.size());
+  }
+
+  void AddRow(const InputRow &input_row) {
+    if (!series_filter.Matches(input_row.provider_id, input_row.symbol_id)) {
+      return;
+    }
+    assert(input_row.ts_nanos >= last_ts_nanos);
+    last_ts_nanos = input_row.ts_nanos;
+    if (input_row.ts_nanos >= next_boundary_nanos) [[unlikely]] {
+      AdvanceTo(input_row.ts_nanos);
+    }
+    series_table.AddPrice(
+        series_table.FindOrAddSeries(input_row.provider_id,
+                                     input_row.symbol_id),
+        input_row.ts_nanos, input_row.price);
+  }
+
+  void AddColumns(const InputColumns &columns) {
+    if (!series_filter.SelectsAll()) {
+      for (size_t i = 0; i < columns.size(); ++i) {
+        AddRow(columns[i]);
+      }
+      return;
+    }
+    const int64_t *ts_nanos = columns.ts_nanos.data();
+    const uint32_t *provider_ids = columns.provider_ids.data();
+    const uint32_t *symbol_ids = columns.symbol_ids.data();
+    const double *prices = columns.prices.data();
+    const size_t n = columns.size();
+    assert(std::is_sorted(ts_nanos, ts_nanos + n));
+    assert(n == 0 || ts_nanos[0] >= last_ts_nanos);
+    if (n > 0) {
+      last_ts_nanos = ts_nanos[n - 1];
+    }
+
+    for (size_t i = 0; i < n;) {
+      if (ts_nanos[i] >= next_boundary_nanos) {
+        AdvanceTo(ts_nanos[i]);
+      }
+      // Rows before the next boundary need no boundary check.
+      size_t window_end =
+          std::partition_point(
+              ts_nanos + i, ts_nanos + n,
+              [&](int64_t ts) { return ts < next_boundary_nanos; }) -
+          ts_nanos;
+      for (; i < window_end; ++i) {
+        series_table.AddPrice(
+            series_table.FindOrAddSeries(provider_ids[i], symbol_ids[i]),
+            ts_nanos[i], prices[i]);
+      }
+    }
+  }
+
+  // Report the open window of each length, in time order
+  void Finish() {
+    if (!started) {
+      return;
+    }
+    while (std::find(window_has_input.begin(), window_has_input.end(),
+                     true) != window_has_input.end()) {
+      reporting.clear();
+      for (uint64_t windows = schedule[next_entry].windows; windows != 0;
+           windows &= windows - 1) {
+        size_t window = std::countr_zero(windows);
+        if (window_has_input[window]) {
+          window_has_input[window] = false;
+          reporting.push_back(window);
         }
-        output_row_sink(OutputRow{next_report_nanos, provider, symbol,
-                                  twap_state.ComputeTWAP(next_report_nanos)});
       }
+      if (!reporting.empty()) {
+        Report(next_boundary_nanos);
+      }
+      NextBoundary();
     }
-    next_report_nanos += window_nanos;
+  }
+
+private:
+  // A boundary of the schedule, offset_nanos into its period, and the bit of
+  // each length that ends a window there
+  struct ScheduleEntry {
+    int64_t offset_nanos;
+    uint64_t windows;
   };
 
-  input_row_provider([&](const InputRow &input_row) {
-    if (next_report_nanos == 0) {
-      next_report_nanos =
-          ((input_row.ts_nanos + window_nanos) / window_nanos) * window_nanos;
-    } else
-      while (input_row.ts_nanos >= next_report_nanos) {
-        Report();
+  OutputRowSink &output_row_sink;
+  const int64_t max_idle_windows;
+  // The boundaries of one period in time order. The last is at the end of
+  // the period, where every length ends a window.
+  std::vector<ScheduleEntry> schedule;
+  int64_t period_nanos = 0;
+  // The next boundary is at period_start_nanos +
+  // schedule[next_entry].offset_nanos
+  int64_t period_start_nanos = 0;
+  size_t next_entry = 0;
+  // Rows before it need no boundary processed. 0 before any input.
+  int64_t next_boundary_nanos = 0;
+  bool started = false;
+  // Per length, as in TWAPWindowClock: whether the window it has open has
+  // input, and the idle windows reported since its last window with input
+  std::vector<uint8_t> window_has_input;
+  std::vector<int64_t> idle_windows_reported;
+  // Lengths with a window still to report before the next input
+  size_t live_windows = 0;
+  // The lengths reporting at the boundary being reported
+  std::vector<uint32_t> reporting;
+  TWAPSeriesTable series_table;
+  const TWAPSeriesFilter series_filter;
+  // Only checked in debug builds
+  int64_t last_ts_nanos = std::numeric_limits<int64_t>::min();
+
+  void BuildSchedule(const std::vector<int64_t> &window_nanos) {
+    period_nanos = CheckTWAPWindowLengths(window_nanos);
+    for (size_t window = 0; window < window_nanos.size(); ++window) {
+      for (int64_t offset = window_nanos[window]; offset <= period_nanos;
+           offset += window_nanos[window]) {
+        schedule.push_back(ScheduleEntry{offset, uint64_t(1) << window});
       }
-    if (input_row.provider_id >= provider_to_symbol_to_twap.size()) {
-      provider_to_symbol_to_twap.resize(input_row.provider_id + 1);
     }
-    if (input_row.symbol_id >=
-        provider_to_symbol_to_twap[input_row.provider_id].size()) {
-      provider_to_symbol_to_twap[input_row.provider_id].resize(
-          input_row.symbol_id + 1);
+    std::sort(schedule.begin(), schedule.end(),
+              [](const ScheduleEntry &a, const ScheduleEntry &b) {
+                return a.offset_nanos < b.offset_nanos;
+              });
+    // Merge the entries of lengths that share a boundary
+    size_t merged = 0;
+    for (const ScheduleEntry &entry : schedule) {
+      ScheduleEntry *last = merged > 0 ? &schedule[merged - 1] : nullptr;
+      if (last != nullptr && last->offset_nanos == entry.offset_nanos) {
+        last->windows |= entry.windows;
+      } else {
+        schedule[merged++] = entry;
+      }
     }
-    provider_to_symbol_to_twap[input_row.provider_id][input_row.symbol_id]
-        .AddPrice(input_row.ts_nanos, input_row.price);
-  });
+    schedule.resize(merged);
+  }
+
+  // Move to the first boundary after ts_nanos
+  void SkipTo(int64_t ts_nanos) {
+    period_start_nanos = ts_nanos / period_nanos * period_nanos;
+    next_entry = std::upper_bound(schedule.begin(), schedule.end(),
+                                  ts_nanos - period_start_nanos,
+                                  [](int64_t offset, const ScheduleEntry &e) {
+                                    return offset < e.offset_nanos;
+                                  }) -
+                 schedule.begin();
+    next_boundary_nanos =
+        period_start_nanos + schedule[next_entry].offset_nanos;
+  }
 
-  Report();
+  void NextBoundary() {
+    if (++next_entry == schedule.size()) {
+      next_entry = 0;
+      period_start_nanos += period_nanos;
+    }
+    next_boundary_nanos =
+        period_start_nanos + schedule[next_entry].offset_nanos;
+  }
+
+  void ReportWindow(int64_t report_nanos, size_t window) {
+    series_table.ForEachSeries([&](uint32_t series) {
+      if (series_table.Empty(series)) {
+        return;
+      }
+      output_row_sink(
+          window, OutputRow{report_nanos, series_table.ProviderId(series),
+                            series_table.SymbolId(series),
+                            series_table.ComputeTWAP(series, report_nanos)});
+    });
+  }
+
+  void ReportWindows(int64_t report_nanos) {
+    series_table.ForEachSeries([&](uint32_t series) {
+      if (series_table.Empty(series)) {
+        return;
+      }
+      OutputRow row{report_nanos, series_table.ProviderId(series),
+                    series_table.SymbolId(series),
+                    series_table.ComputeTWAP(series, report_nanos)};
+      for (uint32_t window : reporting) {
+        output_row_sink(window, row);
+      }
+    });
+  }
+
+  // Report at the boundary being reported. Most boundaries end a window of
+  // the shortest length alone, so that case gets a loop of its own.
+  void Report(int64_t report_nanos) {
+    if (reporting.size() == 1) {
+      ReportWindow(report_nanos, reporting[0]);
+    } else {
+      ReportWindows(report_nanos);
+    }
+  }
+
+  // Report every boundary at or before ts_nanos, then count ts_nanos as
+  // input to the window each length has open
+  void AdvanceTo(int64_t ts_nanos) {
+    if (!started) {
+      started = true;
+      SkipTo(ts_nanos);
+    }
+    while (next_boundary_nanos <= ts_nanos) {
+      if (live_windows == 0) {
+        // Nothing to report before the next input, so skip the rest of
+        // the idle gap at once
+        SkipTo(ts_nanos);
+        break;
+      }
+      reporting.clear();
+      for (uint64_t windows = schedule[next_entry].windows; windows != 0;
+           windows &= windows - 1) {
+        size_t window = std::countr_zero(windows);
+        if (window_has_input[window]) {
+          window_has_input[window] = false;
+          idle_windows_reported[window] = 0;
+        } else if (idle_windows_reported[window] < max_idle_windows) {
+          idle_windows_reported[window]++;
+        } else {
+          continue;
+        }
+        reporting.push_back(window);
+        if (idle_windows_reported[window] == max_idle_windows) {
+          live_windows--;
+        }
+      }
+      if (!reporting.empty()) {
+        Report(next_boundary_nanos);
+      }
+      NextBoundary();
+    }
+    std::fill(window_has_input.begin(), window_has_input.end(), true);
+    live_windows = window_has_input.size();
+  }
+};
+
+// Compute the TWAP over each of window_nanos in one pass over the input, as
+// MultiWindowTWAPEngine does; options.window_nanos is not used.
+template <typename InputRowProvider, typename OutputRowSink>
+void ComputeMultiWindowTWAP(InputRowProvider &&input_row_provider,
+                            OutputRowSink &&output_row_sink,
+                            const std::vector<int64_t> &window_nanos,
+                            const TWAPOptions &options = {}) {
+  MultiWindowTWAPEngine<std::remove_reference_t<OutputRowSink>> engine(
+      output_row_sink, window_nanos, options);
+  input_row_provider([&](const auto &input) {
+    if constexpr (std::is_same_v<std::remove_cvref_t<decltype(input)>,
+                                 InputColumns>) {
+      engine.AddColumns(input);
+    } else {
+      engine.AddRow(input);
+    }
+  });
+  engine.Finish();
 }
 
 struct NameToId {
@@ -0,0 +1,118 @@
+#include "partvwap_feather.hh"
+#include "partvwap.hh"
+#include "partvwap_parquet.hh"
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/ipc/api.h>
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace {
+std::shared_ptr<arrow::Schema> FeatherSchema() {
+  return arrow::schema(
+      {arrow::field("provider", arrow::dictionary(arrow::int32(),
+                                                  arrow::utf8())),
+       arrow::field("symbol", arrow::dictionary(arrow::int32(), arrow::utf8())),
+       arrow::field("timestamp", arrow::int64()),
+       arrow::field("price", arrow::float64())});
+}
+
+// A buffer over values that outlive the arrays built on it, without copying
+template <typename T>
+std::shared_ptr<arrow::Buffer> WrapSpan(std::span<const T> values) {
+  return std::make_shared<arrow::Buffer>(
+      reinterpret_cast<const uint8_t *>(values.data()),
+      int64_t(values.size_bytes()));
+}
+
+// A dictionary of all the names of a NameToId in id order. It is rebuilt
+// only when names were added, so the writer sees either the same array or an
+// extension of it, which it writes as a delta.
+class FeatherDictionary {
+public:
+  arrow::Result<std::shared_ptr<arrow::Array>> Get(const NameToId &names) {
+    if (dictionary == nullptr ||
+        dictionary->length() != int64_t(names.id_to_name.size())) {
+      arrow::StringBuilder builder;
+      ARROW_RETURN_NOT_OK(builder.AppendValues(names.id_to_name));
+      ARROW_RETURN_NOT_OK(builder.Finish(&dictionary));
+    }
+    return dictionary;
+  }
+
+private:
+  std::shared_ptr<arrow::Array> dictionary;
+};
+
+std::shared_ptr<arrow::Array>
+DictionaryColumn(std::span<const uint32_t> ids,
+                 const std::shared_ptr<arrow::Array> &dictionary) {
+  return std::make_shared<arrow::DictionaryArray>(
+      arrow::dictionary(arrow::int32(), arrow::utf8()),
+      std::make_shared<arrow::Int32Array>(int64_t(ids.size()), WrapSpan(ids)),
+      dictionary);
+}
+} // namespace
+
+arrow::Status
+WriteFeatherFromParquetFiles(const std::vector<std::string> &parquet_files,
+                             const std::string &feather_filename,
+                             const ParquetReadOptions &options) {
+  NameToId providers;
+  NameToId symbols;
+  ARROW_ASSIGN_OR_RAISE(auto outfile,
+                        arrow::io::FileOutputStream::Open(feather_filename));
+  auto write_options = arrow::ipc::IpcWriteOptions::Defaults();
+  // The IPC file format only allows a dictionary to change by extension
+  write_options.emit_dictionary_deltas = true;
+  ARROW_ASSIGN_OR_RAISE(
+      auto writer,
+      arrow::ipc::MakeFileWriter(outfile, FeatherSchema(), write_options));
+
+  FeatherDictionary provider_dictionary;
+  FeatherDictionary symbol_dictionary;
+  ARROW_RETURN_NOT_OK(ReadManyParquetFileColumns(
+      parquet_files,
+      [&](const InputColumns &columns) -> arrow::Status {
+        ARROW_ASSIGN_OR_RAISE(auto provider_names,
+                              provider_dictionary.Get(providers));
+        ARROW_ASSIGN_OR_RAISE(auto symbol_names,
+                              symbol_dictionary.Get(symbols));
+        // The columns are only borrowed until the batch is written
+        auto batch = arrow::RecordBatch::Make(
+            FeatherSchema(), columns.size(),
+            {DictionaryColumn(columns.provider_ids, provider_names),
+             DictionaryColumn(columns.symbol_ids, symbol_names),
+             std::make_shared<arrow::Int64Array>(
+                 int64_t(columns.size()), WrapSpan(columns.ts_nanos)),
+             std::make_shared<arrow::DoubleArray>(int64_t(columns.size()),
+                                                  WrapSpan(columns.prices))});
+        return writer->WriteRecordBatch(*batch);
+      },
+      providers, symbols, options));
+  ARROW_RETURN_NOT_OK(writer->Close());
+  return outfile->Close();
+}
+
+arrow::Status
+ReadFeatherToInputRows(const std::string &filename,
+                       std::function<arrow::Status(ParquetChunk)> f,
+                       NameToId &providers, NameToId &symbols) {
+  ARROW_ASSIGN_OR_RAISE(auto file, arrow::io::MemoryMappedFile::Open(
+                                       filename, arrow::io::FileMode::READ));
+  // Reads of an uncompressed file are slices of the mapping, so the batches
+  // are never copied
+  ARROW_ASSIGN_OR_RAISE(auto reader,
+                        arrow::ipc::RecordBatchFileReader::Open(file));
+  ParquetBatchRemap remap;
+  for (int i = 0; i < reader->num_record_batches(); i++) {
+    ARROW_ASSIGN_OR_RAISE(auto batch, reader->ReadRecordBatch(i));
+    ARROW_RETURN_NOT_OK(
+        ParquetChunkFromBatch(*batch, f, providers, symbols, remap));
+  }
+  return arrow::Status::OK();
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "partvwap.hh"
+#include "partvwap_parquet.hh"
+#include <arrow/api.h>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Arrow IPC (Feather v2) files hold the same columns as the parquet input,
+// uncompressed, so a memory mapped file is read without decoding: the
+// columns handed to the engine point straight into the mapping. They trade
+// disk space for decode time, as a tier next to parquet and turbo files.
+//
+// The provider and symbol columns are dictionary encoded over all the names
+// of the file in id order, extended with a delta dictionary whenever a new
+// name appears, so reading one file into empty NameToIds needs no index
+// translation.
+
+// Write the rows of parquet files, in order, to one Arrow IPC file with a
+// record batch per parquet batch
+arrow::Status
+WriteFeatherFromParquetFiles(const std::vector<std::string> &parquet_files,
+                             const std::string &feather_filename,
+                             const ParquetReadOptions &options = {});
+
+// Memory map an Arrow IPC file with provider, symbol, timestamp and price
+// columns, calling f with each record batch. The chunk points into the
+// mapping, which stays open until f returns.
+arrow::Status
+ReadFeatherToInputRows(const std::string &filename,
+                       std::function<arrow::Status(ParquetChunk)> f,
+                       NameToId &providers, NameToId &symbols);
+
+// Read Arrow IPC files in order, calling f with an InputColumns view of each
+// record batch
+template <typename FilenameContainer, typename ColumnsCallback>
+arrow::Status ReadManyFeatherFileColumns(const FilenameContainer &filenames,
+                                         ColumnsCallback &&f,
+                                         NameToId &providers,
+                                         NameToId &symbols) {
+  auto chunk_callback = [&](ParquetChunk chunk) -> arrow::Status {
+    InputColumns columns = chunk.Columns();
+    if constexpr (std::is_void_v<decltype(f(columns))>) {
+      f(columns);
+    } else {
+      ARROW_RETURN_NOT_OK(f(columns));
+    }
+    return arrow::Status::OK();
+  };
+  for (const auto &filename : filenames) {
+    ARROW_RETURN_NOT_OK(
+        ReadFeatherToInputRows(filename, chunk_callback, providers, symbols));
+  }
+  return arrow::Status::OK();
+}
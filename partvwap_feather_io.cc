@@ -0,0 +1,142 @@
+#include "partvwap.hh"
+#include "partvwap_feather.hh"
+#include "partvwap_parallel.hh"
+#include "partvwap_parquet.hh"
+#include "perf_counter_scope.hh"
+
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/time/time.h>
+#include <arrow/api.h>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+ABSL_FLAG(int64_t, max_idle_windows, std::numeric_limits<int64_t>::max(),
+          "Number of windows without input to report after a window with "
+          "input; the rest of an idle gap is skipped");
+ABSL_FLAG(int, compute_threads, 1,
+          "Number of threads to partition the TWAP series over");
+ABSL_FLAG(std::string, output_compression, "uncompressed",
+          "Compression codec of the output parquet file, e.g. snappy or zstd "
+          "where Arrow was built with it");
+ABSL_FLAG(int64_t, output_row_group_rows, 1024 * 1024,
+          "Rows per row group of the output parquet file");
+ABSL_FLAG(int, output_queue_row_groups, 2,
+          "Number of output row groups queued for the background writer "
+          "before the computation waits for it");
+
+int main(int argc, char **argv) {
+  std::vector<char *> args = absl::ParseCommandLine(argc, argv);
+
+  if (args.size() != 3) {
+    std::cerr << "Usage: " << args[0] << " <input_feather_file> <output_file>"
+              << std::endl;
+    std::cerr << "This program memory maps a feather file written by "
+                 "parquet_to_feather, computes the TWAP for each provider "
+                 "and symbol combination, and writes the results to "
+                 "<output_file> in parquet format."
+              << std::endl;
+    return 1;
+  }
+  if (absl::GetFlag(FLAGS_max_idle_windows) < 0) {
+    std::cerr << "Error: --max_idle_windows must not be negative" << std::endl;
+    return 1;
+  }
+
+  std::string input_feather_file = args[1];
+  std::string output_file = args[2];
+
+  if (!std::filesystem::exists(input_feather_file)) {
+    std::cerr << "Error: Input feather file does not exist: "
+              << input_feather_file << std::endl;
+    return 1;
+  }
+
+  NameToId providers;
+  NameToId symbols;
+  auto output_compression = arrow::util::Codec::GetCompressionType(
+      absl::GetFlag(FLAGS_output_compression));
+  if (!output_compression.ok()) {
+    std::cerr << "Error: Unknown --output_compression: "
+              << output_compression.status().ToString() << std::endl;
+    return 1;
+  }
+  ParquetWriteOptions write_options{
+      .row_group_rows = absl::GetFlag(FLAGS_output_row_group_rows),
+      .compression = *output_compression};
+  AsyncParquetOutputWriter writer(
+      providers, symbols, write_options,
+      absl::GetFlag(FLAGS_output_queue_row_groups));
+
+  auto open_status = writer.OpenOutputFile(output_file);
+  if (!open_status.ok()) {
+    std::cerr << "Error opening output file '" << output_file
+              << "': " << open_status.ToString() << std::endl;
+    return 1;
+  }
+
+  arrow::Status read_status;
+  arrow::Status write_status;
+  absl::Time start_time = absl::Now();
+  absl::Time end_time;
+  int64_t input_rows = 0;
+  int64_t output_rows = 0;
+  {
+    PerfCounterScope scope("ComputeTWAP");
+    auto input_row_provider = [&](auto &&row_acceptor) {
+      read_status &= ReadManyFeatherFileColumns(
+          std::vector<std::string>{input_feather_file},
+          [&](const InputColumns &columns) {
+            row_acceptor(columns);
+            input_rows += columns.size();
+          },
+          providers, symbols);
+    };
+    auto output_row_sink = [&](const OutputRow &row) {
+      output_rows++;
+      write_status &= writer.AppendOutputRow(row);
+    };
+    TWAPOptions options{.max_idle_windows =
+                            absl::GetFlag(FLAGS_max_idle_windows)};
+    if (absl::GetFlag(FLAGS_compute_threads) > 1) {
+      ComputeTWAPParallel(input_row_provider, output_row_sink, options,
+                          absl::GetFlag(FLAGS_compute_threads));
+    } else {
+      ComputeTWAP(input_row_provider, output_row_sink, options);
+    }
+    scope.IncrementNumRows(input_rows);
+    end_time = absl::Now();
+  }
+  if (!write_status.ok()) {
+    std::cerr << "Error writing output file '" << output_file
+              << "': " << write_status.ToString() << std::endl;
+    return 1;
+  }
+
+  if (!read_status.ok()) {
+    std::cerr << "Error reading feather file '" << input_feather_file
+              << "': " << read_status.ToString() << std::endl;
+    return 1;
+  }
+
+  auto close_status = writer.CloseOutputFile();
+  if (!close_status.ok()) {
+    std::cerr << "Error closing output file '" << output_file
+              << "': " << close_status.ToString() << std::endl;
+    return 1;
+  }
+
+  std::cout << "Successfully processed " << input_rows << " rows; wrote "
+            << output_rows << " results to " << output_file << std::endl;
+  std::cout << "Time taken to compute TWAP: "
+            << absl::FormatDuration(end_time - start_time) << std::endl
+            << "Per input row " << (end_time - start_time) / input_rows
+            << std::endl
+            << "Total seconds " << absl::ToDoubleSeconds(end_time - start_time)
+            << std::endl;
+
+  return 0;
+}
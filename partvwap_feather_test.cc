@@ -0,0 +1,149 @@
+#include "partvwap.hh"
+#include "partvwap_feather.hh"
+#include "partvwap_parquet.hh"
+#include "temp_file_for_test.hh"
+#include <absl/strings/str_cat.h>
+#include <arrow/api.h>
+#include <arrow/testing/gtest_util.h>
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+namespace {
+// Parquet files that each add providers and symbols the earlier ones did not
+// have, so the feather dictionaries grow by deltas
+struct ParquetFilesForTest {
+  std::vector<TempFileForTest> tmp_files;
+  std::vector<std::string> filenames;
+  std::vector<InputRow> rows;
+  NameToId providers;
+  NameToId symbols;
+
+  explicit ParquetFilesForTest(size_t num_files, int rows_per_file)
+      : tmp_files(num_files) {
+    int64_t ts = 1000000000000;
+    for (size_t file = 0; file < num_files; file++) {
+      std::vector<InputRow> file_rows;
+      for (int i = 0; i < rows_per_file; i++) {
+        ts += 1000000;
+        file_rows.push_back(InputRow{
+            ts,
+            providers.IDFromName(absl::StrCat("provider", file, "_", i % 3)),
+            symbols.IDFromName(absl::StrCat("symbol", (file + i) % 7)),
+            100.0 + file + i / 1000.0});
+      }
+      EXPECT_OK(WriteParquetFromInputRows(tmp_files[file].tmp_filename,
+                                          file_rows, providers, symbols));
+      filenames.push_back(tmp_files[file].tmp_filename);
+      rows.insert(rows.end(), file_rows.begin(), file_rows.end());
+    }
+  }
+};
+} // namespace
+
+TEST(ReadManyFeatherFileColumns, ReadsConvertedParquetFiles) {
+  ParquetFilesForTest parquet(4, 1000);
+  TempFileForTest feather_file;
+  ASSERT_OK(WriteFeatherFromParquetFiles(
+      parquet.filenames, feather_file.tmp_filename,
+      ParquetReadOptions{.batch_size = 300}));
+
+  NameToId providers;
+  NameToId symbols;
+  std::vector<InputRow> read;
+  int batches = 0;
+  ASSERT_OK(ReadManyFeatherFileColumns(
+      std::vector<std::string>{feather_file.tmp_filename},
+      [&](const InputColumns &columns) {
+        batches++;
+        for (size_t i = 0; i < columns.size(); i++) {
+          read.push_back(columns[i]);
+        }
+      },
+      providers, symbols));
+  EXPECT_GE(batches, 4 * 1000 / 300);
+  // The dictionaries hold every name in first seen order
+  EXPECT_EQ(providers.id_to_name, parquet.providers.id_to_name);
+  EXPECT_EQ(symbols.id_to_name, parquet.symbols.id_to_name);
+  EXPECT_THAT(read, testing::ElementsAreArray(parquet.rows));
+}
+
+TEST(ReadManyFeatherFileColumns, RemapsIntoExistingNames) {
+  ParquetFilesForTest parquet(2, 100);
+  TempFileForTest feather_file;
+  ASSERT_OK(WriteFeatherFromParquetFiles(parquet.filenames,
+                                         feather_file.tmp_filename));
+
+  NameToId providers;
+  NameToId symbols;
+  providers.IDFromName("other_provider");
+  symbols.IDFromName("symbol6");
+  std::vector<InputRow> read;
+  ASSERT_OK(ReadManyFeatherFileColumns(
+      std::vector<std::string>{feather_file.tmp_filename},
+      [&](const InputColumns &columns) {
+        for (size_t i = 0; i < columns.size(); i++) {
+          read.push_back(columns[i]);
+        }
+      },
+      providers, symbols));
+  ASSERT_EQ(read.size(), parquet.rows.size());
+  for (size_t i = 0; i < read.size(); i++) {
+    EXPECT_EQ(providers[read[i].provider_id],
+              parquet.providers[parquet.rows[i].provider_id]);
+    EXPECT_EQ(symbols[read[i].symbol_id],
+              parquet.symbols[parquet.rows[i].symbol_id]);
+    EXPECT_EQ(read[i].ts_nanos, parquet.rows[i].ts_nanos);
+    EXPECT_EQ(read[i].price, parquet.rows[i].price);
+  }
+}
+
+TEST(ReadManyFeatherFileColumns, ReportsMissingFile) {
+  NameToId providers;
+  NameToId symbols;
+  EXPECT_FALSE(ReadManyFeatherFileColumns(
+                   std::vector<std::string>{"/nonexistent/file.feather"},
+                   [](const InputColumns &columns) {}, providers, symbols)
+                   .ok());
+}
+
+static void BM_ComputeTWAPThroughFeather(benchmark::State &state) {
+  TempFileForTest parquet_file;
+  TempFileForTest feather_file;
+  NameToId providers;
+  NameToId symbols;
+  std::vector<InputRow> input_rows;
+  input_rows.reserve(1000000);
+  for (int64_t i = 0; i < input_rows.capacity(); i++) {
+    input_rows.push_back(
+        InputRow{1000000000000 + i * 1000000,
+                 providers.IDFromName("provider" + std::to_string(i % 10)),
+                 symbols.IDFromName("symbol" + std::to_string(i % 100)),
+                 100.0 + (i % 10)});
+  }
+  ASSERT_OK(WriteParquetFromInputRows(parquet_file.tmp_filename, input_rows,
+                                      providers, symbols));
+  ASSERT_OK(WriteFeatherFromParquetFiles(
+      std::vector<std::string>{parquet_file.tmp_filename},
+      feather_file.tmp_filename));
+
+  for (auto _ : state) {
+    double sum_twap = 0;
+    ComputeTWAP(
+        [&](auto &&f) {
+          ASSERT_OK(ReadManyFeatherFileColumns(
+              std::vector<std::string>{feather_file.tmp_filename}, f,
+              providers, symbols));
+        },
+        [&](const OutputRow &output_row) { sum_twap += output_row.twap; });
+    benchmark::DoNotOptimize(sum_twap);
+  }
+
+  state.SetItemsProcessed(state.iterations() * input_rows.size());
+}
+BENCHMARK(BM_ComputeTWAPThroughFeather);
+
+TEST(Benchmarks, RunAll) { ::benchmark::RunSpecifiedBenchmarks("all"); }
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "partvwap.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Merges inputs that are each in nondecreasing timestamp order but overlap
+// one another, e.g. one file per venue for the same day, into one stream in
+// timestamp order without sorting or rewriting them first.
+//
+// Each source is pulled one batch at a time through Next(), which returns
+// its next InputColumns batch, valid until the following call, or an empty
+// batch once it is exhausted. The current timestamp of every source sits in
+// a loser tree: each internal node holds the source that lost the match
+// below it, so after the winner advances one pass from its leaf to the root,
+// log2(k) comparisons against a flat array of keys, finds the next winner.
+//
+// The winner is not advanced one row at a time. The smallest of the losers
+// on its path is the runner-up, and all of the winner's rows before the
+// runner-up's timestamp are handed on as a single slice of its batch. Inputs
+// that interleave coarsely thus cost one tree pass per run of rows rather
+// than per row, and the slices point into the sources' own batches. Equal
+// timestamps are ordered by source index.
+template <typename Source> class KWayMerge {
+public:
+  explicit KWayMerge(std::vector<Source> &sources)
+      : sources(sources), k(sources.size()), batches(k), offsets(k, 0),
+        head_ts_nanos(k), exhausted(k, false), tree(std::max<size_t>(k, 1)) {}
+
+  // Calls f with slices of the sources' batches in merged order, until the
+  // sources are exhausted or f returns false
+  template <typename ColumnsCallback> void Run(ColumnsCallback &&f) {
+    if (k == 0) {
+      return;
+    }
+    for (size_t source = 0; source < k; source++) {
+      Refill(source);
+    }
+    Build();
+    while (true) {
+      uint32_t winner = tree[0];
+      if (exhausted[winner]) {
+        return;
+      }
+      // The runner-up is the best of the sources the winner beat
+      uint32_t runner_up = kNone;
+      for (size_t node = (winner + k) / 2; node >= 1; node /= 2) {
+        if (runner_up == kNone || Less(tree[node], runner_up)) {
+          runner_up = tree[node];
+        }
+      }
+      const InputColumns &batch = batches[winner];
+      const int64_t *begin = batch.ts_nanos.data() + offsets[winner];
+      const int64_t *end = batch.ts_nanos.data() + batch.size();
+      const int64_t *run_end = end;
+      if (runner_up != kNone && !exhausted[runner_up]) {
+        int64_t limit = head_ts_nanos[runner_up];
+        // Ties go to the lower source index
+        run_end = winner < runner_up ? std::upper_bound(begin, end, limit)
+                                     : std::lower_bound(begin, end, limit);
+      }
+      size_t run_rows = run_end - begin;
+      if (!f(batch.subspan(offsets[winner], run_rows))) {
+        return;
+      }
+      offsets[winner] += run_rows;
+      if (offsets[winner] == batch.size()) {
+        Refill(winner);
+      } else {
+        head_ts_nanos[winner] = *run_end;
+      }
+      Replay(winner);
+    }
+  }
+
+private:
+  static constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+
+  std::vector<Source> &sources;
+  const size_t k;
+  std::vector<InputColumns> batches;
+  std::vector<size_t> offsets;
+  // Timestamp of each source's next row; the keys of the tree
+  std::vector<int64_t> head_ts_nanos;
+  std::vector<bool> exhausted;
+  // tree[0] is the overall winner, tree[1..k-1] the loser of each match
+  std::vector<uint32_t> tree;
+
+  bool Less(uint32_t a, uint32_t b) const {
+    if (exhausted[a] != exhausted[b]) {
+      return exhausted[b];
+    }
+    return std::pair(head_ts_nanos[a], a) < std::pair(head_ts_nanos[b], b);
+  }
+
+  void Refill(uint32_t source) {
+    batches[source] = sources[source].Next();
+    offsets[source] = 0;
+    if (batches[source].size() == 0) {
+      exhausted[source] = true;
+    } else {
+      head_ts_nanos[source] = batches[source].ts_nanos[0];
+    }
+  }
+
+  // Play every match, with source i at leaf k + i
+  void Build() {
+    std::vector<uint32_t> winners(2 * k);
+    for (size_t source = 0; source < k; source++) {
+      winners[k + source] = source;
+    }
+    for (size_t node = k - 1; node >= 1; node--) {
+      uint32_t a = winners[2 * node];
+      uint32_t b = winners[2 * node + 1];
+      winners[node] = Less(a, b) ? a : b;
+      tree[node] = Less(a, b) ? b : a;
+    }
+    tree[0] = winners[1];
+  }
+
+  // Replay the matches on the path of a source whose key changed
+  void Replay(uint32_t source) {
+    uint32_t winner = source;
+    for (size_t node = (source + k) / 2; node >= 1; node /= 2) {
+      if (Less(tree[node], winner)) {
+        std::swap(tree[node], winner);
+      }
+    }
+    tree[0] = winner;
+  }
+};
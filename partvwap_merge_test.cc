@@ -0,0 +1,209 @@
+#include "partvwap.hh"
+#include "partvwap_merge.hh"
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <random>
+#include <utility>
+#include <vector>
+
+namespace {
+// Hands out a sorted run of rows in batches of batch_rows
+struct VectorMergeSource {
+  InputColumnBuffer rows;
+  size_t batch_rows;
+  size_t offset = 0;
+  int64_t batches_read = 0;
+
+  InputColumns Next() {
+    size_t n = std::min(batch_rows, rows.size() - offset);
+    InputColumns batch = rows.View().subspan(offset, n);
+    offset += n;
+    batches_read++;
+    return batch;
+  }
+};
+
+// Rows of one source in timestamp order, with its index as the provider
+InputColumnBuffer SortedRows(size_t n, uint32_t source, std::mt19937 &rng) {
+  std::uniform_int_distribution<int64_t> gap(0, 3);
+  InputColumnBuffer rows;
+  int64_t ts_nanos = 1000000000000;
+  for (size_t i = 0; i < n; i++) {
+    ts_nanos += gap(rng);
+    rows.push_back(InputRow{ts_nanos, source, uint32_t(i % 5), double(i)});
+  }
+  return rows;
+}
+
+std::vector<InputRow> Merge(std::vector<VectorMergeSource> &sources) {
+  std::vector<InputRow> merged;
+  KWayMerge merge(sources);
+  merge.Run([&](const InputColumns &columns) {
+    for (size_t i = 0; i < columns.size(); i++) {
+      merged.push_back(columns[i]);
+    }
+    return true;
+  });
+  return merged;
+}
+
+// What the merge should produce: a stable sort on timestamp of the sources
+// concatenated in order
+std::vector<InputRow> SortedConcatenation(
+    const std::vector<VectorMergeSource> &sources) {
+  std::vector<InputRow> rows;
+  for (const VectorMergeSource &source : sources) {
+    for (size_t i = 0; i < source.rows.size(); i++) {
+      rows.push_back(source.rows.View()[i]);
+    }
+  }
+  std::stable_sort(rows.begin(), rows.end(),
+                   [](const InputRow &a, const InputRow &b) {
+                     return a.ts_nanos < b.ts_nanos;
+                   });
+  return rows;
+}
+} // namespace
+
+TEST(KWayMerge, MergesSortedSources) {
+  std::mt19937 rng(1);
+  for (uint32_t k : {1, 2, 3, 5, 8, 13}) {
+    std::vector<VectorMergeSource> sources;
+    for (uint32_t source = 0; source < k; source++) {
+      // Some sources are empty, and batch sizes differ
+      size_t n = source % 4 == 3 ? 0 : 500 + 100 * source;
+      sources.push_back(
+          VectorMergeSource{SortedRows(n, source, rng), 7 + 11 * source});
+    }
+    std::vector<InputRow> expected = SortedConcatenation(sources);
+    EXPECT_EQ(Merge(sources), expected) << k << " sources";
+  }
+}
+
+TEST(KWayMerge, OrdersEqualTimestampsBySource) {
+  std::vector<VectorMergeSource> sources(3);
+  for (uint32_t source = 0; source < 3; source++) {
+    sources[source].batch_rows = 2;
+    for (int64_t ts_nanos : {10, 10, 20, 30, 30}) {
+      sources[source].rows.push_back(InputRow{ts_nanos, source, 0, 1.0});
+    }
+  }
+  std::vector<InputRow> merged = Merge(sources);
+  std::vector<std::pair<int64_t, uint32_t>> order;
+  for (const InputRow &row : merged) {
+    order.emplace_back(row.ts_nanos, row.provider_id);
+  }
+  EXPECT_THAT(order, testing::ElementsAre(
+                         std::pair(10, 0), std::pair(10, 0), std::pair(10, 1),
+                         std::pair(10, 1), std::pair(10, 2), std::pair(10, 2),
+                         std::pair(20, 0), std::pair(20, 1), std::pair(20, 2),
+                         std::pair(30, 0), std::pair(30, 0), std::pair(30, 1),
+                         std::pair(30, 1), std::pair(30, 2), std::pair(30, 2)));
+}
+
+TEST(KWayMerge, PassesOnRunsBetweenOtherSources) {
+  // Sources that take turns over long stretches are passed on a batch at a
+  // time, not row by row
+  std::vector<VectorMergeSource> sources(2);
+  for (uint32_t source = 0; source < 2; source++) {
+    sources[source].batch_rows = 100;
+    for (int64_t block = source; block < 10; block += 2) {
+      for (int64_t i = 0; i < 100; i++) {
+        sources[source].rows.push_back(
+            InputRow{block * 1000 + i, source, 0, 1.0});
+      }
+    }
+  }
+  int64_t runs = 0;
+  KWayMerge merge(sources);
+  merge.Run([&](const InputColumns &columns) {
+    EXPECT_EQ(columns.size(), 100);
+    runs++;
+    return true;
+  });
+  EXPECT_EQ(runs, 10);
+}
+
+TEST(KWayMerge, StopsWhenCallbackReturnsFalse) {
+  std::mt19937 rng(2);
+  std::vector<VectorMergeSource> sources;
+  for (uint32_t source = 0; source < 4; source++) {
+    sources.push_back(VectorMergeSource{SortedRows(1000, source, rng), 10});
+  }
+  int64_t runs = 0;
+  KWayMerge merge(sources);
+  merge.Run([&](const InputColumns &) { return ++runs < 3; });
+  EXPECT_EQ(runs, 3);
+  // Only the first batch of each source was read
+  for (const VectorMergeSource &source : sources) {
+    EXPECT_LE(source.batches_read, 2);
+  }
+}
+
+TEST(KWayMerge, ComputesTWAPOfConcatenatedSortedInput) {
+  std::mt19937 rng(3);
+  std::vector<VectorMergeSource> sources;
+  for (uint32_t source = 0; source < 6; source++) {
+    InputColumnBuffer rows;
+    std::uniform_int_distribution<int64_t> gap(0, 100000000);
+    int64_t ts_nanos = 1000000000000;
+    for (size_t i = 0; i < 2000; i++) {
+      ts_nanos += gap(rng);
+      rows.push_back(
+          InputRow{ts_nanos, source % 2, uint32_t(i % 7), 100.0 + i % 13});
+    }
+    sources.push_back(VectorMergeSource{std::move(rows), 256});
+  }
+  std::vector<InputRow> sorted = SortedConcatenation(sources);
+  std::vector<OutputRow> expected;
+  ComputeTWAP(
+      [&](auto &&f) {
+        for (const InputRow &row : sorted) {
+          f(row);
+        }
+      },
+      [&](const OutputRow &row) { expected.push_back(row); });
+
+  std::vector<OutputRow> output;
+  auto output_row_sink = [&](const OutputRow &row) { output.push_back(row); };
+  TWAPEngine<decltype(output_row_sink)> engine(output_row_sink, TWAPOptions{});
+  KWayMerge merge(sources);
+  merge.Run([&](const InputColumns &columns) {
+    engine.AddColumns(columns);
+    return true;
+  });
+  engine.Finish();
+  EXPECT_EQ(output, expected);
+}
+
+static void BM_KWayMerge(benchmark::State &state) {
+  std::mt19937 rng(1);
+  std::vector<VectorMergeSource> sources;
+  for (uint32_t source = 0; source < state.range(0); source++) {
+    sources.push_back(VectorMergeSource{
+        SortedRows(1000000 / state.range(0), source, rng), 65536});
+  }
+  size_t rows = 0;
+  for (auto _ : state) {
+    for (VectorMergeSource &source : sources) {
+      source.offset = 0;
+    }
+    int64_t sum = 0;
+    KWayMerge merge(sources);
+    merge.Run([&](const InputColumns &columns) {
+      for (size_t i = 0; i < columns.size(); i++) {
+        sum += columns.ts_nanos[i];
+      }
+      rows += columns.size();
+      return true;
+    });
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(rows);
+}
+BENCHMARK(BM_KWayMerge)->Arg(2)->Arg(8)->Arg(64);
+
+TEST(Benchmarks, RunAll) { ::benchmark::RunSpecifiedBenchmarks("all"); }
@@ -0,0 +1,606 @@
+#pragma once
+
+#include <absl/cleanup/cleanup.h>
+#include <absl/strings/str_cat.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "partvwap.hh"
+
+// Which worker owns a (provider, symbol) series
+inline uint32_t SeriesShard(uint32_t provider_id, uint32_t symbol_id,
+                            uint32_t num_shards) {
+  uint64_t key = (uint64_t(provider_id) << 32) | symbol_id;
+  return ((key * 0x9E3779B97F4A7C15ull) >> 32) % num_shards;
+}
+
+// One worker thread of ParallelTWAPEngine. The engine fills the work buffer
+// for a generation while the worker processes the previous one; buffers are
+// double-buffered by generation parity.
+class TWAPShardWorker {
+public:
+  struct Work {
+    InputColumnBuffer rows;
+    // Report at boundary_nanos after the first row_end rows
+    std::vector<std::pair<size_t, int64_t>> reports;
+  };
+  struct Result {
+    std::vector<OutputRow> rows;
+    // Output of report i is rows[report_ends[i - 1], report_ends[i])
+    std::vector<size_t> report_ends;
+  };
+
+  Work work[2];
+  Result result[2];
+
+  TWAPShardWorker() : thread([this] { Run(); }) {}
+
+  TWAPShardWorker(const TWAPShardWorker &) = delete;
+  TWAPShardWorker &operator=(const TWAPShardWorker &) = delete;
+
+  ~TWAPShardWorker() {
+    {
+      std::lock_guard lock(mutex);
+      stop = true;
+    }
+    cv.notify_all();
+    thread.join();
+  }
+
+  // Hand work[submitted % 2] to the worker
+  void Submit() {
+    {
+      std::lock_guard lock(mutex);
+      ++submitted;
+    }
+    cv.notify_all();
+  }
+
+  // Wait until the first `generations` submissions are processed
+  void Wait(int64_t generations) {
+    std::unique_lock lock(mutex);
+    cv.wait(lock, [&] { return completed >= generations || error; });
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+private:
+  TWAPSeriesTable series_table;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  int64_t submitted = 0;
+  int64_t completed = 0;
+  bool stop = false;
+  std::exception_ptr error;
+
+  std::thread thread;
+
+  void Process(const Work &work, Result &result) {
+    result.rows.clear();
+    result.report_ends.clear();
+    const InputColumns rows = work.rows.View();
+    size_t row = 0;
+    auto add_rows_until = [&](size_t row_end) {
+      for (; row < row_end; ++row) {
+        series_table.AddPrice(series_table.FindOrAddSeries(
+                                  rows.provider_ids[row], rows.symbol_ids[row]),
+                              rows.ts_nanos[row], rows.prices[row]);
+      }
+    };
+    for (auto [row_end, report_nanos] : work.reports) {
+      add_rows_until(row_end);
+      series_table.ForEachSeries([&](uint32_t series) {
+        if (series_table.Empty(series)) {
+          return;
+        }
+        result.rows.push_back(
+            OutputRow{report_nanos, series_table.ProviderId(series),
+                      series_table.SymbolId(series),
+                      series_table.ComputeTWAP(series, report_nanos)});
+      });
+      result.report_ends.push_back(result.rows.size());
+    }
+    add_rows_until(rows.size());
+  }
+
+  void Run() {
+    int64_t generation = 0;
+    while (true) {
+      {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&] { return stop || submitted > generation; });
+        if (submitted == generation) {
+          return;
+        }
+      }
+      try {
+        Process(work[generation % 2], result[generation % 2]);
+      } catch (...) {
+        std::lock_guard lock(mutex);
+        error = std::current_exception();
+      }
+      ++generation;
+      {
+        std::lock_guard lock(mutex);
+        completed = generation;
+      }
+      cv.notify_all();
+    }
+  }
+};
+
+// Computes the same output as TWAPEngine, in the same order, with series
+// partitioned over worker threads. The calling thread runs the window clock,
+// routes each row to the worker owning its series, and merges each report's
+// per-worker output, already in (provider, symbol) order, into one stream.
+template <typename OutputRowSink> class ParallelTWAPEngine {
+  OutputRowSink &output_row_sink;
+  TWAPWindowClock clock;
+  const TWAPSeriesFilter series_filter;
+  std::vector<std::unique_ptr<TWAPShardWorker>> workers;
+  int64_t generation = 0;
+  size_t buffered_rows = 0;
+  size_t buffered_reports = 0;
+
+  static constexpr size_t kRowsPerGeneration = 1 << 16;
+  static constexpr size_t kReportsPerGeneration = 64;
+
+  TWAPShardWorker::Work &CurrentWork(uint32_t shard) {
+    return workers[shard]->work[generation % 2];
+  }
+
+  void Report(int64_t report_nanos) {
+    for (uint32_t shard = 0; shard < workers.size(); ++shard) {
+      auto &work = CurrentWork(shard);
+      work.reports.emplace_back(work.rows.size(), report_nanos);
+    }
+    if (++buffered_reports >= kReportsPerGeneration) {
+      Flush();
+    }
+  }
+
+  void AdvanceTo(int64_t ts_nanos) {
+    clock.AdvanceTo(ts_nanos,
+                    [&](int64_t report_nanos) { Report(report_nanos); });
+  }
+
+  void Route(const InputRow &input_row) {
+    CurrentWork(SeriesShard(input_row.provider_id, input_row.symbol_id,
+                            workers.size()))
+        .rows.push_back(input_row);
+    if (++buffered_rows >= kRowsPerGeneration) {
+      Flush();
+    }
+  }
+
+  void MergeResults(int64_t merge_generation) {
+    using Cursor = std::pair<size_t, uint32_t>; // (row index, shard)
+    std::vector<Cursor> heap;
+    std::vector<size_t> ends(workers.size());
+    auto key = [&](const Cursor &cursor) {
+      const OutputRow &row =
+          workers[cursor.second]->result[merge_generation % 2]
+              .rows[cursor.first];
+      return std::pair(row.provider_id, row.symbol_id);
+    };
+    auto greater = [&](const Cursor &a, const Cursor &b) {
+      return key(a) > key(b);
+    };
+
+    size_t num_reports =
+        workers[0]->result[merge_generation % 2].report_ends.size();
+    for (size_t report = 0; report < num_reports; ++report) {
+      heap.clear();
+      for (uint32_t shard = 0; shard < workers.size(); ++shard) {
+        const auto &report_ends =
+            workers[shard]->result[merge_generation % 2].report_ends;
+        size_t begin = report == 0 ? 0 : report_ends[report - 1];
+        ends[shard] = report_ends[report];
+        if (begin < ends[shard]) {
+          heap.emplace_back(begin, shard);
+        }
+      }
+      std::make_heap(heap.begin(), heap.end(), greater);
+      while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        Cursor &cursor = heap.back();
+        output_row_sink(workers[cursor.second]
+                            ->result[merge_generation % 2]
+                            .rows[cursor.first]);
+        if (++cursor.first < ends[cursor.second]) {
+          std::push_heap(heap.begin(), heap.end(), greater);
+        } else {
+          heap.pop_back();
+        }
+      }
+    }
+  }
+
+  // Submit the current generation, then merge the previous one while the
+  // workers run.
+  void Flush() {
+    for (auto &worker : workers) {
+      worker->Submit();
+    }
+    ++generation;
+    if (generation > 1) {
+      for (auto &worker : workers) {
+        worker->Wait(generation - 1);
+      }
+      MergeResults(generation - 2);
+    }
+    for (uint32_t shard = 0; shard < workers.size(); ++shard) {
+      CurrentWork(shard).rows.clear();
+      CurrentWork(shard).reports.clear();
+    }
+    buffered_rows = 0;
+    buffered_reports = 0;
+  }
+
+public:
+  ParallelTWAPEngine(OutputRowSink &output_row_sink, const TWAPOptions &options,
+                     int num_threads)
+      : output_row_sink(output_row_sink), clock(options),
+        series_filter(options.series_filter) {
+    for (int i = 0; i < std::max(num_threads, 1); ++i) {
+      workers.push_back(std::make_unique<TWAPShardWorker>());
+    }
+  }
+
+  void AddRow(const InputRow &input_row) {
+    if (!series_filter.Matches(input_row.provider_id, input_row.symbol_id)) {
+      return;
+    }
+    AdvanceTo(input_row.ts_nanos);
+    Route(input_row);
+  }
+
+  void AddColumns(const InputColumns &columns) {
+    for (size_t i = 0; i < columns.size(); ++i) {
+      AddRow(columns[i]);
+    }
+  }
+
+  void Finish() {
+    Report(clock.next_report_nanos);
+    Flush();
+    for (auto &worker : workers) {
+      worker->Wait(generation);
+    }
+    MergeResults(generation - 1);
+  }
+};
+
+// Parallel ComputeTWAP over num_threads series-partitioned workers; same
+// input_row_provider contract and output order as ComputeTWAP.
+template <typename InputRowProvider, typename OutputRowSink>
+void ComputeTWAPParallel(InputRowProvider &&input_row_provider,
+                         OutputRowSink &&output_row_sink,
+                         const TWAPOptions &options, int num_threads) {
+  ParallelTWAPEngine<std::remove_reference_t<OutputRowSink>> engine(
+      output_row_sink, options, num_threads);
+  input_row_provider([&](const auto &input) {
+    if constexpr (std::is_same_v<std::remove_cvref_t<decltype(input)>,
+                                 InputColumns>) {
+      engine.AddColumns(input);
+    } else {
+      engine.AddRow(input);
+    }
+  });
+  engine.Finish();
+}
+
+// One series' window as computed by a time slice, before the history from
+// earlier slices is folded in
+struct TWAPSliceOutputRow {
+  uint32_t provider_id;
+  uint32_t symbol_id;
+  TWAPWindowPartial window;
+  double close_price;
+};
+
+struct TWAPSliceResult {
+  std::vector<int64_t> report_nanos;
+  // Rows of report i are rows[report_ends[i - 1], report_ends[i]), in
+  // (provider, symbol) order, for the series seen so far in the slice
+  std::vector<size_t> report_ends;
+  std::vector<TWAPSliceOutputRow> rows;
+
+  // Translate the ids of a slice computed with its own id space, e.g. its
+  // own dictionaries, into the ids the output uses, keeping each report in
+  // (provider, symbol) order
+  void RemapIds(std::span<const uint32_t> provider_ids,
+                std::span<const uint32_t> symbol_ids) {
+    for (TWAPSliceOutputRow &row : rows) {
+      row.provider_id = provider_ids[row.provider_id];
+      row.symbol_id = symbol_ids[row.symbol_id];
+    }
+    size_t begin = 0;
+    for (size_t end : report_ends) {
+      std::sort(rows.begin() + begin, rows.begin() + end,
+                [](const TWAPSliceOutputRow &a, const TWAPSliceOutputRow &b) {
+                  return std::tie(a.provider_id, a.symbol_id) <
+                         std::tie(b.provider_id, b.symbol_id);
+                });
+      begin = end;
+    }
+  }
+};
+
+// Computes the windows of one time slice [begin_nanos, end_nanos). Every
+// slice but the first starts right after a report at begin_nanos, and every
+// slice but the last ends with a report at end_nanos. Rows outside the slice
+// are ignored.
+class TWAPSliceEngine {
+  TWAPWindowClock clock;
+  TWAPSeriesTable series_table;
+  const int64_t begin_nanos;
+  const int64_t end_nanos;
+  TWAPSliceResult result;
+
+  void Report(int64_t report_nanos) {
+    series_table.ForEachSeries([&](uint32_t series) {
+      if (series_table.Empty(series)) {
+        return;
+      }
+      result.rows.push_back(TWAPSliceOutputRow{
+          series_table.ProviderId(series), series_table.SymbolId(series),
+          series_table.CloseWindow(series, report_nanos),
+          series_table.LastPrice(series)});
+    });
+    result.report_nanos.push_back(report_nanos);
+    result.report_ends.push_back(result.rows.size());
+    series_table.AssumeHistoryBefore(report_nanos);
+  }
+
+  void AddInSlice(const InputRow &input_row) {
+    clock.AdvanceTo(input_row.ts_nanos,
+                    [&](int64_t report_nanos) { Report(report_nanos); });
+    series_table.AddPrice(series_table.FindOrAddSeries(input_row.provider_id,
+                                                       input_row.symbol_id),
+                          input_row.ts_nanos, input_row.price);
+  }
+
+public:
+  TWAPSliceEngine(const TWAPOptions &options, int64_t begin_nanos,
+                  int64_t end_nanos)
+      : clock(options), begin_nanos(begin_nanos), end_nanos(end_nanos) {
+    if (begin_nanos != std::numeric_limits<int64_t>::min()) {
+      clock.ResumeAfter(begin_nanos);
+      series_table.AssumeHistoryBefore(begin_nanos);
+    }
+  }
+
+  void AddRow(const InputRow &input_row) {
+    if (input_row.ts_nanos >= begin_nanos && input_row.ts_nanos < end_nanos) {
+      AddInSlice(input_row);
+    }
+  }
+
+  void AddColumns(const InputColumns &columns) {
+    const int64_t *ts_nanos = columns.ts_nanos.data();
+    size_t begin =
+        std::lower_bound(ts_nanos, ts_nanos + columns.size(), begin_nanos) -
+        ts_nanos;
+    size_t end =
+        std::lower_bound(ts_nanos, ts_nanos + columns.size(), end_nanos) -
+        ts_nanos;
+    for (size_t i = begin; i < end; ++i) {
+      AddInSlice(columns[i]);
+    }
+  }
+
+  TWAPSliceResult Finish() {
+    if (end_nanos != std::numeric_limits<int64_t>::max() &&
+        clock.next_report_nanos != end_nanos) {
+      throw std::runtime_error(
+          absl::StrCat("Time slice [", begin_nanos, ", ", end_nanos,
+                       ") has no input in its last window"));
+    }
+    if (!clock.window_has_input) {
+      // Nothing after the report that ended the previous slice
+      return std::move(result);
+    }
+    Report(clock.next_report_nanos);
+    return std::move(result);
+  }
+};
+
+// Folds consecutive TWAPSliceResults into the running per-series totals and
+// emits the same rows as the serial engine. Series that were live before a
+// slice but not yet seen in it are forward-filled here; series first seen
+// in a slice drop the carried time the slice assumed for them.
+template <typename OutputRowSink> class TWAPSliceStitcher {
+  OutputRowSink &output_row_sink;
+  TWAPSeriesTable series_table;
+  int64_t last_report_nanos = 0;
+  std::vector<const TWAPSliceOutputRow *> slice_row_for_series;
+
+public:
+  explicit TWAPSliceStitcher(OutputRowSink &output_row_sink)
+      : output_row_sink(output_row_sink) {}
+
+  void Add(const TWAPSliceResult &result) {
+    size_t begin = 0;
+    for (size_t report = 0; report < result.report_nanos.size(); ++report) {
+      const int64_t report_nanos = result.report_nanos[report];
+      const size_t live_before = series_table.size();
+      for (size_t i = begin; i < result.report_ends[report]; ++i) {
+        const TWAPSliceOutputRow &row = result.rows[i];
+        uint32_t series =
+            series_table.FindOrAddSeries(row.provider_id, row.symbol_id);
+        slice_row_for_series.resize(series_table.size());
+        slice_row_for_series[series] = &row;
+      }
+      begin = result.report_ends[report];
+
+      series_table.ForEachSeries([&](uint32_t series) {
+        const TWAPSliceOutputRow *row = slice_row_for_series[series];
+        double twap;
+        if (row != nullptr) {
+          TWAPWindowPartial window = row->window;
+          if (series >= live_before) {
+            window.carry_nanos = 0;
+          }
+          twap = series_table.MergeWindow(series, window, row->close_price);
+          slice_row_for_series[series] = nullptr;
+        } else {
+          twap = series_table.MergeWindow(
+              series,
+              TWAPWindowPartial{.carry_nanos =
+                                    report_nanos - last_report_nanos},
+              series_table.CarryPrice(series));
+        }
+        output_row_sink(OutputRow{report_nanos, series_table.ProviderId(series),
+                                  series_table.SymbolId(series), twap});
+      });
+      last_report_nanos = report_nanos;
+    }
+  }
+};
+
+// Computes the same output as ComputeTWAP over input that is split into time
+// slices, e.g. one per input file, each computed on one of num_threads
+// threads and then stitched together in order.
+//
+// slice_start_nanos holds, in order, the timestamp of the first row of each
+// candidate slice; a slice runs from the end of the window holding its first
+// row to the end of the window holding the next slice's first row, and
+// slices that would be empty are merged away.
+// The slices are cut on the unfiltered input, so options.series_filter must
+// select every series.
+// slice_input_provider(slice, begin_nanos, end_nanos, acceptor) runs on a
+// worker thread and must feed, in order, at least the rows in [begin_nanos,
+// end_nanos) to the acceptor, as InputRows or InputColumns.
+// on_slice_output(slice) runs on the calling thread before the output of a
+// slice is emitted. It may instead take (slice, TWAPSliceResult &), e.g. to
+// RemapIds of a slice read with its own dictionaries.
+template <typename SliceInputProvider, typename OutputRowSink,
+          typename OnSliceOutput>
+void ComputeTWAPTimeSliced(SliceInputProvider &&slice_input_provider,
+                           OutputRowSink &&output_row_sink,
+                           OnSliceOutput &&on_slice_output,
+                           const std::vector<int64_t> &slice_start_nanos,
+                           const TWAPOptions &options, int num_threads) {
+  if (!options.series_filter.SelectsAll()) {
+    throw std::invalid_argument(
+        "ComputeTWAPTimeSliced does not support a series filter");
+  }
+  std::vector<int64_t> bounds{std::numeric_limits<int64_t>::min()};
+  for (size_t i = 1; i < slice_start_nanos.size(); ++i) {
+    int64_t bound = ((slice_start_nanos[i] + options.window_nanos) /
+                     options.window_nanos) *
+                    options.window_nanos;
+    if (bounds.size() == 1 || bound > bounds.back()) {
+      bounds.push_back(bound);
+    }
+  }
+  bounds.push_back(std::numeric_limits<int64_t>::max());
+  const size_t num_slices = bounds.size() - 1;
+  num_threads = std::max(1, std::min<int>(num_threads, num_slices));
+
+  std::vector<TWAPSliceResult> results(num_slices);
+  std::vector<std::exception_ptr> errors(num_slices);
+  std::vector<bool> done(num_slices);
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t stitched = 0;
+  bool abandoned = false;
+  std::atomic<size_t> next_slice = 0;
+
+  auto worker = [&] {
+    while (true) {
+      size_t slice = next_slice++;
+      if (slice >= num_slices) {
+        return;
+      }
+      {
+        // Bound the finished but unstitched results held in memory
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&] {
+          return abandoned || slice < stitched + 2 * num_threads;
+        });
+        if (abandoned) {
+          return;
+        }
+      }
+      try {
+        TWAPSliceEngine engine(options, bounds[slice], bounds[slice + 1]);
+        slice_input_provider(slice, bounds[slice], bounds[slice + 1],
+                             [&](const auto &input) {
+                               if constexpr (std::is_same_v<
+                                                 std::remove_cvref_t<
+                                                     decltype(input)>,
+                                                 InputColumns>) {
+                                 engine.AddColumns(input);
+                               } else {
+                                 engine.AddRow(input);
+                               }
+                             });
+        results[slice] = engine.Finish();
+      } catch (...) {
+        errors[slice] = std::current_exception();
+      }
+      {
+        std::lock_guard lock(mutex);
+        done[slice] = true;
+      }
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  absl::Cleanup joiner = [&] {
+    {
+      std::lock_guard lock(mutex);
+      abandoned = true;
+    }
+    cv.notify_all();
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  };
+  for (int i = 0; i < num_threads; ++i) {
+    threads.emplace_back(worker);
+  }
+
+  TWAPSliceStitcher<std::remove_reference_t<OutputRowSink>> stitcher(
+      output_row_sink);
+  for (size_t slice = 0; slice < num_slices; ++slice) {
+    {
+      std::unique_lock lock(mutex);
+      cv.wait(lock, [&] { return bool(done[slice]); });
+    }
+    if (errors[slice]) {
+      std::rethrow_exception(errors[slice]);
+    }
+    if constexpr (std::is_invocable_v<OnSliceOutput &, size_t,
+                                      TWAPSliceResult &>) {
+      on_slice_output(slice, results[slice]);
+    } else {
+      on_slice_output(slice);
+    }
+    stitcher.Add(results[slice]);
+    results[slice] = TWAPSliceResult{};
+    {
+      std::lock_guard lock(mutex);
+      stitched = slice + 1;
+    }
+    cv.notify_all();
+  }
+}
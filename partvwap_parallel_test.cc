@@ -0,0 +1,227 @@
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/str_cat.h>
+#include <absl/time/time.h>
+#include <benchmark/benchmark.h>
+#include <cmath>
+#include <cstdint>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "partvwap.hh"
+#include "partvwap_parallel.hh"
+
+namespace {
+InputColumnBuffer MakeSparseInput(int64_t num_rows) {
+  InputColumnBuffer input;
+  std::mt19937_64 rng(17);
+  int64_t ts = 1000000000000;
+  for (int64_t i = 0; i < num_rows; i++) {
+    // Mostly dense trading with the occasional multi-window gap
+    ts += rng() % 5000 == 0 ? int64_t(rng() % 20) * 15000000000
+                            : int64_t(rng() % 2000000);
+    // A few hundred active symbols scattered over a sparse id space
+    uint32_t symbol = rng() % 300;
+    input.push_back(InputRow{ts, static_cast<uint32_t>(rng() % 4),
+                             symbol * 131 % 40000,
+                             100.0 + double(rng() % 1000) / 100});
+  }
+  return input;
+}
+} // namespace
+
+TEST(ComputeTWAPParallel, MatchesSerial) {
+  InputColumnBuffer input = MakeSparseInput(200000);
+  for (int64_t max_idle_windows : {int64_t(0), int64_t(3),
+                                   std::numeric_limits<int64_t>::max()}) {
+    TWAPOptions options{.max_idle_windows = max_idle_windows};
+    std::vector<OutputRow> serial;
+    ComputeTWAP([&](auto &&f) { f(input.View()); },
+                [&](const OutputRow &row) { serial.push_back(row); }, options);
+    ASSERT_FALSE(serial.empty());
+
+    for (int num_threads : {1, 3, 8}) {
+      std::vector<OutputRow> parallel;
+      ComputeTWAPParallel(
+          [&](auto &&f) {
+            for (size_t i = 0; i < input.size(); i++) {
+              f(input.View()[i]);
+            }
+          },
+          [&](const OutputRow &row) { parallel.push_back(row); }, options,
+          num_threads);
+      ASSERT_EQ(parallel.size(), serial.size())
+          << num_threads << " threads, max_idle_windows " << max_idle_windows;
+      EXPECT_TRUE(parallel == serial)
+          << num_threads << " threads, max_idle_windows " << max_idle_windows;
+    }
+  }
+}
+
+TEST(ComputeTWAPParallel, SeriesFilterMatchesSerial) {
+  InputColumnBuffer input = MakeSparseInput(50000);
+  TWAPOptions options{.series_filter = TWAPSeriesFilter::Only(
+                          {{0, 131}, {1, 262}, {3, 0}, {2, 39300}})};
+  std::vector<OutputRow> serial;
+  ComputeTWAP([&](auto &&f) { f(input.View()); },
+              [&](const OutputRow &row) { serial.push_back(row); }, options);
+  ASSERT_FALSE(serial.empty());
+  std::vector<OutputRow> parallel;
+  ComputeTWAPParallel([&](auto &&f) { f(input.View()); },
+                      [&](const OutputRow &row) { parallel.push_back(row); },
+                      options, 3);
+  EXPECT_TRUE(parallel == serial);
+}
+
+TEST(ComputeTWAPParallel, EmptyInput) {
+  std::vector<OutputRow> output_rows;
+  ComputeTWAPParallel(
+      [&](auto &&f) {},
+      [&](const OutputRow &row) { output_rows.push_back(row); }, TWAPOptions{},
+      4);
+  EXPECT_TRUE(output_rows.empty());
+}
+
+TEST(ComputeTWAPTimeSliced, MatchesSerial) {
+  InputColumnBuffer input = MakeSparseInput(200000);
+  const InputColumns all = input.View();
+  for (int64_t max_idle_windows : {int64_t(0), int64_t(3),
+                                   std::numeric_limits<int64_t>::max()}) {
+    TWAPOptions options{.max_idle_windows = max_idle_windows};
+    std::vector<OutputRow> serial;
+    ComputeTWAP([&](auto &&f) { f(all); },
+                [&](const OutputRow &row) { serial.push_back(row); }, options);
+
+    // Split the input into "files" of various sizes, including files that
+    // start and end in the same window as their neighbours
+    for (size_t file_rows : {size_t(1), size_t(997), size_t(20000),
+                             size_t(199999), input.size()}) {
+      std::vector<size_t> file_starts;
+      std::vector<int64_t> slice_start_nanos;
+      for (size_t i = 0; i < input.size(); i += file_rows) {
+        file_starts.push_back(i);
+        slice_start_nanos.push_back(all.ts_nanos[i]);
+      }
+      file_starts.push_back(input.size());
+      if (file_rows == 1) {
+        // One slice per window would be slow; keep a sample
+        file_starts = {0, 1, 2, 500, 501, 90000, input.size() - 1,
+                       input.size()};
+        slice_start_nanos.clear();
+        for (size_t i = 0; i + 1 < file_starts.size(); ++i) {
+          slice_start_nanos.push_back(all.ts_nanos[file_starts[i]]);
+        }
+      }
+
+      for (int num_threads : {1, 4}) {
+        std::vector<OutputRow> sliced;
+        ComputeTWAPTimeSliced(
+            [&](size_t slice, int64_t begin_nanos, int64_t end_nanos,
+                auto &&f) {
+              for (size_t i = 0; i + 1 < file_starts.size(); ++i) {
+                InputColumns file = all.subspan(
+                    file_starts[i], file_starts[i + 1] - file_starts[i]);
+                if (file.ts_nanos.back() >= begin_nanos &&
+                    file.ts_nanos.front() < end_nanos) {
+                  f(file);
+                }
+              }
+            },
+            [&](const OutputRow &row) { sliced.push_back(row); },
+            [](size_t slice) {}, slice_start_nanos, options, num_threads);
+        ASSERT_EQ(sliced.size(), serial.size())
+            << file_rows << " rows per file, max_idle_windows "
+            << max_idle_windows;
+        EXPECT_TRUE(sliced == serial) << file_rows
+                                      << " rows per file, max_idle_windows "
+                                      << max_idle_windows;
+      }
+    }
+  }
+}
+
+TEST(ComputeTWAPTimeSliced, RemapsSliceLocalIds) {
+  InputColumnBuffer input = MakeSparseInput(50000);
+  const InputColumns all = input.View();
+  std::vector<OutputRow> serial;
+  ComputeTWAP([&](auto &&f) { f(all); },
+              [&](const OutputRow &row) { serial.push_back(row); },
+              TWAPOptions{});
+
+  // Each slice numbers the ids in the order it first sees them, as reading
+  // with per-slice dictionaries does
+  const size_t file_rows = 12500;
+  std::vector<int64_t> slice_start_nanos;
+  for (size_t i = 0; i < input.size(); i += file_rows) {
+    slice_start_nanos.push_back(all.ts_nanos[i]);
+  }
+  std::vector<std::vector<uint32_t>> slice_providers(slice_start_nanos.size());
+  std::vector<std::vector<uint32_t>> slice_symbols(slice_start_nanos.size());
+  std::vector<OutputRow> sliced;
+  ComputeTWAPTimeSliced(
+      [&](size_t slice, int64_t begin_nanos, int64_t end_nanos, auto &&f) {
+        absl::flat_hash_map<uint32_t, uint32_t> provider_ids;
+        absl::flat_hash_map<uint32_t, uint32_t> symbol_ids;
+        auto local_id = [](absl::flat_hash_map<uint32_t, uint32_t> &ids,
+                           std::vector<uint32_t> &global_ids, uint32_t id) {
+          auto [it, added] = ids.emplace(id, global_ids.size());
+          if (added) {
+            global_ids.push_back(id);
+          }
+          return it->second;
+        };
+        for (size_t i = 0; i < input.size(); ++i) {
+          InputRow row = all[i];
+          if (row.ts_nanos >= begin_nanos && row.ts_nanos < end_nanos) {
+            row.provider_id = local_id(provider_ids, slice_providers[slice],
+                                       row.provider_id);
+            row.symbol_id =
+                local_id(symbol_ids, slice_symbols[slice], row.symbol_id);
+            f(row);
+          }
+        }
+      },
+      [&](const OutputRow &row) { sliced.push_back(row); },
+      [&](size_t slice, TWAPSliceResult &result) {
+        result.RemapIds(slice_providers[slice], slice_symbols[slice]);
+      },
+      slice_start_nanos, TWAPOptions{}, 3);
+  ASSERT_EQ(sliced.size(), serial.size());
+  EXPECT_TRUE(sliced == serial);
+}
+
+TEST(ComputeTWAPTimeSliced, RethrowsSliceErrors) {
+  InputColumnBuffer input = MakeSparseInput(1000);
+  std::vector<int64_t> slice_start_nanos{input.ts_nanos[0],
+                                         input.ts_nanos[500]};
+  EXPECT_THROW(ComputeTWAPTimeSliced(
+                   [&](size_t slice, int64_t begin_nanos, int64_t end_nanos,
+                       auto &&f) {
+                     if (slice == 1) {
+                       throw std::runtime_error("bad file");
+                     }
+                     f(input.View());
+                   },
+                   [](const OutputRow &row) {}, [](size_t slice) {},
+                   slice_start_nanos, TWAPOptions{}, 2),
+               std::runtime_error);
+}
+
+static void BM_ComputeTWAPParallel(benchmark::State &state) {
+  InputColumnBuffer input = MakeSparseInput(1000000);
+  for (auto _ : state) {
+    double sum_twap = 0;
+    ComputeTWAPParallel([&](auto &&f) { f(input.View()); },
+                        [&](const OutputRow &row) { sum_twap += row.twap; },
+                        TWAPOptions{}, state.range(0));
+    benchmark::DoNotOptimize(sum_twap);
+  }
+  state.SetItemsProcessed(state.iterations() * input.size());
+}
+BENCHMARK(BM_ComputeTWAPParallel)->Arg(1)->Arg(4);
+
+TEST(Benchmarks, RunAll) { ::benchmark::RunSpecifiedBenchmarks("all"); }
@@ -7,20 +7,28 @@
 #include <absl/strings/string_view.h>
 #include <absl/time/time.h>
 #include <algorithm>
+#include <array>
 #include <arrow/api.h>
 #include <arrow/io/api.h>
 #include <arrow/ipc/api.h>
 #include <arrow/testing/gtest_util.h>
 #include <cmath>
 #include <cstdint>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <parquet/arrow/reader.h>
 #include <parquet/arrow/writer.h>
+#include <parquet/exception.h>
+#include <parquet/file_reader.h>
+#include <parquet/metadata.h>
+#include <parquet/statistics.h>
 #include <vector>
 
 arrow::Status WriteParquetFromInputRows(std::string filename,
@@ -73,142 +81,592 @@ arrow::Status WriteParquetFromInputRows(std::string filename,
   return arrow::Status::OK();
 }
 
-arrow::Status ReadParquetToInputRows(
-    const std::string &filename,
-    std::function<arrow::Status(ParquetChunk)> chunk_callback,
-    NameToId &providers, NameToId &symbols) {
-  auto reader_props = parquet::ArrowReaderProperties();
+namespace {
+// The input columns, found by name so that files may order them differently
+// or carry other columns
+constexpr std::array<const char *, 4> kParquetInputColumns = {
+    "provider", "symbol", "timestamp", "price"};
+
+// A parquet file opened for reading the input columns, which readers on
+// several threads can share
+struct ParquetInputFile {
+  std::shared_ptr<arrow::io::RandomAccessFile> file;
+  std::shared_ptr<parquet::FileMetaData> metadata;
+  // Leaf column index of each of kParquetInputColumns
+  std::vector<int> column_indices;
+};
+
+arrow::Result<ParquetInputFile>
+OpenParquetInputFile(const std::string &filename) {
+  ParquetInputFile input;
+  ARROW_ASSIGN_OR_RAISE(input.file, arrow::io::ReadableFile::Open(filename));
+  try {
+    input.metadata = parquet::ReadMetaData(input.file);
+  } catch (const parquet::ParquetException &e) {
+    return arrow::Status::IOError("Reading metadata of ", filename, ": ",
+                                  e.what());
+  }
+  for (const char *name : kParquetInputColumns) {
+    int index = input.metadata->schema()->ColumnIndex(name);
+    if (index < 0) {
+      return arrow::Status::Invalid("No column '", name, "' in ", filename);
+    }
+    input.column_indices.push_back(index);
+  }
+  return input;
+}
 
-  reader_props.set_read_dictionary(0, true); // provider column
-  reader_props.set_read_dictionary(1, true); // symbol column
+// The row groups of input that options.begin_nanos and options.end_nanos
+// leave to be read, in order
+arrow::Result<std::vector<int>>
+SelectRowGroups(const ParquetInputFile &input,
+                const ParquetReadOptions &options) {
+  const int num_row_groups = input.metadata->num_row_groups();
+  std::vector<int> row_groups;
+  row_groups.reserve(num_row_groups);
+  const bool all = options.begin_nanos == std::numeric_limits<int64_t>::min() &&
+                   options.end_nanos == std::numeric_limits<int64_t>::max();
+  try {
+    for (int i = 0; i < num_row_groups; i++) {
+      if (!all) {
+        auto statistics = std::dynamic_pointer_cast<parquet::Int64Statistics>(
+            input.metadata->RowGroup(i)
+                ->ColumnChunk(input.column_indices[2]) // timestamp
+                ->statistics());
+        if (statistics != nullptr && statistics->HasMinMax() &&
+            (statistics->max() < options.begin_nanos ||
+             statistics->min() >= options.end_nanos)) {
+          continue;
+        }
+      }
+      row_groups.push_back(i);
+    }
+  } catch (const parquet::ParquetException &e) {
+    return arrow::Status::IOError("Reading row group statistics: ", e.what());
+  }
+  return row_groups;
+}
+
+arrow::Result<std::unique_ptr<parquet::arrow::FileReader>>
+OpenParquetReader(const ParquetInputFile &input,
+                  const ParquetReadOptions &options) {
+  parquet::ReaderProperties properties(arrow::default_memory_pool());
+  if (options.buffer_size > 0) {
+    properties.enable_buffered_stream();
+    properties.set_buffer_size(options.buffer_size);
+  }
+
+  auto reader_props = parquet::ArrowReaderProperties();
+  reader_props.set_read_dictionary(input.column_indices[0], true); // provider
+  reader_props.set_read_dictionary(input.column_indices[1], true); // symbol
+  reader_props.set_use_threads(options.use_threads);
+  reader_props.set_pre_buffer(options.pre_buffer);
+  reader_props.set_batch_size(options.batch_size);
 
   parquet::arrow::FileReaderBuilder reader_builder;
-  ARROW_RETURN_NOT_OK(reader_builder.OpenFile(filename));
+  ARROW_RETURN_NOT_OK(
+      reader_builder.Open(input.file, properties, input.metadata));
   reader_builder.memory_pool(arrow::default_memory_pool());
   reader_builder.properties(reader_props);
+  return reader_builder.Build();
+}
 
-  std::unique_ptr<parquet::arrow::FileReader> arrow_reader;
-  ARROW_ASSIGN_OR_RAISE(arrow_reader, reader_builder.Build());
-
+// Calls f with each record batch of the input columns of some row groups
+template <typename BatchCallback>
+arrow::Status ForEachRowGroupBatch(parquet::arrow::FileReader &reader,
+                                   const ParquetInputFile &input,
+                                   const std::vector<int> &row_groups,
+                                   BatchCallback &&f) {
   std::shared_ptr<arrow::RecordBatchReader> rb_reader;
-  ARROW_RETURN_NOT_OK(arrow_reader->GetRecordBatchReader(&rb_reader));
-
-  // Process record batches
-  std::shared_ptr<arrow::RecordBatch> batch;
-  while (rb_reader->ReadNext(&batch).ok() && batch != nullptr) {
-    // Get column arrays for this batch
-    auto provider_array =
-        std::static_pointer_cast<arrow::DictionaryArray>(batch->column(0));
-    auto symbol_array =
-        std::static_pointer_cast<arrow::DictionaryArray>(batch->column(1));
-    auto timestamp_array =
-        std::static_pointer_cast<arrow::Int64Array>(batch->column(2));
-    auto price_array =
-        std::static_pointer_cast<arrow::DoubleArray>(batch->column(3));
-    // Unpack provider dictionary
-    auto provider_dict = std::static_pointer_cast<arrow::StringArray>(
-        provider_array->dictionary());
-    auto provider_ids = std::vector<int64_t>(provider_dict->length());
-    for (int64_t i = 0; i < provider_dict->length(); i++) {
-      provider_ids[i] = providers.IDFromName(provider_dict->GetView(i));
+  ARROW_RETURN_NOT_OK(reader.GetRecordBatchReader(
+      row_groups, input.column_indices, &rb_reader));
+
+  while (true) {
+    std::shared_ptr<arrow::RecordBatch> batch;
+    ARROW_RETURN_NOT_OK(rb_reader->ReadNext(&batch));
+    if (batch == nullptr) {
+      break;
     }
-    ARROW_ASSIGN_OR_RAISE(auto provider_indices_view,
-                          provider_array->indices()->View(arrow::int32()));
-    auto provider_indices =
-        std::static_pointer_cast<arrow::Int32Array>(provider_indices_view);
-
-    // Unpack symbol dictionary
-    auto symbol_dict = std::static_pointer_cast<arrow::StringArray>(
-        symbol_array->dictionary());
-    auto symbol_ids = std::vector<int64_t>(symbol_dict->length());
-    for (int64_t i = 0; i < symbol_dict->length(); i++) {
-      symbol_ids[i] = symbols.IDFromName(symbol_dict->GetView(i));
+    ARROW_RETURN_NOT_OK(f(batch));
+  }
+  return arrow::Status::OK();
+}
+
+// Calls f with each record batch of the input columns of a parquet file,
+// with the provider and symbol columns dictionary encoded
+template <typename BatchCallback>
+arrow::Status ForEachParquetBatch(const std::string &filename,
+                                  const ParquetReadOptions &options,
+                                  BatchCallback &&f) {
+  ARROW_ASSIGN_OR_RAISE(ParquetInputFile input,
+                        OpenParquetInputFile(filename));
+  ARROW_ASSIGN_OR_RAISE(std::vector<int> row_groups,
+                        SelectRowGroups(input, options));
+  if (row_groups.empty()) {
+    return arrow::Status::OK();
+  }
+  if (options.row_group_threads <= 0) {
+    ARROW_ASSIGN_OR_RAISE(auto reader, OpenParquetReader(input, options));
+    return ForEachRowGroupBatch(*reader, input, row_groups, f);
+  }
+
+  // Keep up to row_group_threads row groups decoding, each with its own
+  // reader over the shared file, and pass their batches on in order
+  using Batches = std::vector<std::shared_ptr<arrow::RecordBatch>>;
+  auto read_row_group = [&](int row_group) -> arrow::Result<Batches> {
+    ARROW_ASSIGN_OR_RAISE(auto reader, OpenParquetReader(input, options));
+    Batches batches;
+    ARROW_RETURN_NOT_OK(ForEachRowGroupBatch(
+        *reader, input, {row_group},
+        [&](std::shared_ptr<arrow::RecordBatch> batch) {
+          batches.push_back(std::move(batch));
+          return arrow::Status::OK();
+        }));
+    return batches;
+  };
+  std::deque<std::future<arrow::Result<Batches>>> pending;
+  size_t next_row_group = 0;
+  auto fill = [&] {
+    while (next_row_group < row_groups.size() &&
+           pending.size() < size_t(options.row_group_threads)) {
+      pending.push_back(std::async(std::launch::async, read_row_group,
+                                   row_groups[next_row_group]));
+      ++next_row_group;
     }
-    ARROW_ASSIGN_OR_RAISE(auto symbol_indices_view,
-                          symbol_array->indices()->View(arrow::int32()));
-    auto symbol_indices =
-        std::static_pointer_cast<arrow::Int32Array>(symbol_indices_view);
+  };
+  for (fill(); !pending.empty(); fill()) {
+    auto batches = pending.front().get();
+    pending.pop_front();
+    ARROW_RETURN_NOT_OK(batches.status());
+    for (const auto &batch : *batches) {
+      ARROW_RETURN_NOT_OK(f(batch));
+    }
+  }
+  return arrow::Status::OK();
+}
 
-    ParquetChunk chunk{.num_rows = batch->num_rows(),
-                       .provider_indices = provider_indices.get(),
-                       .symbol_indices = symbol_indices.get(),
-                       .timestamp_array = timestamp_array.get(),
-                       .price_array = price_array.get(),
-                       .providers = providers,
-                       .symbols = symbols};
+// A RecordBatchReader over a parquet file that owns the FileReader its
+// batches are decoded by
+class OwningParquetBatchReader : public arrow::RecordBatchReader {
+public:
+  OwningParquetBatchReader(
+      std::unique_ptr<parquet::arrow::FileReader> reader,
+      std::shared_ptr<arrow::RecordBatchReader> batches)
+      : reader(std::move(reader)), batches(std::move(batches)) {}
+
+  std::shared_ptr<arrow::Schema> schema() const override {
+    return batches->schema();
+  }
 
-    ARROW_RETURN_NOT_OK(chunk_callback(chunk));
+  arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch> *batch) override {
+    return batches->ReadNext(batch);
   }
 
-  return arrow::Status::OK();
+private:
+  // Declared first, so it outlives the batch reader
+  std::unique_ptr<parquet::arrow::FileReader> reader;
+  std::shared_ptr<arrow::RecordBatchReader> batches;
+};
+
+// The column of a batch with the given name and type
+template <typename ArrayType>
+arrow::Result<std::shared_ptr<ArrayType>>
+ParquetBatchColumn(const arrow::RecordBatch &batch, const std::string &name,
+                   arrow::Type::type type_id) {
+  auto column = batch.GetColumnByName(name);
+  if (column == nullptr) {
+    return arrow::Status::Invalid("No column '", name, "' in batch");
+  }
+  if (column->type_id() != type_id) {
+    return arrow::Status::TypeError("Column '", name, "' has type ",
+                                    column->type()->ToString());
+  }
+  return std::static_pointer_cast<ArrayType>(column);
+}
+} // namespace
+
+arrow::Result<std::span<const uint32_t>>
+ParquetDictionaryRemap::Remap(const arrow::DictionaryArray &array,
+                              NameToId &names) {
+  const auto &new_dictionary = array.dictionary();
+  if (new_dictionary->type_id() != arrow::Type::STRING) {
+    return arrow::Status::TypeError("Dictionary has type ",
+                                    new_dictionary->type()->ToString());
+  }
+  if (dictionary == nullptr || (new_dictionary != dictionary &&
+                                !new_dictionary->Equals(*dictionary))) {
+    const auto &strings =
+        static_cast<const arrow::StringArray &>(*new_dictionary);
+    dictionary_ids.resize(strings.length());
+    for (int64_t i = 0; i < strings.length(); i++) {
+      dictionary_ids[i] = names.IDFromName(strings.GetView(i));
+    }
+    identity = true;
+    for (size_t i = 0; i < dictionary_ids.size(); i++) {
+      identity &= dictionary_ids[i] == i;
+    }
+  }
+  // Hold on to the dictionary so a new one cannot reuse its address
+  dictionary = new_dictionary;
+
+  if (array.indices()->type_id() != arrow::Type::INT32) {
+    return arrow::Status::TypeError("Dictionary indices have type ",
+                                    array.indices()->type()->ToString());
+  }
+  const int64_t n = array.length();
+  const uint32_t *indices = reinterpret_cast<const uint32_t *>(
+      array.indices()->data()->GetValues<int32_t>(1));
+  // Check the indices apart from the gather so that both vectorize
+  uint32_t max_index = 0;
+  for (int64_t i = 0; i < n; i++) {
+    max_index = std::max(max_index, indices[i]);
+  }
+  if (n > 0 && max_index >= dictionary_ids.size()) {
+    return arrow::Status::Invalid("Dictionary index ", max_index,
+                                  " out of range for dictionary of size ",
+                                  dictionary_ids.size());
+  }
+  if (identity) {
+    return std::span<const uint32_t>(indices, n);
+  }
+  ids.resize(n);
+  const uint32_t *table = dictionary_ids.data();
+  for (int64_t i = 0; i < n; i++) {
+    ids[i] = table[indices[i]];
+  }
+  return std::span<const uint32_t>(ids);
+}
+
+arrow::Status
+ParquetChunkFromBatch(const arrow::RecordBatch &batch,
+                      std::function<arrow::Status(ParquetChunk)> f,
+                      NameToId &providers, NameToId &symbols,
+                      ParquetBatchRemap &remap) {
+  // Get column arrays for this batch
+  ARROW_ASSIGN_OR_RAISE(auto provider_array,
+                        ParquetBatchColumn<arrow::DictionaryArray>(
+                            batch, "provider", arrow::Type::DICTIONARY));
+  ARROW_ASSIGN_OR_RAISE(auto symbol_array,
+                        ParquetBatchColumn<arrow::DictionaryArray>(
+                            batch, "symbol", arrow::Type::DICTIONARY));
+  ARROW_ASSIGN_OR_RAISE(auto timestamp_array,
+                        ParquetBatchColumn<arrow::Int64Array>(
+                            batch, "timestamp", arrow::Type::INT64));
+  ARROW_ASSIGN_OR_RAISE(auto price_array,
+                        ParquetBatchColumn<arrow::DoubleArray>(
+                            batch, "price", arrow::Type::DOUBLE));
+
+  ARROW_ASSIGN_OR_RAISE(auto provider_ids,
+                        remap.providers.Remap(*provider_array, providers));
+  ARROW_ASSIGN_OR_RAISE(auto symbol_ids,
+                        remap.symbols.Remap(*symbol_array, symbols));
+
+  ParquetChunk chunk{.num_rows = batch.num_rows(),
+                     .provider_ids = provider_ids,
+                     .symbol_ids = symbol_ids,
+                     .timestamp_array = timestamp_array.get(),
+                     .price_array = price_array.get(),
+                     .providers = providers,
+                     .symbols = symbols};
+
+  return f(chunk);
+}
+
+arrow::Status ReadParquetToInputRows(
+    const std::string &filename,
+    std::function<arrow::Status(ParquetChunk)> chunk_callback,
+    NameToId &providers, NameToId &symbols,
+    const ParquetReadOptions &options) {
+  ParquetBatchRemap remap;
+  return ForEachParquetBatch(
+      filename, options,
+      [&](const std::shared_ptr<arrow::RecordBatch> &batch) {
+        return ParquetChunkFromBatch(*batch, chunk_callback, providers,
+                                     symbols, remap);
+      });
+}
+
+arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>>
+ReadParquetBatches(const std::string &filename,
+                   const ParquetReadOptions &options) {
+  std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+  ARROW_RETURN_NOT_OK(ForEachParquetBatch(
+      filename, options, [&](std::shared_ptr<arrow::RecordBatch> batch) {
+        batches.push_back(std::move(batch));
+        return arrow::Status::OK();
+      }));
+  return batches;
+}
+
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>>
+OpenParquetBatchReader(const std::string &filename,
+                       const ParquetReadOptions &options) {
+  ARROW_ASSIGN_OR_RAISE(ParquetInputFile input,
+                        OpenParquetInputFile(filename));
+  ARROW_ASSIGN_OR_RAISE(std::vector<int> row_groups,
+                        SelectRowGroups(input, options));
+  ARROW_ASSIGN_OR_RAISE(auto reader, OpenParquetReader(input, options));
+  std::shared_ptr<arrow::RecordBatchReader> batches;
+  ARROW_RETURN_NOT_OK(reader->GetRecordBatchReader(
+      row_groups, input.column_indices, &batches));
+  return std::make_shared<OwningParquetBatchReader>(std::move(reader),
+                                                    std::move(batches));
+}
+
+InputColumns ParquetMergeSource::Next() {
+  while (status.ok()) {
+    status = reader->ReadNext(&batch);
+    if (!status.ok() || batch == nullptr) {
+      break;
+    }
+    if (batch->num_rows() == 0) {
+      continue;
+    }
+    InputColumns columns;
+    status = ParquetChunkFromBatch(
+        *batch,
+        [&](ParquetChunk chunk) {
+          columns = chunk.Columns();
+          return arrow::Status::OK();
+        },
+        *providers, *symbols, remap);
+    if (status.ok()) {
+      return columns;
+    }
+  }
+  // An error ends this input early; the merge stops at it
+  batch = nullptr;
+  return InputColumns{};
+}
+
+arrow::Result<std::pair<int64_t, int64_t>>
+ReadParquetTimestampRange(const std::string &filename) {
+  std::pair<int64_t, int64_t> range{std::numeric_limits<int64_t>::max(),
+                                    std::numeric_limits<int64_t>::min()};
+  try {
+    auto reader = parquet::ParquetFileReader::OpenFile(filename);
+    auto metadata = reader->metadata();
+    const int timestamp_column = metadata->schema()->ColumnIndex("timestamp");
+    if (timestamp_column < 0) {
+      return arrow::Status::Invalid("No column 'timestamp' in ", filename);
+    }
+    for (int i = 0; i < metadata->num_row_groups(); i++) {
+      auto row_group = metadata->RowGroup(i);
+      if (row_group->num_rows() == 0) {
+        continue;
+      }
+      auto statistics = std::dynamic_pointer_cast<parquet::Int64Statistics>(
+          row_group->ColumnChunk(timestamp_column)->statistics());
+      if (statistics == nullptr || !statistics->HasMinMax()) {
+        return arrow::Status::Invalid("No timestamp statistics in row group ",
+                                      i, " of ", filename);
+      }
+      range.first = std::min(range.first, statistics->min());
+      range.second = std::max(range.second, statistics->max());
+    }
+  } catch (const parquet::ParquetException &e) {
+    return arrow::Status::IOError("Reading metadata of ", filename, ": ",
+                                  e.what());
+  }
+  return range;
+}
+
+namespace {
+// A dictionary array over names, indexed by the ids
+arrow::Result<std::shared_ptr<arrow::Array>>
+DictionaryFromIds(const std::vector<uint32_t> &ids,
+                  const std::vector<std::string> &names) {
+  uint32_t max_id = 0;
+  for (uint32_t id : ids) {
+    max_id = std::max(max_id, id);
+  }
+  size_t dictionary_size = ids.empty() ? 0 : size_t(max_id) + 1;
+  if (dictionary_size > names.size()) {
+    return arrow::Status::Invalid("Output row id ", max_id, " has no name");
+  }
+  arrow::StringBuilder dictionary_builder;
+  for (size_t id = 0; id < dictionary_size; id++) {
+    ARROW_RETURN_NOT_OK(dictionary_builder.Append(names[id]));
+  }
+  std::shared_ptr<arrow::Array> dictionary;
+  ARROW_RETURN_NOT_OK(dictionary_builder.Finish(&dictionary));
+  // The ids are only read while the row group is written, so are wrapped
+  // rather than copied
+  auto indices = std::make_shared<arrow::Int32Array>(
+      int64_t(ids.size()), arrow::Buffer::Wrap(ids));
+  return std::make_shared<arrow::DictionaryArray>(
+      arrow::dictionary(arrow::int32(), arrow::utf8()), indices, dictionary);
+}
+} // namespace
+
+std::shared_ptr<arrow::Schema> ParquetOutputWriter::Schema() {
+  return arrow::schema(
+      {arrow::field("provider", arrow::dictionary(arrow::int32(),
+                                                  arrow::utf8())),
+       arrow::field("symbol", arrow::dictionary(arrow::int32(), arrow::utf8())),
+       arrow::field("timestamp", arrow::int64()),
+       arrow::field("twap", arrow::float64())});
+}
+
+arrow::Status ParquetOutputWriter::WriteRowGroup(
+    parquet::arrow::FileWriter &writer, const OutputColumnBuffer &columns,
+    const std::vector<std::string> &provider_names,
+    const std::vector<std::string> &symbol_names) {
+  ARROW_ASSIGN_OR_RAISE(
+      auto provider_array,
+      DictionaryFromIds(columns.provider_ids, provider_names));
+  ARROW_ASSIGN_OR_RAISE(auto symbol_array,
+                        DictionaryFromIds(columns.symbol_ids, symbol_names));
+  auto timestamp_array = std::make_shared<arrow::Int64Array>(
+      int64_t(columns.size()), arrow::Buffer::Wrap(columns.ts_nanos));
+  auto twap_array = std::make_shared<arrow::DoubleArray>(
+      int64_t(columns.size()), arrow::Buffer::Wrap(columns.twaps));
+
+  auto batch = arrow::RecordBatch::Make(
+      Schema(), columns.size(),
+      {provider_array, symbol_array, timestamp_array, twap_array});
+
+  // Each flush is one row group
+  ARROW_RETURN_NOT_OK(writer.NewBufferedRowGroup());
+  return writer.WriteRecordBatch(*batch);
 }
 
 arrow::Status ParquetOutputWriter::OpenOutputFile(std::string filename) {
   ARROW_RETURN_NOT_OK(
       arrow::io::FileOutputStream::Open(filename).Value(&outfile));
+  ARROW_ASSIGN_OR_RAISE(
+      writer, parquet::arrow::FileWriter::Open(
+                  *Schema(), arrow::default_memory_pool(), outfile,
+                  parquet::WriterProperties::Builder()
+                      .compression(options.compression)
+                      ->max_row_group_length(options.row_group_rows)
+                      ->build(),
+                  parquet::ArrowWriterProperties::Builder().build()));
   return arrow::Status::OK();
 }
 
 arrow::Status ParquetOutputWriter::AppendOutputRow(const OutputRow &row) {
-  ARROW_RETURN_NOT_OK(provider_builder.Append(providers[row.provider_id]));
-  ARROW_RETURN_NOT_OK(symbol_builder.Append(symbols[row.symbol_id]));
-  ARROW_RETURN_NOT_OK(timestamp_builder.Append(row.ts_nanos));
-  ARROW_RETURN_NOT_OK(twap_builder.Append(row.twap));
-  buffered_rows++;
-
-  if (buffered_rows >= 1024 * 1024) {
+  buffer.push_back(row);
+  if (int64_t(buffer.size()) >= options.row_group_rows) {
     ARROW_RETURN_NOT_OK(OutputRowChunk());
   }
-
   return arrow::Status::OK();
 }
 
 arrow::Status ParquetOutputWriter::OutputRowChunk() {
-  if (buffered_rows == 0) {
+  if (buffer.size() == 0) {
     return arrow::Status::OK();
   }
+  ARROW_RETURN_NOT_OK(WriteRowGroup(*writer, buffer, providers.id_to_name,
+                                    symbols.id_to_name));
+  buffer.clear();
+  return arrow::Status::OK();
+}
 
-  std::shared_ptr<arrow::Array> provider_array;
-  std::shared_ptr<arrow::Array> symbol_array;
-  std::shared_ptr<arrow::Array> timestamp_array;
-  std::shared_ptr<arrow::Array> twap_array;
+arrow::Status ParquetOutputWriter::CloseOutputFile() {
+  ARROW_RETURN_NOT_OK(OutputRowChunk());
+  ARROW_RETURN_NOT_OK(writer->Close());
+  ARROW_RETURN_NOT_OK(outfile->Close());
+  return arrow::Status::OK();
+}
 
-  ARROW_RETURN_NOT_OK(provider_builder.Finish(&provider_array));
-  ARROW_RETURN_NOT_OK(symbol_builder.Finish(&symbol_array));
-  ARROW_RETURN_NOT_OK(timestamp_builder.Finish(&timestamp_array));
-  ARROW_RETURN_NOT_OK(twap_builder.Finish(&twap_array));
-  auto schema = arrow::schema({arrow::field("provider", arrow::utf8()),
-                               arrow::field("symbol", arrow::utf8()),
-                               arrow::field("timestamp", arrow::int64()),
-                               arrow::field("twap", arrow::float64())});
+AsyncParquetOutputWriter::AsyncParquetOutputWriter(
+    NameToId &providers, NameToId &symbols, const ParquetWriteOptions &options,
+    int queue_row_groups)
+    : writer(providers, symbols, options),
+      queue_row_groups(std::max(1, queue_row_groups)) {}
 
-  auto batch = arrow::RecordBatch::Make(
-      schema, provider_array->length(),
-      {provider_array, symbol_array, timestamp_array, twap_array});
+AsyncParquetOutputWriter::~AsyncParquetOutputWriter() { Stop(); }
 
-  std::shared_ptr<parquet::arrow::FileWriter> writer;
-  ARROW_ASSIGN_OR_RAISE(writer,
-                        parquet::arrow::FileWriter::Open(
-                            *schema, arrow::default_memory_pool(), outfile,
-                            parquet::WriterProperties::Builder().build(),
-                            parquet::ArrowWriterProperties::Builder().build()));
+arrow::Status AsyncParquetOutputWriter::OpenOutputFile(std::string filename) {
+  ARROW_RETURN_NOT_OK(writer.OpenOutputFile(filename));
+  buffer.reserve(writer.options.row_group_rows);
+  thread = std::thread([this] { Run(); });
+  return arrow::Status::OK();
+}
 
-  ARROW_RETURN_NOT_OK(writer->WriteRecordBatch(*batch));
-  ARROW_RETURN_NOT_OK(writer->Close());
+arrow::Status AsyncParquetOutputWriter::OutputRowChunk() {
+  if (buffer.size() == 0) {
+    return arrow::Status::OK();
+  }
+  // The names only grow, so a snapshot is stale when the size changes
+  if (provider_names == nullptr ||
+      provider_names->size() != writer.providers.id_to_name.size()) {
+    provider_names = std::make_shared<const std::vector<std::string>>(
+        writer.providers.id_to_name);
+  }
+  if (symbol_names == nullptr ||
+      symbol_names->size() != writer.symbols.id_to_name.size()) {
+    symbol_names = std::make_shared<const std::vector<std::string>>(
+        writer.symbols.id_to_name);
+  }
+  RowGroup row_group{std::move(buffer), provider_names, symbol_names};
+  buffer = OutputColumnBuffer{};
+  buffer.reserve(writer.options.row_group_rows);
+  {
+    std::unique_lock lock(mutex);
+    cv.wait(lock, [&] { return queue.size() < queue_row_groups; });
+    ARROW_RETURN_NOT_OK(status);
+    queue.push_back(std::move(row_group));
+  }
+  cv.notify_all();
+  return arrow::Status::OK();
+}
 
-  // Reset builders for next chunk
-  provider_builder.Reset();
-  symbol_builder.Reset();
-  timestamp_builder.Reset();
-  twap_builder.Reset();
+void AsyncParquetOutputWriter::Run() {
+  while (true) {
+    RowGroup row_group;
+    {
+      std::unique_lock lock(mutex);
+      cv.wait(lock, [&] { return closing || !queue.empty(); });
+      if (queue.empty()) {
+        return;
+      }
+      row_group = std::move(queue.front());
+    }
+    arrow::Status row_group_status;
+    if (status.ok()) {
+      row_group_status = ParquetOutputWriter::WriteRowGroup(
+          *writer.writer, row_group.columns, *row_group.provider_names,
+          *row_group.symbol_names);
+    }
+    {
+      // Only popped once written, so a full queue bounds the row groups in
+      // memory to queue_row_groups plus the one being filled
+      std::lock_guard lock(mutex);
+      queue.pop_front();
+      if (status.ok()) {
+        status = row_group_status;
+      }
+    }
+    cv.notify_all();
+  }
+}
 
-  buffered_rows = 0;
-  return arrow::Status::OK();
+void AsyncParquetOutputWriter::Stop() {
+  if (!thread.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard lock(mutex);
+    closing = true;
+  }
+  cv.notify_all();
+  thread.join();
 }
 
-arrow::Status ParquetOutputWriter::CloseOutputFile() {
-  ARROW_RETURN_NOT_OK(OutputRowChunk());
-  ARROW_RETURN_NOT_OK(outfile->Close());
+arrow::Status AsyncParquetOutputWriter::CloseOutputFile() {
+  arrow::Status chunk_status = OutputRowChunk();
+  {
+    // Wait for the queue to drain before stopping
+    std::unique_lock lock(mutex);
+    cv.wait(lock, [&] { return queue.empty(); });
+  }
+  Stop();
+  ARROW_RETURN_NOT_OK(chunk_status);
+  ARROW_RETURN_NOT_OK(status);
+  ARROW_RETURN_NOT_OK(writer.writer->Close());
+  ARROW_RETURN_NOT_OK(writer.outfile->Close());
   return arrow::Status::OK();
 }
 
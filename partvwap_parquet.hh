@@ -1,21 +1,71 @@
 #pragma once
 
 #include "partvwap.hh"
+#include "partvwap_merge.hh"
 #include <arrow/api.h>
+#include <arrow/util/compression.h>
+#include <parquet/arrow/writer.h>
 
+#include <algorithm>
 #include <cassert>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
+#include <future>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 struct ParquetChunk {
   int64_t num_rows;
-  const arrow::Int32Array *provider_indices;
-  const arrow::Int32Array *symbol_indices;
+  // Ids in providers and symbols of each row
+  std::span<const uint32_t> provider_ids;
+  std::span<const uint32_t> symbol_ids;
   const arrow::Int64Array *timestamp_array;
   const arrow::DoubleArray *price_array;
 
   const NameToId &providers;
   const NameToId &symbols;
+
+  // A view of the chunk's rows, pointing into its arrays
+  InputColumns Columns() const {
+    return InputColumns{
+        {timestamp_array->raw_values(), size_t(num_rows)},
+        provider_ids,
+        symbol_ids,
+        {price_array->raw_values(), size_t(num_rows)}};
+  }
+};
+
+struct ParquetReadOptions {
+  // Number of files to decode ahead on background threads while the caller
+  // consumes the current one; 0 decodes on the calling thread as it reads.
+  // Each prefetched file is held fully decoded in memory.
+  int prefetch_files = 0;
+  // Number of row groups of a file to decode concurrently, each with its
+  // own reader, passing their batches on in order; 0 decodes the row groups
+  // one after another
+  int row_group_threads = 0;
+  // Let Arrow decode the columns of a row group on its own thread pool
+  bool use_threads = false;
+  // Coalesce and issue the reads of a row group's column chunks up front
+  bool pre_buffer = true;
+  // Rows per record batch
+  int64_t batch_size = 64 * 1024;
+  // Read column chunks through a stream buffer of this many bytes instead
+  // of reading each one whole; 0 reads them whole
+  int64_t buffer_size = 0;
+  // Only decode the row groups whose timestamp statistics overlap
+  // [begin_nanos, end_nanos). The rows of those row groups are passed on
+  // whole, so some may lie outside it. Row groups without statistics are
+  // always decoded.
+  int64_t begin_nanos = std::numeric_limits<int64_t>::min();
+  int64_t end_nanos = std::numeric_limits<int64_t>::max();
 };
 
 arrow::Status WriteParquetFromInputRows(std::string filename,
@@ -23,59 +73,274 @@ arrow::Status WriteParquetFromInputRows(std::string filename,
                                         const NameToId &providers,
                                         const NameToId &symbols);
 
+// Read the provider, symbol, timestamp and price columns of a parquet file,
+// found by name; other columns are never decoded
 arrow::Status
 ReadParquetToInputRows(const std::string &filename,
                        std::function<arrow::Status(ParquetChunk)> f,
-                       NameToId &providers, NameToId &symbols);
+                       NameToId &providers, NameToId &symbols,
+                       const ParquetReadOptions &options = {});
+
+// Decode a whole parquet file into record batches, with the provider and
+// symbol columns dictionary encoded. Touches no shared state, so files can
+// be decoded on background threads.
+arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>>
+ReadParquetBatches(const std::string &filename,
+                   const ParquetReadOptions &options = {});
+
+// Translates the indices of dictionary encoded columns into ids of a
+// NameToId. The translation of a dictionary is cached and reused for as long
+// as consecutive batches share it, so each batch costs one gather. When the
+// translation is the identity, as for a dictionary of all the names in id
+// order, the indices are returned as they are without a gather.
+class ParquetDictionaryRemap {
+public:
+  // The id of each row of array, valid until the next call
+  arrow::Result<std::span<const uint32_t>>
+  Remap(const arrow::DictionaryArray &array, NameToId &names);
+
+private:
+  std::shared_ptr<arrow::Array> dictionary;
+  std::vector<uint32_t> dictionary_ids;
+  bool identity = false;
+  std::vector<uint32_t> ids;
+};
+
+// The remaps for the provider and symbol columns of a sequence of batches
+struct ParquetBatchRemap {
+  ParquetDictionaryRemap providers;
+  ParquetDictionaryRemap symbols;
+};
+
+// Resolve the dictionaries of a batch from ReadParquetBatches into providers
+// and symbols, then call f with it. remap carries the cached dictionaries
+// from one batch to the next.
+arrow::Status
+ParquetChunkFromBatch(const arrow::RecordBatch &batch,
+                      std::function<arrow::Status(ParquetChunk)> f,
+                      NameToId &providers, NameToId &symbols,
+                      ParquetBatchRemap &remap);
+
+// The smallest and largest timestamp in a parquet file, from the column
+// statistics in its footer. An empty file has min > max.
+arrow::Result<std::pair<int64_t, int64_t>>
+ReadParquetTimestampRange(const std::string &filename);
+
+// Open a parquet file to be read one record batch at a time as the caller
+// asks for them, with the provider and symbol columns dictionary encoded.
+// Lets several files be read in step with one another.
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>>
+OpenParquetBatchReader(const std::string &filename,
+                       const ParquetReadOptions &options = {});
+
+// One input of a KWayMerge: the batches of a reader from
+// OpenParquetBatchReader as InputColumns with ids in providers and symbols.
+// An error ends the input and is kept for ReadStatus.
+class ParquetMergeSource {
+public:
+  ParquetMergeSource(std::shared_ptr<arrow::RecordBatchReader> reader,
+                     NameToId &providers, NameToId &symbols)
+      : reader(std::move(reader)), providers(&providers), symbols(&symbols) {}
+
+  // The next non-empty batch, valid until the next call, or an empty one at
+  // the end of the input
+  InputColumns Next();
+
+  const arrow::Status &ReadStatus() const { return status; }
+
+private:
+  std::shared_ptr<arrow::RecordBatchReader> reader;
+  NameToId *providers;
+  NameToId *symbols;
+  std::shared_ptr<arrow::RecordBatch> batch;
+  ParquetBatchRemap remap;
+  arrow::Status status;
+};
+
+// Read parquet files in order, calling f with an InputColumns view of each
+// record batch. The views point straight into the Arrow buffers.
+template <typename FilenameContainer, typename ColumnsCallback>
+arrow::Status
+ReadManyParquetFileColumns(const FilenameContainer &filenames,
+                           ColumnsCallback &&f, NameToId &providers,
+                           NameToId &symbols,
+                           const ParquetReadOptions &options = {}) {
+  auto chunk_callback = [&](ParquetChunk chunk) -> arrow::Status {
+    InputColumns columns = chunk.Columns();
+    if constexpr (std::is_void_v<decltype(f(columns))>) {
+      f(columns);
+    } else {
+      ARROW_RETURN_NOT_OK(f(columns));
+    }
+    return arrow::Status::OK();
+  };
+
+  if (options.prefetch_files <= 0) {
+    for (const auto &filename : filenames) {
+      ARROW_RETURN_NOT_OK(ReadParquetToInputRows(filename, chunk_callback,
+                                                 providers, symbols, options));
+    }
+    return arrow::Status::OK();
+  }
+
+  // Keep up to prefetch_files decodes in flight ahead of the file being
+  // consumed, and consume them in order so timestamps stay sorted
+  std::deque<std::future<
+      arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>>>>
+      pending;
+  ParquetBatchRemap remap;
+  auto next_file = std::begin(filenames);
+  auto fill = [&] {
+    while (next_file != std::end(filenames) &&
+           pending.size() <= size_t(options.prefetch_files)) {
+      pending.push_back(
+          std::async(std::launch::async,
+                     [&options, filename = std::string(*next_file)] {
+                       return ReadParquetBatches(filename, options);
+                     }));
+      ++next_file;
+    }
+  };
+  for (fill(); !pending.empty(); fill()) {
+    auto batches = pending.front().get();
+    pending.pop_front();
+    ARROW_RETURN_NOT_OK(batches.status());
+    for (const auto &batch : *batches) {
+      ARROW_RETURN_NOT_OK(ParquetChunkFromBatch(*batch, chunk_callback,
+                                                providers, symbols, remap));
+    }
+  }
+  return arrow::Status::OK();
+}
+
+// Read parquet files whose rows overlap in time, such as one file per venue
+// over the same day, merged into timestamp order; each file must be in
+// order on its own. Every file is open at once, holding one record batch,
+// and f is called with InputColumns runs of rows from a KWayMerge over
+// them. Rows with equal timestamps come in the order of the filenames.
+// Files are read on the calling thread, so options.prefetch_files and
+// options.row_group_threads do not apply. The first read error in any file
+// stops the merge and is returned.
+template <typename FilenameContainer, typename ColumnsCallback>
+arrow::Status
+ReadMergedParquetFileColumns(const FilenameContainer &filenames,
+                             ColumnsCallback &&f, NameToId &providers,
+                             NameToId &symbols,
+                             const ParquetReadOptions &options = {}) {
+  std::vector<ParquetMergeSource> sources;
+  for (const auto &filename : filenames) {
+    ARROW_ASSIGN_OR_RAISE(
+        auto reader, OpenParquetBatchReader(std::string(filename), options));
+    sources.emplace_back(std::move(reader), providers, symbols);
+  }
+  arrow::Status status;
+  KWayMerge merge(sources);
+  merge.Run([&](const InputColumns &columns) {
+    // A source that failed looks exhausted to the merge, which would carry
+    // on without its rows
+    for (const ParquetMergeSource &source : sources) {
+      if (!source.ReadStatus().ok()) {
+        status = source.ReadStatus();
+        return false;
+      }
+    }
+    if constexpr (std::is_void_v<decltype(f(columns))>) {
+      f(columns);
+    } else {
+      status = f(columns);
+    }
+    return status.ok();
+  });
+  ARROW_RETURN_NOT_OK(status);
+  // A source can also fail on the last refill, with no run after it
+  for (const ParquetMergeSource &source : sources) {
+    ARROW_RETURN_NOT_OK(source.ReadStatus());
+  }
+  return arrow::Status::OK();
+}
 
 template <typename FilenameContainer, typename RowCallback>
 arrow::Status ReadManyParquetFiles(const FilenameContainer &filenames,
                                    RowCallback &&f, NameToId &providers,
-                                   NameToId &symbols) {
-  int64_t last_ts = std::numeric_limits<int64_t>::min();
-  for (const auto &filename : filenames) {
-    ARROW_RETURN_NOT_OK(ReadParquetToInputRows(
-        filename,
-        [&](ParquetChunk chunk) -> arrow::Status {
-          for (int64_t i = 0; i < chunk.num_rows; i++) {
-            int64_t ts = chunk.timestamp_array->Value(i);
-            assert(ts >= last_ts);
-            last_ts = ts;
-            InputRow row{
-                ts, static_cast<uint32_t>(chunk.provider_indices->Value(i)),
-                static_cast<uint32_t>(chunk.symbol_indices->Value(i)),
-                chunk.price_array->Value(i)};
-            if constexpr (std::is_void_v<decltype(f(row))>) {
-              f(row);
-            } else {
-              ARROW_RETURN_NOT_OK(f(row));
-            }
+                                   NameToId &symbols,
+                                   const ParquetReadOptions &options = {}) {
+  return ReadManyParquetFileColumns(
+      filenames,
+      [&](const InputColumns &columns) -> arrow::Status {
+        for (size_t i = 0; i < columns.size(); i++) {
+          InputRow row = columns[i];
+          if constexpr (std::is_void_v<decltype(f(row))>) {
+            f(row);
+          } else {
+            ARROW_RETURN_NOT_OK(f(row));
           }
-          return arrow::Status::OK();
-        },
-        providers, symbols));
-  }
-  return arrow::Status::OK();
+        }
+        return arrow::Status::OK();
+      },
+      providers, symbols, options);
 }
 
+struct ParquetWriteOptions {
+  // Output rows buffered and written as each row group
+  int64_t row_group_rows = 1024 * 1024;
+  arrow::Compression::type compression = arrow::Compression::UNCOMPRESSED;
+};
+
+// Output rows in columns, the unit a row group is written from
+struct OutputColumnBuffer {
+  std::vector<uint32_t> provider_ids;
+  std::vector<uint32_t> symbol_ids;
+  std::vector<int64_t> ts_nanos;
+  std::vector<double> twaps;
+
+  size_t size() const { return ts_nanos.size(); }
+
+  void push_back(const OutputRow &row) {
+    provider_ids.push_back(row.provider_id);
+    symbol_ids.push_back(row.symbol_id);
+    ts_nanos.push_back(row.ts_nanos);
+    twaps.push_back(row.twap);
+  }
+
+  void reserve(size_t n) {
+    provider_ids.reserve(n);
+    symbol_ids.reserve(n);
+    ts_nanos.reserve(n);
+    twaps.reserve(n);
+  }
+
+  void clear() {
+    provider_ids.clear();
+    symbol_ids.clear();
+    ts_nanos.clear();
+    twaps.clear();
+  }
+};
+
+// Writes output rows to one parquet file, a row group at a time. The
+// provider and symbol columns are dictionary encoded with the ids as the
+// indices, so no names are copied per row.
 struct ParquetOutputWriter {
   std::shared_ptr<arrow::io::FileOutputStream> outfile;
+  std::unique_ptr<parquet::arrow::FileWriter> writer;
   NameToId &providers;
   NameToId &symbols;
-  int64_t buffered_rows = 0;
+  const ParquetWriteOptions options;
+  OutputColumnBuffer buffer;
 
-  explicit ParquetOutputWriter(NameToId &providers, NameToId &symbols)
-      : providers(providers), symbols(symbols) {}
+  explicit ParquetOutputWriter(NameToId &providers, NameToId &symbols,
+                               const ParquetWriteOptions &options = {})
+      : providers(providers), symbols(symbols), options(options) {}
 
-  arrow::StringBuilder provider_builder;
-  arrow::StringBuilder symbol_builder;
-  arrow::Int64Builder timestamp_builder;
-  arrow::DoubleBuilder twap_builder;
+  static std::shared_ptr<arrow::Schema> Schema();
 
-  std::shared_ptr<arrow::StringArray> provider_array;
-  std::shared_ptr<arrow::StringArray> symbol_array;
-  std::shared_ptr<arrow::Int64Array> timestamp_array;
-  std::shared_ptr<arrow::DoubleArray> twap_array;
+  // Write columns as one row group, naming the ids from the id_to_name
+  // vectors of the providers and symbols
+  static arrow::Status
+  WriteRowGroup(parquet::arrow::FileWriter &writer,
+                const OutputColumnBuffer &columns,
+                const std::vector<std::string> &provider_names,
+                const std::vector<std::string> &symbol_names);
 
   arrow::Status OpenOutputFile(std::string filename);
   arrow::Status AppendOutputRow(const OutputRow &row);
@@ -83,5 +348,63 @@ struct ParquetOutputWriter {
   arrow::Status CloseOutputFile();
 };
 
+// Writes output rows like ParquetOutputWriter, but encodes, compresses and
+// writes each row group on a background thread. Full row groups are handed
+// over through a queue of at most queue_row_groups, and AppendOutputRow
+// blocks while it is full. A background error is returned by the next
+// AppendOutputRow that hands over a row group, or by CloseOutputFile.
+class AsyncParquetOutputWriter {
+public:
+  AsyncParquetOutputWriter(NameToId &providers, NameToId &symbols,
+                           const ParquetWriteOptions &options = {},
+                           int queue_row_groups = 2);
+  AsyncParquetOutputWriter(const AsyncParquetOutputWriter &) = delete;
+  AsyncParquetOutputWriter &
+  operator=(const AsyncParquetOutputWriter &) = delete;
+  // If the file was not closed, lets the background thread write the row
+  // groups already queued, then stops it. Rows still buffered are dropped
+  // and the file is left without a footer.
+  ~AsyncParquetOutputWriter();
+
+  arrow::Status OpenOutputFile(std::string filename);
+
+  arrow::Status AppendOutputRow(const OutputRow &row) {
+    buffer.push_back(row);
+    if (int64_t(buffer.size()) >= writer.options.row_group_rows) {
+      return OutputRowChunk();
+    }
+    return arrow::Status::OK();
+  }
+
+  // Hand the buffered rows to the background thread as a row group
+  arrow::Status OutputRowChunk();
+  arrow::Status CloseOutputFile();
+
+private:
+  struct RowGroup {
+    OutputColumnBuffer columns;
+    // Snapshots of the names, as the caller keeps adding to them
+    std::shared_ptr<const std::vector<std::string>> provider_names;
+    std::shared_ptr<const std::vector<std::string>> symbol_names;
+  };
+
+  void Run();
+  void Stop();
+
+  ParquetOutputWriter writer;
+  const size_t queue_row_groups;
+  OutputColumnBuffer buffer;
+  std::shared_ptr<const std::vector<std::string>> provider_names;
+  std::shared_ptr<const std::vector<std::string>> symbol_names;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<RowGroup> queue;
+  bool closing = false;
+  // The first error of the background thread
+  arrow::Status status;
+  std::thread thread;
+};
+
 // Find all parquet files in a directory and return them sorted
 std::vector<std::string> FindAndSortParquetFiles(std::string_view input_dir);
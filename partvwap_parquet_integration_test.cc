@@ -8,6 +8,7 @@
 #include <absl/strings/str_cat.h>
 #include <absl/strings/string_view.h>
 #include <absl/time/time.h>
+#include <algorithm>
 #include <array>
 #include <arrow/api.h>
 #include <arrow/io/api.h>
@@ -15,9 +16,11 @@
 #include <arrow/testing/gtest_util.h>
 #include <cstdlib>
 #include <filesystem>
+#include <fstream>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <iostream>
+#include <iterator>
 #include <parquet/arrow/reader.h>
 #include <parquet/arrow/writer.h>
 #include <string>
@@ -59,4 +62,38 @@ TEST(ParquetIOIntegration, EndToEndTest) {
   ASSERT_TRUE(std::filesystem::exists(buffered_parquet_twap_file.tmp_filename));
   ASSERT_GT(std::filesystem::file_size(buffered_parquet_twap_file.tmp_filename),
             0);
-}
\ No newline at end of file
+
+  TempFileForTest parallel_parquet_twap_file;
+
+  cmd = "./partvwap_parquet_io " + std::string(test_dir.tmp_dirname) + " " +
+        parallel_parquet_twap_file.tmp_filename + " --compute_threads=4";
+  cmd_output = RunCommandForTest(cmd.c_str());
+  std::cout << "Command output: " << cmd_output << std::endl;
+
+  // Same rows in the same order, so the same bytes
+  std::ifstream serial_output(parquet_twap_file.tmp_filename,
+                              std::ios::binary);
+  std::ifstream parallel_output(parallel_parquet_twap_file.tmp_filename,
+                                std::ios::binary);
+  EXPECT_TRUE(std::equal(std::istreambuf_iterator<char>(serial_output),
+                         std::istreambuf_iterator<char>(),
+                         std::istreambuf_iterator<char>(parallel_output),
+                         std::istreambuf_iterator<char>()));
+
+  TempFileForTest time_sliced_parquet_twap_file;
+
+  cmd = "./partvwap_parquet_io " + std::string(test_dir.tmp_dirname) + " " +
+        time_sliced_parquet_twap_file.tmp_filename +
+        " --time_slice_threads=3";
+  cmd_output = RunCommandForTest(cmd.c_str());
+  std::cout << "Command output: " << cmd_output << std::endl;
+
+  serial_output.clear();
+  serial_output.seekg(0);
+  std::ifstream time_sliced_output(time_sliced_parquet_twap_file.tmp_filename,
+                                   std::ios::binary);
+  EXPECT_TRUE(std::equal(std::istreambuf_iterator<char>(serial_output),
+                         std::istreambuf_iterator<char>(),
+                         std::istreambuf_iterator<char>(time_sliced_output),
+                         std::istreambuf_iterator<char>()));
+}
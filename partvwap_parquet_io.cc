@@ -1,5 +1,7 @@
 #include "partvwap.hh"
+#include "partvwap_parallel.hh"
 #include "partvwap_parquet.hh"
+#include "partvwap_reorder.hh"
 #include "perf_counter_scope.hh"
 #include <absl/flags/flag.h>
 #include <absl/flags/parse.h>
@@ -9,11 +11,139 @@
 #include <arrow/io/api.h>
 #include <filesystem>
 #include <iostream>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
 #include <vector>
 
 ABSL_FLAG(bool, buffer_in_memory, false,
           "Read from Parquet into a memory buffer then time the computation "
           "reading from that");
+ABSL_FLAG(int64_t, max_idle_windows, std::numeric_limits<int64_t>::max(),
+          "Number of windows without input to report after a window with "
+          "input; the rest of an idle gap is skipped");
+ABSL_FLAG(int, compute_threads, 1,
+          "Number of threads to partition the TWAP series over");
+ABSL_FLAG(int, prefetch_files, 2,
+          "Number of parquet files to decode ahead on background threads");
+ABSL_FLAG(int, parquet_row_group_threads, 0,
+          "Number of row groups of a parquet file to decode concurrently");
+ABSL_FLAG(bool, parquet_use_threads, false,
+          "Decode the columns of a parquet row group on Arrow's thread pool");
+ABSL_FLAG(bool, parquet_pre_buffer, true,
+          "Coalesce the reads of a parquet row group's columns up front");
+ABSL_FLAG(int64_t, parquet_batch_size, 64 * 1024,
+          "Rows per record batch read from parquet");
+ABSL_FLAG(int64_t, parquet_buffer_size, 0,
+          "Read parquet column chunks through a buffer of this many bytes; 0 "
+          "reads them whole");
+ABSL_FLAG(bool, merge_inputs, false,
+          "Merge the input files into timestamp order as they are read, for "
+          "files that each hold sorted rows over the same stretch of time, "
+          "e.g. one per venue; all are open at once. Otherwise the files are "
+          "read one after another in name order. Not used with "
+          "--time_slice_threads.");
+ABSL_FLAG(std::optional<absl::Duration>, max_lateness, std::nullopt,
+          "Put input rows up to this far behind the latest row back in "
+          "timestamp order before computing; rows later than that are "
+          "counted and dropped. Unset trusts the input to be in order. Not "
+          "used with --time_slice_threads.");
+ABSL_FLAG(int, time_slice_threads, 1,
+          "Number of threads to compute time slices of the input on, one "
+          "slice per input file; not used with --buffer_in_memory");
+ABSL_FLAG(std::string, output_compression, "uncompressed",
+          "Compression codec of the output parquet file, e.g. snappy or zstd "
+          "where Arrow was built with it");
+ABSL_FLAG(int64_t, output_row_group_rows, 1024 * 1024,
+          "Rows per row group of the output parquet file");
+ABSL_FLAG(int, output_queue_row_groups, 2,
+          "Number of output row groups queued for the background writer "
+          "before the computation waits for it");
+
+// Compute with one time slice per input file, each slice reading the files
+// that overlap it with its own dictionaries. The dictionaries are merged in
+// file order before a slice's output is written, as a serial read would, and
+// the slice's ids are translated into the merged ones.
+template <typename OutputRowSink>
+arrow::Status ComputeTWAPParquetTimeSliced(
+    const std::vector<std::string> &parquet_files,
+    OutputRowSink &output_row_sink, const TWAPOptions &options,
+    const ParquetReadOptions &read_options, int num_threads,
+    NameToId &providers, NameToId &symbols, int64_t &input_rows) {
+  std::vector<std::string> files;
+  std::vector<std::pair<int64_t, int64_t>> file_ranges;
+  std::vector<int64_t> slice_start_nanos;
+  for (const auto &filename : parquet_files) {
+    ARROW_ASSIGN_OR_RAISE(auto range, ReadParquetTimestampRange(filename));
+    if (range.first <= range.second) {
+      files.push_back(filename);
+      file_ranges.push_back(range);
+      slice_start_nanos.push_back(range.first);
+    }
+  }
+
+  struct SliceNames {
+    NameToId providers;
+    NameToId symbols;
+    int64_t input_rows = 0;
+  };
+  std::vector<SliceNames> slice_names(files.size() + 1);
+  try {
+    ComputeTWAPTimeSliced(
+        [&](size_t slice, int64_t begin_nanos, int64_t end_nanos,
+            auto &&row_acceptor) {
+          std::vector<std::string> slice_files;
+          for (size_t i = 0; i < files.size(); i++) {
+            if (file_ranges[i].second >= begin_nanos &&
+                file_ranges[i].first < end_nanos) {
+              slice_files.push_back(files[i]);
+            }
+          }
+          // Files that straddle the slice boundaries are only read as far
+          // as the row groups that overlap the slice
+          ParquetReadOptions slice_read_options = read_options;
+          slice_read_options.begin_nanos = begin_nanos;
+          slice_read_options.end_nanos = end_nanos;
+          SliceNames &names = slice_names[slice];
+          auto status = ReadManyParquetFileColumns(
+              slice_files,
+              [&](const InputColumns &columns) {
+                row_acceptor(columns);
+                // A row group on a slice boundary is read by both slices
+                names.input_rows +=
+                    std::lower_bound(columns.ts_nanos.begin(),
+                                     columns.ts_nanos.end(), end_nanos) -
+                    std::lower_bound(columns.ts_nanos.begin(),
+                                     columns.ts_nanos.end(), begin_nanos);
+              },
+              names.providers, names.symbols, slice_read_options);
+          if (!status.ok()) {
+            throw std::runtime_error(status.ToString());
+          }
+        },
+        output_row_sink,
+        [&](size_t slice, TWAPSliceResult &result) {
+          SliceNames &names = slice_names[slice];
+          std::vector<uint32_t> provider_ids;
+          for (const auto &name : names.providers.id_to_name) {
+            provider_ids.push_back(providers.IDFromName(name));
+          }
+          std::vector<uint32_t> symbol_ids;
+          for (const auto &name : names.symbols.id_to_name) {
+            symbol_ids.push_back(symbols.IDFromName(name));
+          }
+          result.RemapIds(provider_ids, symbol_ids);
+          input_rows += names.input_rows;
+          names = SliceNames{};
+        },
+        slice_start_nanos, options, num_threads);
+  } catch (const std::runtime_error &e) {
+    return arrow::Status::IOError(e.what());
+  }
+  return arrow::Status::OK();
+}
 
 int main(int argc, char **argv) {
   std::vector<char *> args = absl::ParseCommandLine(argc, argv);
@@ -29,6 +159,10 @@ int main(int argc, char **argv) {
               << std::endl;
     return 1;
   }
+  if (absl::GetFlag(FLAGS_max_idle_windows) < 0) {
+    std::cerr << "Error: --max_idle_windows must not be negative" << std::endl;
+    return 1;
+  }
 
   std::string input_dir = args[1];
   std::string output_file = args[2];
@@ -50,7 +184,27 @@ int main(int argc, char **argv) {
 
   NameToId providers;
   NameToId symbols;
-  ParquetOutputWriter writer(providers, symbols);
+  auto output_compression = arrow::util::Codec::GetCompressionType(
+      absl::GetFlag(FLAGS_output_compression));
+  if (!output_compression.ok()) {
+    std::cerr << "Error: Unknown --output_compression: "
+              << output_compression.status().ToString() << std::endl;
+    return 1;
+  }
+  const std::optional<absl::Duration> max_lateness =
+      absl::GetFlag(FLAGS_max_lateness);
+  if (max_lateness && *max_lateness < absl::ZeroDuration()) {
+    std::cerr << "Error: --max_lateness must not be negative" << std::endl;
+    return 1;
+  }
+  const int64_t max_lateness_nanos =
+      max_lateness ? absl::ToInt64Nanoseconds(*max_lateness) : 0;
+  ParquetWriteOptions write_options{
+      .row_group_rows = absl::GetFlag(FLAGS_output_row_group_rows),
+      .compression = *output_compression};
+  AsyncParquetOutputWriter writer(
+      providers, symbols, write_options,
+      absl::GetFlag(FLAGS_output_queue_row_groups));
 
   auto open_status = writer.OpenOutputFile(output_file);
   if (!open_status.ok()) {
@@ -59,16 +213,32 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  std::vector<InputRow> input_row_buffer;
+  InputColumnBuffer input_row_buffer;
+  ParquetReadOptions read_options{
+      .prefetch_files = absl::GetFlag(FLAGS_prefetch_files),
+      .row_group_threads = absl::GetFlag(FLAGS_parquet_row_group_threads),
+      .use_threads = absl::GetFlag(FLAGS_parquet_use_threads),
+      .pre_buffer = absl::GetFlag(FLAGS_parquet_pre_buffer),
+      .batch_size = absl::GetFlag(FLAGS_parquet_batch_size),
+      .buffer_size = absl::GetFlag(FLAGS_parquet_buffer_size)};
+
+  // Read every input file in timestamp order, calling f with columns
+  const bool merge_inputs = absl::GetFlag(FLAGS_merge_inputs);
+  auto read_parquet_files = [&](auto &&f) {
+    if (merge_inputs) {
+      return ReadMergedParquetFileColumns(parquet_files, f, providers,
+                                          symbols, read_options);
+    }
+    return ReadManyParquetFileColumns(parquet_files, f, providers, symbols,
+                                      read_options);
+  };
 
   if (absl::GetFlag(FLAGS_buffer_in_memory)) {
-    auto buffer_status = ReadManyParquetFiles(
-        parquet_files,
-        [&](const InputRow &row) {
-          input_row_buffer.push_back(row);
-          return arrow::Status::OK();
-        },
-        providers, symbols);
+    auto buffer_status = read_parquet_files([&](const InputColumns &columns) {
+      for (size_t i = 0; i < columns.size(); i++) {
+        input_row_buffer.push_back(columns[i]);
+      }
+    });
     if (!buffer_status.ok()) {
       std::cerr << "Error reading parquet files into memory buffer: "
                 << buffer_status.ToString() << std::endl;
@@ -83,32 +253,51 @@ int main(int argc, char **argv) {
   absl::Time start_time = absl::Now();
   absl::Time end_time;
   int64_t input_rows = 0;
+  int64_t late_rows = 0;
   int64_t output_rows = 0;
   {
     PerfCounterScope scope("ComputeTWAP");
-    ComputeTWAP(
-        [&](auto &&row_acceptor) {
-          if (absl::GetFlag(FLAGS_buffer_in_memory)) {
-            for (const auto &row : input_row_buffer) {
-              row_acceptor(row);
-              input_rows++;
-            }
-          } else {
-            // Read all parquet files and process the data
-            read_status &= ReadManyParquetFiles(
-                parquet_files,
-                [&](const InputRow &row) -> arrow::Status {
-                  row_acceptor(row);
-                  input_rows++;
-                  return arrow::Status::OK();
-                },
-                providers, symbols);
-          }
-        },
-        [&](const OutputRow &row) {
-          output_rows++;
-          write_status &= writer.AppendOutputRow(row);
+    auto input_row_provider = [&](auto &&row_acceptor) {
+      auto late_row_sink = [&](const InputRow &) { late_rows++; };
+      ReorderBuffer reorder(max_lateness_nanos, row_acceptor, late_row_sink);
+      auto accept_columns = [&](const InputColumns &columns) {
+        if (max_lateness) {
+          reorder.AddColumns(columns);
+        } else {
+          row_acceptor(columns);
+        }
+      };
+      if (absl::GetFlag(FLAGS_buffer_in_memory)) {
+        accept_columns(input_row_buffer.View());
+        input_rows += input_row_buffer.size();
+      } else {
+        // Read all parquet files and process the data
+        read_status &= read_parquet_files([&](const InputColumns &columns) {
+          accept_columns(columns);
+          input_rows += columns.size();
         });
+      }
+      reorder.Flush();
+    };
+    auto output_row_sink = [&](const OutputRow &row) {
+      output_rows++;
+      write_status &= writer.AppendOutputRow(row);
+    };
+    TWAPOptions options{.max_idle_windows =
+                            absl::GetFlag(FLAGS_max_idle_windows)};
+    if (absl::GetFlag(FLAGS_time_slice_threads) > 1 &&
+        !absl::GetFlag(FLAGS_buffer_in_memory) && !max_lateness &&
+        !merge_inputs) {
+      read_status &= ComputeTWAPParquetTimeSliced(
+          parquet_files, output_row_sink, options, read_options,
+          absl::GetFlag(FLAGS_time_slice_threads), providers, symbols,
+          input_rows);
+    } else if (absl::GetFlag(FLAGS_compute_threads) > 1) {
+      ComputeTWAPParallel(input_row_provider, output_row_sink, options,
+                          absl::GetFlag(FLAGS_compute_threads));
+    } else {
+      ComputeTWAP(input_row_provider, output_row_sink, options);
+    }
     scope.IncrementNumRows(input_rows);
     end_time = absl::Now();
   }
@@ -133,6 +322,10 @@ int main(int argc, char **argv) {
 
   std::cout << "Successfully processed " << input_rows << " rows; wrote "
             << output_rows << " results to " << output_file << std::endl;
+  if (max_lateness) {
+    std::cout << "Dropped " << late_rows << " rows more than "
+              << absl::FormatDuration(*max_lateness) << " late" << std::endl;
+  }
   std::cout << "Time taken to compute TWAP: "
             << absl::FormatDuration(end_time - start_time) << std::endl
             << "Per input row " << (end_time - start_time) / input_rows
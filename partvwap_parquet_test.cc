@@ -7,6 +7,7 @@
 #include <absl/strings/str_cat.h>
 #include <absl/strings/string_view.h>
 #include <absl/time/time.h>
+#include <algorithm>
 #include <arrow/api.h>
 #include <arrow/io/api.h>
 #include <arrow/ipc/api.h>
@@ -22,6 +23,7 @@
 #include <iostream>
 #include <parquet/arrow/reader.h>
 #include <parquet/arrow/writer.h>
+#include <tuple>
 #include <vector>
 
 TEST(ComputeTWAP, BasicThroughParquet) {
@@ -49,6 +51,383 @@ TEST(ComputeTWAP, BasicThroughParquet) {
               testing::ElementsAre(OutputRow{1005000000000, 0, 0, 100.0}));
 };
 
+TEST(ReadManyParquetFiles, PrefetchKeepsFileOrder) {
+  NameToId providers;
+  NameToId symbols;
+  std::vector<TempFileForTest> tmp_files(5);
+  std::vector<std::string> filenames;
+  std::vector<InputRow> written;
+  int64_t ts = 1000000000000;
+  for (size_t file = 0; file < tmp_files.size(); file++) {
+    std::vector<InputRow> rows;
+    for (int i = 0; i < 1000; i++) {
+      ts += 1000000;
+      rows.push_back(InputRow{
+          ts, providers.IDFromName(absl::StrCat("provider", i % 3)),
+          symbols.IDFromName(absl::StrCat("symbol", i % 7)),
+          100.0 + file + i / 1000.0});
+    }
+    ASSERT_OK(WriteParquetFromInputRows(tmp_files[file].tmp_filename, rows,
+                                        providers, symbols));
+    filenames.push_back(tmp_files[file].tmp_filename);
+    written.insert(written.end(), rows.begin(), rows.end());
+  }
+
+  for (int prefetch_files : {0, 1, 3, 10}) {
+    NameToId read_providers;
+    NameToId read_symbols;
+    std::vector<InputRow> read;
+    ASSERT_OK(ReadManyParquetFiles(
+        filenames, [&](const InputRow &row) { read.push_back(row); },
+        read_providers, read_symbols,
+        ParquetReadOptions{.prefetch_files = prefetch_files}));
+    ASSERT_EQ(read.size(), written.size()) << prefetch_files;
+    for (size_t i = 0; i < read.size(); i++) {
+      EXPECT_EQ(read[i].ts_nanos, written[i].ts_nanos);
+      EXPECT_EQ(read[i].price, written[i].price);
+    }
+    EXPECT_EQ(read_symbols.id_to_name, symbols.id_to_name);
+  }
+}
+
+TEST(ReadManyParquetFiles, PrefetchReportsMissingFile) {
+  NameToId providers;
+  NameToId symbols;
+  EXPECT_FALSE(ReadManyParquetFiles(
+                   std::vector<std::string>{"/nonexistent/file.parquet"},
+                   [](const InputRow &row) {}, providers, symbols,
+                   ParquetReadOptions{.prefetch_files = 2})
+                   .ok());
+}
+
+TEST(ReadManyParquetFiles, ProjectsColumnsByName) {
+  // A vendor file with the input columns out of order between others, in
+  // several row groups
+  std::vector<InputRow> written;
+  arrow::StringBuilder venue_builder;
+  arrow::DoubleBuilder price_builder;
+  arrow::StringBuilder symbol_builder;
+  arrow::Int64Builder size_builder;
+  arrow::Int64Builder timestamp_builder;
+  arrow::StringBuilder provider_builder;
+  for (int i = 0; i < 10500; i++) {
+    written.push_back(InputRow{1000000000000 + i * 1000000, uint32_t(i % 3),
+                               uint32_t(i % 7), 100.0 + i / 1000.0});
+    ASSERT_OK(venue_builder.Append(absl::StrCat("venue", i % 5)));
+    ASSERT_OK(price_builder.Append(written.back().price));
+    ASSERT_OK(symbol_builder.Append(absl::StrCat("symbol", i % 7)));
+    ASSERT_OK(size_builder.Append(i));
+    ASSERT_OK(timestamp_builder.Append(written.back().ts_nanos));
+    ASSERT_OK(provider_builder.Append(absl::StrCat("provider", i % 3)));
+  }
+  auto schema = arrow::schema({arrow::field("venue", arrow::utf8()),
+                               arrow::field("price", arrow::float64()),
+                               arrow::field("symbol", arrow::utf8()),
+                               arrow::field("size", arrow::int64()),
+                               arrow::field("timestamp", arrow::int64()),
+                               arrow::field("provider", arrow::utf8())});
+  std::vector<std::shared_ptr<arrow::Array>> arrays(6);
+  ASSERT_OK(venue_builder.Finish(&arrays[0]));
+  ASSERT_OK(price_builder.Finish(&arrays[1]));
+  ASSERT_OK(symbol_builder.Finish(&arrays[2]));
+  ASSERT_OK(size_builder.Finish(&arrays[3]));
+  ASSERT_OK(timestamp_builder.Finish(&arrays[4]));
+  ASSERT_OK(provider_builder.Finish(&arrays[5]));
+  TempFileForTest tmp_file;
+  std::shared_ptr<arrow::io::FileOutputStream> outfile;
+  ASSERT_OK(arrow::io::FileOutputStream::Open(tmp_file.tmp_filename)
+                .Value(&outfile));
+  ASSERT_OK(parquet::arrow::WriteTable(*arrow::Table::Make(schema, arrays),
+                                       arrow::default_memory_pool(), outfile,
+                                       2100));
+  ASSERT_OK(outfile->Close());
+
+  ASSERT_OK_AND_ASSIGN(auto range,
+                       ReadParquetTimestampRange(tmp_file.tmp_filename));
+  EXPECT_EQ(range.first, written.front().ts_nanos);
+  EXPECT_EQ(range.second, written.back().ts_nanos);
+
+  for (ParquetReadOptions options :
+       {ParquetReadOptions{},
+        ParquetReadOptions{.row_group_threads = 3, .batch_size = 1000},
+        ParquetReadOptions{.use_threads = true,
+                           .pre_buffer = false,
+                           .buffer_size = 4096},
+        ParquetReadOptions{.prefetch_files = 1, .row_group_threads = 10}}) {
+    NameToId providers;
+    NameToId symbols;
+    std::vector<InputRow> read;
+    ASSERT_OK(ReadManyParquetFiles(
+        std::vector<std::string>{tmp_file.tmp_filename},
+        [&](const InputRow &row) { read.push_back(row); }, providers, symbols,
+        options));
+    ASSERT_EQ(read.size(), written.size());
+    for (size_t i = 0; i < read.size(); i++) {
+      EXPECT_EQ(read[i].ts_nanos, written[i].ts_nanos);
+      EXPECT_EQ(read[i].price, written[i].price);
+      EXPECT_EQ(providers[read[i].provider_id],
+                absl::StrCat("provider", i % 3));
+      EXPECT_EQ(symbols[read[i].symbol_id], absl::StrCat("symbol", i % 7));
+    }
+  }
+}
+
+TEST(ReadManyParquetFiles, SkipsRowGroupsOutsideTimeRange) {
+  arrow::StringBuilder provider_builder;
+  arrow::StringBuilder symbol_builder;
+  arrow::Int64Builder timestamp_builder;
+  arrow::DoubleBuilder price_builder;
+  for (int i = 0; i < 10000; i++) {
+    ASSERT_OK(provider_builder.Append("provider"));
+    ASSERT_OK(symbol_builder.Append(absl::StrCat("symbol", i % 7)));
+    ASSERT_OK(timestamp_builder.Append(1000000000000 + i * 1000000));
+    ASSERT_OK(price_builder.Append(100.0 + i));
+  }
+  auto schema = arrow::schema({arrow::field("provider", arrow::utf8()),
+                               arrow::field("symbol", arrow::utf8()),
+                               arrow::field("timestamp", arrow::int64()),
+                               arrow::field("price", arrow::float64())});
+  std::vector<std::shared_ptr<arrow::Array>> arrays(4);
+  ASSERT_OK(provider_builder.Finish(&arrays[0]));
+  ASSERT_OK(symbol_builder.Finish(&arrays[1]));
+  ASSERT_OK(timestamp_builder.Finish(&arrays[2]));
+  ASSERT_OK(price_builder.Finish(&arrays[3]));
+  TempFileForTest tmp_file;
+  std::shared_ptr<arrow::io::FileOutputStream> outfile;
+  ASSERT_OK(arrow::io::FileOutputStream::Open(tmp_file.tmp_filename)
+                .Value(&outfile));
+  ASSERT_OK(parquet::arrow::WriteTable(*arrow::Table::Make(schema, arrays),
+                                       arrow::default_memory_pool(), outfile,
+                                       1000));
+  ASSERT_OK(outfile->Close());
+
+  for (int row_group_threads : {0, 2}) {
+    // Rows 2500 to 4499 lie in the row groups of rows 2000 to 4999
+    ParquetReadOptions options{.row_group_threads = row_group_threads,
+                               .begin_nanos = 1000000000000 + 2500 * 1000000,
+                               .end_nanos = 1000000000000 + 4500 * 1000000};
+    NameToId providers;
+    NameToId symbols;
+    std::vector<int64_t> read;
+    ASSERT_OK(ReadManyParquetFileColumns(
+        std::vector<std::string>{tmp_file.tmp_filename},
+        [&](const InputColumns &columns) {
+          read.insert(read.end(), columns.ts_nanos.begin(),
+                      columns.ts_nanos.end());
+        },
+        providers, symbols, options));
+    ASSERT_EQ(read.size(), 3000) << row_group_threads;
+    EXPECT_EQ(read.front(), 1000000000000 + 2000 * 1000000);
+    EXPECT_EQ(read.back(), 1000000000000 + 4999 * 1000000);
+  }
+}
+
+TEST(ReadManyParquetFiles, RemapsEachFilesDictionary) {
+  // Each file is written with its own dictionaries, so the same name has a
+  // different dictionary index in each
+  std::vector<std::vector<std::pair<std::string, std::string>>> file_names = {
+      {{"p0", "s0"}, {"p1", "s1"}, {"p0", "s1"}},
+      {{"p2", "s1"}, {"p1", "s0"}, {"p0", "s2"}},
+      {{"p1", "s2"}, {"p1", "s2"}, {"p2", "s0"}}};
+  std::vector<TempFileForTest> tmp_files(file_names.size());
+  std::vector<std::string> filenames;
+  int64_t ts = 1000000000000;
+  for (size_t file = 0; file < file_names.size(); file++) {
+    NameToId providers;
+    NameToId symbols;
+    std::vector<InputRow> rows;
+    for (const auto &[provider, symbol] : file_names[file]) {
+      ts += 1000000;
+      rows.push_back(InputRow{ts, providers.IDFromName(provider),
+                              symbols.IDFromName(symbol), 100.0});
+    }
+    ASSERT_OK(WriteParquetFromInputRows(tmp_files[file].tmp_filename, rows,
+                                        providers, symbols));
+    filenames.push_back(tmp_files[file].tmp_filename);
+  }
+
+  for (int prefetch_files : {0, 2}) {
+    NameToId providers;
+    NameToId symbols;
+    std::vector<std::pair<std::string, std::string>> read;
+    ASSERT_OK(ReadManyParquetFiles(
+        filenames,
+        [&](const InputRow &row) {
+          read.emplace_back(providers[row.provider_id],
+                            symbols[row.symbol_id]);
+        },
+        providers, symbols,
+        ParquetReadOptions{.prefetch_files = prefetch_files}));
+    std::vector<std::pair<std::string, std::string>> expected;
+    for (const auto &names : file_names) {
+      expected.insert(expected.end(), names.begin(), names.end());
+    }
+    EXPECT_EQ(read, expected) << prefetch_files;
+  }
+}
+
+TEST(ReadMergedParquetFileColumns, MergesOverlappingFiles) {
+  // One file per provider over the same stretch of time, each with its own
+  // dictionaries and read in small batches
+  std::vector<TempFileForTest> tmp_files(4);
+  std::vector<std::string> filenames;
+  std::vector<std::tuple<int64_t, std::string, std::string, double>> written;
+  for (size_t file = 0; file < tmp_files.size(); file++) {
+    NameToId providers;
+    NameToId symbols;
+    std::vector<InputRow> rows;
+    int64_t ts = 1000000000000;
+    for (int i = 0; i < 1000; i++) {
+      ts += 1000000 * ((i + file) % 4);
+      rows.push_back(InputRow{
+          ts, providers.IDFromName(absl::StrCat("provider", file)),
+          symbols.IDFromName(absl::StrCat("symbol", (i + file) % 7)),
+          100.0 + i});
+      written.emplace_back(ts, providers[rows.back().provider_id],
+                           symbols[rows.back().symbol_id], rows.back().price);
+    }
+    ASSERT_OK(WriteParquetFromInputRows(tmp_files[file].tmp_filename, rows,
+                                        providers, symbols));
+    filenames.push_back(tmp_files[file].tmp_filename);
+  }
+  std::stable_sort(written.begin(), written.end(),
+                   [](const auto &a, const auto &b) {
+                     return std::get<0>(a) < std::get<0>(b);
+                   });
+
+  NameToId providers;
+  NameToId symbols;
+  std::vector<std::tuple<int64_t, std::string, std::string, double>> read;
+  ASSERT_OK(ReadMergedParquetFileColumns(
+      filenames,
+      [&](const InputColumns &columns) {
+        for (size_t i = 0; i < columns.size(); i++) {
+          InputRow row = columns[i];
+          read.emplace_back(row.ts_nanos,
+                            std::string(providers[row.provider_id]),
+                            std::string(symbols[row.symbol_id]), row.price);
+        }
+      },
+      providers, symbols, ParquetReadOptions{.batch_size = 100}));
+  EXPECT_EQ(read, written);
+
+  EXPECT_FALSE(ReadMergedParquetFileColumns(
+                   std::vector<std::string>{filenames[0],
+                                            "/nonexistent/file.parquet"},
+                   [](const InputColumns &) {}, providers, symbols)
+                   .ok());
+}
+
+TEST(ReadManyParquetFiles, ReportsMissingColumn) {
+  arrow::Int64Builder timestamp_builder;
+  ASSERT_OK(timestamp_builder.Append(1));
+  std::shared_ptr<arrow::Array> timestamp_array;
+  ASSERT_OK(timestamp_builder.Finish(&timestamp_array));
+  TempFileForTest tmp_file;
+  std::shared_ptr<arrow::io::FileOutputStream> outfile;
+  ASSERT_OK(arrow::io::FileOutputStream::Open(tmp_file.tmp_filename)
+                .Value(&outfile));
+  ASSERT_OK(parquet::arrow::WriteTable(
+      *arrow::Table::Make(
+          arrow::schema({arrow::field("timestamp", arrow::int64())}),
+          {timestamp_array}),
+      arrow::default_memory_pool(), outfile, 1024));
+  ASSERT_OK(outfile->Close());
+
+  NameToId providers;
+  NameToId symbols;
+  EXPECT_TRUE(ReadManyParquetFiles(
+                  std::vector<std::string>{tmp_file.tmp_filename},
+                  [](const InputRow &row) {}, providers, symbols)
+                  .IsInvalid());
+}
+
+TEST(ParquetOutputWriter, WritesRowGroupsWithDictionaries) {
+  NameToId providers;
+  NameToId symbols;
+  std::vector<OutputRow> rows;
+  for (int i = 0; i < 2500; i++) {
+    rows.push_back(OutputRow{1000000000000 + i,
+                             providers.IDFromName(absl::StrCat("p", i % 3)),
+                             symbols.IDFromName(absl::StrCat("s", i % 5)),
+                             100.0 + i});
+  }
+  TempFileForTest tmp_file;
+  ParquetOutputWriter writer(providers, symbols,
+                             ParquetWriteOptions{.row_group_rows = 1000});
+  ASSERT_OK(writer.OpenOutputFile(tmp_file.tmp_filename));
+  for (const OutputRow &row : rows) {
+    ASSERT_OK(writer.AppendOutputRow(row));
+  }
+  ASSERT_OK(writer.CloseOutputFile());
+
+  ASSERT_OK_AND_ASSIGN(auto infile,
+                       arrow::io::ReadableFile::Open(tmp_file.tmp_filename));
+  ASSERT_OK_AND_ASSIGN(
+      auto reader,
+      parquet::arrow::OpenFile(infile, arrow::default_memory_pool()));
+  EXPECT_EQ(reader->num_row_groups(), 3);
+  std::shared_ptr<arrow::Table> table;
+  ASSERT_OK(reader->ReadTable(&table));
+  ASSERT_OK_AND_ASSIGN(table, table->CombineChunks());
+  ASSERT_EQ(table->num_rows(), rows.size());
+  auto provider_array = std::static_pointer_cast<arrow::StringArray>(
+      table->GetColumnByName("provider")->chunk(0));
+  auto symbol_array = std::static_pointer_cast<arrow::StringArray>(
+      table->GetColumnByName("symbol")->chunk(0));
+  auto timestamp_array = std::static_pointer_cast<arrow::Int64Array>(
+      table->GetColumnByName("timestamp")->chunk(0));
+  auto twap_array = std::static_pointer_cast<arrow::DoubleArray>(
+      table->GetColumnByName("twap")->chunk(0));
+  for (size_t i = 0; i < rows.size(); i++) {
+    EXPECT_EQ(provider_array->GetView(i), providers[rows[i].provider_id]);
+    EXPECT_EQ(symbol_array->GetView(i), symbols[rows[i].symbol_id]);
+    EXPECT_EQ(timestamp_array->Value(i), rows[i].ts_nanos);
+    EXPECT_EQ(twap_array->Value(i), rows[i].twap);
+  }
+}
+
+TEST(AsyncParquetOutputWriter, WritesRowsAddedWithNewNames) {
+  NameToId providers;
+  NameToId symbols;
+  TempFileForTest tmp_file;
+  AsyncParquetOutputWriter writer(
+      providers, symbols, ParquetWriteOptions{.row_group_rows = 100}, 1);
+  ASSERT_OK(writer.OpenOutputFile(tmp_file.tmp_filename));
+  // New names keep appearing while earlier row groups are being written
+  std::vector<OutputRow> rows;
+  for (int i = 0; i < 1050; i++) {
+    rows.push_back(OutputRow{1000000000000 + i,
+                             providers.IDFromName(absl::StrCat("p", i / 7)),
+                             symbols.IDFromName(absl::StrCat("s", i % 5)),
+                             100.0 + i});
+    ASSERT_OK(writer.AppendOutputRow(rows.back()));
+  }
+  ASSERT_OK(writer.CloseOutputFile());
+
+  ASSERT_OK_AND_ASSIGN(auto infile,
+                       arrow::io::ReadableFile::Open(tmp_file.tmp_filename));
+  ASSERT_OK_AND_ASSIGN(
+      auto reader,
+      parquet::arrow::OpenFile(infile, arrow::default_memory_pool()));
+  EXPECT_EQ(reader->num_row_groups(), 11);
+  std::shared_ptr<arrow::Table> table;
+  ASSERT_OK(reader->ReadTable(&table));
+  ASSERT_OK_AND_ASSIGN(table, table->CombineChunks());
+  ASSERT_EQ(table->num_rows(), rows.size());
+  auto provider_array = std::static_pointer_cast<arrow::StringArray>(
+      table->GetColumnByName("provider")->chunk(0));
+  auto symbol_array = std::static_pointer_cast<arrow::StringArray>(
+      table->GetColumnByName("symbol")->chunk(0));
+  auto timestamp_array = std::static_pointer_cast<arrow::Int64Array>(
+      table->GetColumnByName("timestamp")->chunk(0));
+  for (size_t i = 0; i < rows.size(); i++) {
+    EXPECT_EQ(provider_array->GetView(i), providers[rows[i].provider_id]);
+    EXPECT_EQ(symbol_array->GetView(i), symbols[rows[i].symbol_id]);
+    EXPECT_EQ(timestamp_array->Value(i), rows[i].ts_nanos);
+  }
+}
+
 static void BM_ComputeTWAPThroughParquet(benchmark::State &state) {
   TempFileForTest tmp_file;
   NameToId providers;
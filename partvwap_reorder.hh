@@ -0,0 +1,115 @@
+#pragma once
+
+#include "partvwap.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <utility>
+#include <vector>
+
+// Restores timestamp order to input that is out of order by a bounded
+// amount, e.g. lightly jittered rows merged from several venues. A row is
+// held until the watermark, the latest timestamp seen less max_lateness_nanos,
+// reaches it; then no row that is not late can come before it. Rows behind
+// the watermark on arrival are late: they go to late_row_sink instead, as
+// ordering them would mean reopening windows that were already reported.
+//
+// Rows that arrive in order are queued at O(1) each; only rows that arrive
+// behind the latest queued row pay for the min-heap. Rows with equal
+// timestamps are passed on in arrival order.
+template <typename RowSink, typename LateRowSink> class ReorderBuffer {
+public:
+  ReorderBuffer(int64_t max_lateness_nanos, RowSink &row_sink,
+                LateRowSink &late_row_sink)
+      : max_lateness_nanos(max_lateness_nanos), row_sink(row_sink),
+        late_row_sink(late_row_sink) {
+    assert(max_lateness_nanos >= 0);
+  }
+
+  void AddRow(const InputRow &row) {
+    if (row.ts_nanos < watermark_nanos) [[unlikely]] {
+      late_rows++;
+      late_row_sink(row);
+      return;
+    }
+    Pending pending{row, next_sequence++};
+    if (in_order.empty() || row.ts_nanos >= in_order.back().row.ts_nanos)
+        [[likely]] {
+      in_order.push_back(pending);
+    } else {
+      out_of_order.push(pending);
+    }
+    if (row.ts_nanos > watermark_nanos + max_lateness_nanos) {
+      watermark_nanos = row.ts_nanos - max_lateness_nanos;
+    }
+    Release(watermark_nanos);
+  }
+
+  void AddColumns(const InputColumns &columns) {
+    for (size_t i = 0; i < columns.size(); ++i) {
+      AddRow(columns[i]);
+    }
+  }
+
+  // Pass on every held row, at the end of the input
+  void Flush() { Release(std::numeric_limits<int64_t>::max()); }
+
+  int64_t Watermark() const { return watermark_nanos; }
+  size_t HeldRows() const { return in_order.size() + out_of_order.size(); }
+  int64_t LateRows() const { return late_rows; }
+
+private:
+  struct Pending {
+    InputRow row;
+    uint64_t sequence;
+
+    bool operator>(const Pending &other) const {
+      return std::pair(row.ts_nanos, sequence) >
+             std::pair(other.row.ts_nanos, other.sequence);
+    }
+  };
+
+  // Pass on the held rows at or before ts_nanos in order, merging the
+  // in-order queue with the heap
+  void Release(int64_t ts_nanos) {
+    while (true) {
+      bool from_heap;
+      if (out_of_order.empty()) {
+        from_heap = false;
+      } else if (in_order.empty()) {
+        from_heap = true;
+      } else {
+        from_heap = in_order.front() > out_of_order.top();
+      }
+      if (from_heap) {
+        if (out_of_order.top().row.ts_nanos > ts_nanos) {
+          return;
+        }
+        InputRow row = out_of_order.top().row;
+        out_of_order.pop();
+        row_sink(row);
+      } else {
+        if (in_order.empty() || in_order.front().row.ts_nanos > ts_nanos) {
+          return;
+        }
+        row_sink(in_order.front().row);
+        in_order.pop_front();
+      }
+    }
+  }
+
+  const int64_t max_lateness_nanos;
+  RowSink &row_sink;
+  LateRowSink &late_row_sink;
+  int64_t watermark_nanos = std::numeric_limits<int64_t>::min();
+  uint64_t next_sequence = 0;
+  int64_t late_rows = 0;
+  std::deque<Pending> in_order;
+  std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending>>
+      out_of_order;
+};
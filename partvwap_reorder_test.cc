@@ -0,0 +1,151 @@
+#include "partvwap.hh"
+#include "partvwap_reorder.hh"
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <random>
+#include <utility>
+#include <vector>
+
+namespace {
+bool TimestampLess(const InputRow &a, const InputRow &b) {
+  return a.ts_nanos < b.ts_nanos;
+}
+
+// Rows 1ms apart over a few series, each delayed by up to max_jitter_nanos
+std::vector<InputRow> JitteredRows(size_t n, int64_t max_jitter_nanos,
+                                   uint32_t seed = 1) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int64_t> jitter(0, max_jitter_nanos);
+  std::vector<std::pair<int64_t, InputRow>> arrivals;
+  for (size_t i = 0; i < n; i++) {
+    InputRow row{1000000000000 + int64_t(i) * 1000000, uint32_t(i % 3),
+                 uint32_t(i % 5), 100.0 + i % 17};
+    arrivals.emplace_back(row.ts_nanos + jitter(rng), row);
+  }
+  std::stable_sort(
+      arrivals.begin(), arrivals.end(),
+      [](const auto &a, const auto &b) { return a.first < b.first; });
+  std::vector<InputRow> rows;
+  for (const auto &arrival : arrivals) {
+    rows.push_back(arrival.second);
+  }
+  return rows;
+}
+} // namespace
+
+TEST(ReorderBuffer, SortsRowsWithinLateness) {
+  std::vector<InputRow> rows = JitteredRows(10000, 5000000);
+  ASSERT_FALSE(std::is_sorted(rows.begin(), rows.end(), TimestampLess));
+
+  std::vector<InputRow> released;
+  auto row_sink = [&](const InputRow &row) { released.push_back(row); };
+  std::vector<InputRow> late;
+  auto late_row_sink = [&](const InputRow &row) { late.push_back(row); };
+  ReorderBuffer reorder(5000000, row_sink, late_row_sink);
+  for (const InputRow &row : rows) {
+    reorder.AddRow(row);
+    // Only rows within the lateness of the latest are held
+    EXPECT_LE(reorder.HeldRows(), 7);
+  }
+  reorder.Flush();
+  EXPECT_EQ(reorder.HeldRows(), 0);
+  EXPECT_TRUE(late.empty());
+  EXPECT_EQ(reorder.LateRows(), 0);
+
+  std::vector<InputRow> sorted = rows;
+  std::stable_sort(sorted.begin(), sorted.end(), TimestampLess);
+  EXPECT_EQ(released, sorted);
+}
+
+TEST(ReorderBuffer, DivertsLateRows) {
+  std::vector<InputRow> released;
+  auto row_sink = [&](const InputRow &row) { released.push_back(row); };
+  std::vector<InputRow> late;
+  auto late_row_sink = [&](const InputRow &row) { late.push_back(row); };
+  ReorderBuffer reorder(10, row_sink, late_row_sink);
+  reorder.AddRow(InputRow{100, 0, 0, 1.0});
+  reorder.AddRow(InputRow{95, 0, 0, 2.0});
+  reorder.AddRow(InputRow{120, 0, 0, 3.0});
+  EXPECT_EQ(reorder.Watermark(), 110);
+  // Behind the watermark, and the rows up to it have been passed on
+  reorder.AddRow(InputRow{105, 0, 0, 4.0});
+  // At the watermark is not late
+  reorder.AddRow(InputRow{110, 0, 0, 5.0});
+  reorder.AddRow(InputRow{115, 0, 0, 6.0});
+  reorder.Flush();
+
+  EXPECT_THAT(released,
+              testing::ElementsAre(
+                  InputRow{95, 0, 0, 2.0}, InputRow{100, 0, 0, 1.0},
+                  InputRow{110, 0, 0, 5.0}, InputRow{115, 0, 0, 6.0},
+                  InputRow{120, 0, 0, 3.0}));
+  EXPECT_THAT(late, testing::ElementsAre(InputRow{105, 0, 0, 4.0}));
+  EXPECT_EQ(reorder.LateRows(), 1);
+}
+
+TEST(ReorderBuffer, ZeroLatenessPassesOrderedRowsStraightThrough) {
+  std::vector<InputRow> released;
+  auto row_sink = [&](const InputRow &row) { released.push_back(row); };
+  int64_t late_rows = 0;
+  auto late_row_sink = [&](const InputRow &) { late_rows++; };
+  ReorderBuffer reorder(0, row_sink, late_row_sink);
+  reorder.AddRow(InputRow{100, 0, 0, 1.0});
+  reorder.AddRow(InputRow{100, 1, 0, 2.0});
+  EXPECT_EQ(released.size(), 2);
+  reorder.AddRow(InputRow{99, 0, 0, 3.0});
+  reorder.AddRow(InputRow{101, 0, 0, 4.0});
+  EXPECT_EQ(released.size(), 3);
+  EXPECT_EQ(late_rows, 1);
+  EXPECT_EQ(reorder.HeldRows(), 0);
+}
+
+TEST(ReorderBuffer, ComputesTWAPOfSortedInput) {
+  std::vector<InputRow> rows = JitteredRows(20000, 20000000, 7);
+  std::vector<InputRow> sorted = rows;
+  std::stable_sort(sorted.begin(), sorted.end(), TimestampLess);
+  std::vector<OutputRow> expected;
+  ComputeTWAP(
+      [&](auto &&f) {
+        for (const InputRow &row : sorted) {
+          f(row);
+        }
+      },
+      [&](const OutputRow &row) { expected.push_back(row); });
+
+  std::vector<OutputRow> output;
+  ComputeTWAP(
+      [&](auto &&f) {
+        auto late_row_sink = [](const InputRow &) { FAIL(); };
+        ReorderBuffer reorder(20000000, f, late_row_sink);
+        InputColumnBuffer buffer;
+        for (const InputRow &row : rows) {
+          buffer.push_back(row);
+        }
+        reorder.AddColumns(buffer.View());
+        reorder.Flush();
+      },
+      [&](const OutputRow &row) { output.push_back(row); });
+  EXPECT_EQ(output, expected);
+}
+
+static void BM_ReorderBuffer(benchmark::State &state) {
+  std::vector<InputRow> rows = JitteredRows(1000000, state.range(0));
+  for (auto _ : state) {
+    int64_t sum = 0;
+    auto row_sink = [&](const InputRow &row) { sum += row.ts_nanos; };
+    auto late_row_sink = [](const InputRow &) {};
+    ReorderBuffer reorder(state.range(0), row_sink, late_row_sink);
+    for (const InputRow &row : rows) {
+      reorder.AddRow(row);
+    }
+    reorder.Flush();
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * rows.size());
+}
+BENCHMARK(BM_ReorderBuffer)->Arg(0)->Arg(5000000)->Arg(100000000);
+
+TEST(Benchmarks, RunAll) { ::benchmark::RunSpecifiedBenchmarks("all"); }
@@ -0,0 +1,230 @@
+#include "partvwap.hh"
+#include "partvwap_reorder.hh"
+#include "partvwap_stream.hh"
+
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/strings/str_cat.h>
+#include <absl/time/time.h>
+#include <algorithm>
+#include <charconv>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+ABSL_FLAG(absl::Duration, window, absl::Seconds(15),
+          "Length of the windows to report the TWAP at the end of");
+ABSL_FLAG(int64_t, max_idle_windows, std::numeric_limits<int64_t>::max(),
+          "Number of windows without input to report after a window with "
+          "input; the rest of an idle gap is skipped");
+ABSL_FLAG(absl::Duration, close_delay, absl::InfiniteDuration(),
+          "Close a window once the wall clock is this far past its end, "
+          "without waiting for a row after it; only for input stamped with "
+          "the wall clock. Rows arriving for a window closed this way are "
+          "counted as late and dropped.");
+ABSL_FLAG(std::optional<absl::Duration>, max_lateness, std::nullopt,
+          "Put input rows up to this far behind the latest row back in "
+          "timestamp order; rows later than that are counted and dropped. "
+          "Unset trusts the input to be in order. Windows are then closed "
+          "this much later, so --close_delay should be larger.");
+ABSL_FLAG(std::string, output_format, "binary",
+          "Format of the output stream: binary OutputRow records, or csv");
+ABSL_FLAG(int64_t, read_rows, 4096,
+          "Most input rows to take from the stream per read");
+
+namespace {
+volatile std::sig_atomic_t stop_requested = 0;
+
+void RequestStop(int) { stop_requested = 1; }
+
+void AppendCsv(std::string &buffer, const OutputRow &row) {
+  char twap[32];
+  auto twap_end = std::to_chars(twap, twap + sizeof(twap), row.twap).ptr;
+  absl::StrAppend(&buffer, row.ts_nanos, ",", row.provider_id, ",",
+                  row.symbol_id, ",",
+                  absl::string_view(twap, twap_end - twap), "\n");
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  std::vector<char *> args = absl::ParseCommandLine(argc, argv);
+
+  if (args.size() != 3) {
+    std::cerr << "Usage: " << args[0] << " <input_stream> <output_stream>"
+              << std::endl;
+    std::cerr << "This program reads binary InputRow records from "
+                 "<input_stream>, which is - for stdin, unix:<path> for a "
+                 "Unix domain socket, or a file or FIFO, and computes the "
+                 "TWAP for each provider and symbol combination as they "
+                 "arrive. Each window's results are written to "
+                 "<output_stream>, - for stdout, as soon as the window "
+                 "closes, until the input ends or on SIGINT or SIGTERM."
+              << std::endl;
+    return 1;
+  }
+
+  bool csv = absl::GetFlag(FLAGS_output_format) == "csv";
+  if (!csv && absl::GetFlag(FLAGS_output_format) != "binary") {
+    std::cerr << "Error: Unknown --output_format "
+              << absl::GetFlag(FLAGS_output_format) << std::endl;
+    return 1;
+  }
+  const absl::Duration close_delay = absl::GetFlag(FLAGS_close_delay);
+  const bool close_on_wall_clock = close_delay != absl::InfiniteDuration();
+
+  // Stop at the next read on a signal, then report the open window
+  struct sigaction stop_action {};
+  stop_action.sa_handler = RequestStop;
+  sigaction(SIGINT, &stop_action, nullptr);
+  sigaction(SIGTERM, &stop_action, nullptr);
+  // A closed output is reported as a write error
+  signal(SIGPIPE, SIG_IGN);
+
+  std::string output_path = args[2];
+  int output_fd = STDOUT_FILENO;
+  if (output_path != "-") {
+    output_fd =
+        open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+             0644);
+    if (output_fd == -1) {
+      std::cerr << "Error opening output stream '" << output_path
+                << "': " << strerror(errno) << std::endl;
+      return 1;
+    }
+  }
+
+  TWAPOptions options{
+      .window_nanos = absl::ToInt64Nanoseconds(absl::GetFlag(FLAGS_window)),
+      .max_idle_windows = absl::GetFlag(FLAGS_max_idle_windows)};
+  if (options.window_nanos <= 0) {
+    std::cerr << "Error: --window must be positive" << std::endl;
+    return 1;
+  }
+  if (absl::GetFlag(FLAGS_read_rows) <= 0) {
+    std::cerr << "Error: --read_rows must be positive" << std::endl;
+    return 1;
+  }
+  if (absl::GetFlag(FLAGS_max_idle_windows) < 0) {
+    std::cerr << "Error: --max_idle_windows must not be negative" << std::endl;
+    return 1;
+  }
+  if (absl::GetFlag(FLAGS_max_lateness) &&
+      *absl::GetFlag(FLAGS_max_lateness) < absl::ZeroDuration()) {
+    std::cerr << "Error: --max_lateness must not be negative" << std::endl;
+    return 1;
+  }
+  std::string output_buffer;
+  // Windows reported since the output was last written
+  std::vector<int64_t> output_reports;
+  int64_t output_rows = 0;
+  auto output_row_sink = [&](const OutputRow &row) {
+    if (output_reports.empty() || output_reports.back() != row.ts_nanos) {
+      output_reports.push_back(row.ts_nanos);
+    }
+    if (csv) {
+      AppendCsv(output_buffer, row);
+    } else {
+      output_buffer.append(reinterpret_cast<const char *>(&row), sizeof(row));
+    }
+    output_rows++;
+  };
+  TWAPEngine<decltype(output_row_sink)> engine(output_row_sink, options);
+
+  // From the end of a window to its output being written
+  LatencyStats window_latency;
+  // From reading the input that closed a window to its output being written
+  LatencyStats processing_latency;
+  auto write_output = [&](absl::Time input_time) {
+    if (output_buffer.empty()) {
+      return;
+    }
+    WriteAllToFd(output_fd, output_buffer);
+    absl::Time now = absl::Now();
+    for (int64_t report_nanos : output_reports) {
+      window_latency.Add(now - absl::FromUnixNanos(report_nanos));
+      processing_latency.Add(now - input_time);
+    }
+    output_buffer.clear();
+    output_reports.clear();
+  };
+
+  int64_t input_rows = 0;
+  int64_t late_rows = 0;
+  // Rows before this were due in a window closed on the wall clock
+  int64_t late_before_nanos = std::numeric_limits<int64_t>::min();
+  const std::optional<absl::Duration> max_lateness =
+      absl::GetFlag(FLAGS_max_lateness);
+  auto add_row = [&](const InputRow &row) {
+    if (row.ts_nanos < late_before_nanos) [[unlikely]] {
+      late_rows++;
+      return;
+    }
+    engine.AddRow(row);
+  };
+  auto late_row_sink = [&](const InputRow &) { late_rows++; };
+  ReorderBuffer reorder(
+      max_lateness ? absl::ToInt64Nanoseconds(*max_lateness) : 0, add_row,
+      late_row_sink);
+  try {
+    int input_fd = OpenInputRowStream(args[1]);
+    InputRowStreamReader reader(input_fd,
+                                size_t(absl::GetFlag(FLAGS_read_rows)));
+    while (!stop_requested && !reader.AtEnd()) {
+      absl::Duration timeout = absl::InfiniteDuration();
+      if (close_on_wall_clock && engine.NextReportNanos() != 0) {
+        timeout = std::max(absl::ZeroDuration(),
+                           absl::FromUnixNanos(engine.NextReportNanos()) +
+                               close_delay - absl::Now());
+      }
+      auto rows = reader.Read(timeout);
+      absl::Time input_time = absl::Now();
+      for (const InputRow &row : rows) {
+        if (max_lateness) {
+          reorder.AddRow(row);
+        } else {
+          add_row(row);
+        }
+      }
+      input_rows += rows.size();
+      if (close_on_wall_clock) {
+        int64_t next_report_nanos = engine.NextReportNanos();
+        engine.CloseWindowsThrough(absl::ToUnixNanos(input_time - close_delay));
+        if (engine.NextReportNanos() != next_report_nanos) {
+          late_before_nanos = engine.NextReportNanos() - options.window_nanos;
+        }
+      }
+      write_output(input_time);
+    }
+    reorder.Flush();
+    engine.Finish();
+    write_output(absl::Now());
+    if (input_fd != STDIN_FILENO) {
+      close(input_fd);
+    }
+  } catch (const std::runtime_error &e) {
+    std::cerr << "Error streaming: " << e.what() << std::endl;
+    return 1;
+  }
+  if (output_fd != STDOUT_FILENO && close(output_fd) == -1) {
+    std::cerr << "Error closing output stream '" << output_path
+              << "': " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  std::cerr << "Streamed " << input_rows << " rows (" << late_rows
+            << " late rows dropped); wrote " << output_rows << " results"
+            << std::endl;
+  std::cerr << "Window end to output latency: " << window_latency.Summary()
+            << std::endl;
+  std::cerr << "Input to output latency: " << processing_latency.Summary()
+            << std::endl;
+
+  return 0;
+}
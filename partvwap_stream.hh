@@ -0,0 +1,183 @@
+#pragma once
+
+#include "partvwap.hh"
+
+#include <absl/strings/str_cat.h>
+#include <absl/strings/string_view.h>
+#include <absl/time/time.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <poll.h>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+// A live stream of InputRow records in their in-memory layout, e.g. from a
+// feed handler tap. The records must be in nondecreasing timestamp order.
+static_assert(sizeof(InputRow) == 24);
+static_assert(sizeof(OutputRow) == 24);
+
+constexpr absl::string_view kUnixSocketPrefix = "unix:";
+
+// Open a stream of InputRow records: "-" is stdin, "unix:<path>" connects
+// to a Unix domain stream socket, and anything else is opened as a file,
+// which may be a FIFO.
+inline int OpenInputRowStream(const std::string &source) {
+  if (source == "-") {
+    return STDIN_FILENO;
+  }
+  if (absl::string_view(source).substr(0, kUnixSocketPrefix.size()) ==
+      kUnixSocketPrefix) {
+    std::string path = source.substr(kUnixSocketPrefix.size());
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+      throw std::runtime_error(
+          absl::StrCat("Unix socket path is too long: ", path));
+    }
+    std::copy(path.begin(), path.end(), address.sun_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+      throw std::runtime_error(
+          absl::StrCat("Failed to create Unix socket: ", strerror(errno)));
+    }
+    if (connect(fd, reinterpret_cast<const sockaddr *>(&address),
+                sizeof(address)) == -1) {
+      int connect_errno = errno;
+      close(fd);
+      throw std::runtime_error(absl::StrCat("Failed to connect to ", path,
+                                            ": ", strerror(connect_errno)));
+    }
+    return fd;
+  }
+  int fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    throw std::runtime_error(
+        absl::StrCat("Failed to open ", source, ": ", strerror(errno)));
+  }
+  return fd;
+}
+
+// Reads InputRow records from a file descriptor as they arrive. A record
+// split across reads is kept until the rest of it arrives.
+class InputRowStreamReader {
+public:
+  explicit InputRowStreamReader(int fd, size_t max_rows = 4096)
+      : fd(fd), rows(max_rows) {}
+
+  // Wait up to timeout for input and return the whole rows that arrived,
+  // valid until the next call. Returns no rows on timeout, when interrupted
+  // by a signal, and at the end of the stream, after which AtEnd() is true.
+  std::span<const InputRow>
+  Read(absl::Duration timeout = absl::InfiniteDuration()) {
+    // Move the partial record after the rows returned last time to the front
+    char *data = reinterpret_cast<char *>(rows.data());
+    if (returned_rows > 0) {
+      std::memmove(data, data + returned_rows * sizeof(InputRow),
+                   partial_bytes);
+      returned_rows = 0;
+    }
+    if (at_end) {
+      return {};
+    }
+    pollfd poll_fd{.fd = fd, .events = POLLIN};
+    int timeout_ms =
+        timeout == absl::InfiniteDuration()
+            ? -1
+            : int(std::clamp<int64_t>(absl::ToInt64Milliseconds(
+                                          absl::Ceil(timeout,
+                                                     absl::Milliseconds(1))),
+                                      0, std::numeric_limits<int>::max()));
+    int ready = poll(&poll_fd, 1, timeout_ms);
+    if (ready == -1 && errno != EINTR) {
+      throw std::runtime_error(
+          absl::StrCat("Failed to poll input stream: ", strerror(errno)));
+    }
+    if (ready <= 0) {
+      return {};
+    }
+    ssize_t n = read(fd, data + partial_bytes,
+                     rows.size() * sizeof(InputRow) - partial_bytes);
+    if (n == -1) {
+      if (errno == EINTR || errno == EAGAIN) {
+        return {};
+      }
+      throw std::runtime_error(
+          absl::StrCat("Failed to read input stream: ", strerror(errno)));
+    }
+    if (n == 0) {
+      at_end = true;
+      if (partial_bytes != 0) {
+        throw std::runtime_error(absl::StrCat("Input stream ended ",
+                                              partial_bytes,
+                                              " bytes into a record"));
+      }
+      return {};
+    }
+    size_t bytes = partial_bytes + n;
+    returned_rows = bytes / sizeof(InputRow);
+    partial_bytes = bytes % sizeof(InputRow);
+    return {rows.data(), returned_rows};
+  }
+
+  bool AtEnd() const { return at_end; }
+
+private:
+  int fd;
+  std::vector<InputRow> rows;
+  size_t returned_rows = 0;
+  size_t partial_bytes = 0;
+  bool at_end = false;
+};
+
+// Write all of data to fd, retrying short writes
+inline void WriteAllToFd(int fd, absl::string_view data) {
+  while (!data.empty()) {
+    ssize_t n = write(fd, data.data(), data.size());
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error(
+          absl::StrCat("Failed to write output stream: ", strerror(errno)));
+    }
+    data.remove_prefix(n);
+  }
+}
+
+// Every sample of a latency, summarised by percentiles
+struct LatencyStats {
+  std::vector<absl::Duration> samples;
+
+  void Add(absl::Duration latency) { samples.push_back(latency); }
+
+  // The sample at fraction p of the sorted samples; zero without samples
+  absl::Duration Percentile(double p) {
+    if (samples.empty()) {
+      return absl::ZeroDuration();
+    }
+    size_t i = std::min(samples.size() - 1, size_t(p * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + i, samples.end());
+    return samples[i];
+  }
+
+  std::string Summary() {
+    if (samples.empty()) {
+      return "no samples";
+    }
+    return absl::StrCat(
+        samples.size(), " samples, p50 ",
+        absl::FormatDuration(Percentile(0.5)), ", p99 ",
+        absl::FormatDuration(Percentile(0.99)), ", max ",
+        absl::FormatDuration(
+            *std::max_element(samples.begin(), samples.end())));
+  }
+};
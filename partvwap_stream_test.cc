@@ -0,0 +1,141 @@
+#include "partvwap.hh"
+#include "partvwap_stream.hh"
+#include "temp_file_for_test.hh"
+#include <absl/time/time.h>
+#include <cstdint>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+struct PipeForTest {
+  int fds[2];
+
+  PipeForTest() {
+    if (pipe(fds) == -1) {
+      throw std::runtime_error("Failed to create pipe");
+    }
+  }
+
+  ~PipeForTest() {
+    close(fds[0]);
+    CloseWriteEnd();
+  }
+
+  void Write(const void *data, size_t size) {
+    WriteAllToFd(fds[1],
+                 absl::string_view(static_cast<const char *>(data), size));
+  }
+
+  void CloseWriteEnd() {
+    if (fds[1] != -1) {
+      close(fds[1]);
+      fds[1] = -1;
+    }
+  }
+};
+
+std::vector<InputRow> ToVector(std::span<const InputRow> rows) {
+  return std::vector<InputRow>(rows.begin(), rows.end());
+}
+} // namespace
+
+TEST(InputRowStreamReader, KeepsRecordsSplitAcrossReads) {
+  std::vector<InputRow> rows = {{1000000000000, 1, 2, 10.0},
+                                {1000000000001, 3, 4, 20.5},
+                                {1000000000002, 5, 6, 30.25}};
+  const char *bytes = reinterpret_cast<const char *>(rows.data());
+  PipeForTest pipe;
+  InputRowStreamReader reader(pipe.fds[0]);
+
+  pipe.Write(bytes, sizeof(InputRow) + 10);
+  EXPECT_THAT(ToVector(reader.Read()), testing::ElementsAre(rows[0]));
+  // Nothing whole has arrived yet
+  EXPECT_TRUE(reader.Read(absl::Milliseconds(1)).empty());
+  EXPECT_FALSE(reader.AtEnd());
+
+  pipe.Write(bytes + sizeof(InputRow) + 10, 2 * sizeof(InputRow) - 10);
+  EXPECT_THAT(ToVector(reader.Read()), testing::ElementsAre(rows[1], rows[2]));
+
+  pipe.CloseWriteEnd();
+  EXPECT_TRUE(reader.Read().empty());
+  EXPECT_TRUE(reader.AtEnd());
+}
+
+TEST(InputRowStreamReader, ReadsAtMostMaxRows) {
+  std::vector<InputRow> rows;
+  for (int i = 0; i < 10; i++) {
+    rows.push_back(InputRow{1000000000000 + i, 1, 2, 10.0 + i});
+  }
+  PipeForTest pipe;
+  pipe.Write(rows.data(), rows.size() * sizeof(InputRow));
+  pipe.CloseWriteEnd();
+  InputRowStreamReader reader(pipe.fds[0], 4);
+  std::vector<InputRow> read;
+  while (!reader.AtEnd()) {
+    auto batch = reader.Read();
+    EXPECT_LE(batch.size(), 4);
+    read.insert(read.end(), batch.begin(), batch.end());
+  }
+  EXPECT_EQ(read, rows);
+}
+
+TEST(InputRowStreamReader, ReportsStreamEndingInsideRecord) {
+  InputRow row{1000000000000, 1, 2, 10.0};
+  PipeForTest pipe;
+  pipe.Write(&row, sizeof(row) - 1);
+  pipe.CloseWriteEnd();
+  InputRowStreamReader reader(pipe.fds[0]);
+  EXPECT_TRUE(reader.Read().empty());
+  EXPECT_THROW(reader.Read(), std::runtime_error);
+}
+
+TEST(OpenInputRowStream, ConnectsToUnixSocket) {
+  TempDirectoryForTest tmp_dir;
+  std::string path = tmp_dir.tmp_dirname + "/feed.sock";
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_NE(listen_fd, -1);
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  std::copy(path.begin(), path.end(), address.sun_path);
+  ASSERT_EQ(bind(listen_fd, reinterpret_cast<const sockaddr *>(&address),
+                 sizeof(address)),
+            0);
+  ASSERT_EQ(listen(listen_fd, 1), 0);
+
+  int fd = OpenInputRowStream("unix:" + path);
+  int feed_fd = accept(listen_fd, nullptr, nullptr);
+  ASSERT_NE(feed_fd, -1);
+  InputRow row{1000000000000, 1, 2, 10.0};
+  WriteAllToFd(feed_fd,
+               absl::string_view(reinterpret_cast<const char *>(&row),
+                                 sizeof(row)));
+  close(feed_fd);
+  InputRowStreamReader reader(fd);
+  EXPECT_THAT(ToVector(reader.Read()), testing::ElementsAre(row));
+  EXPECT_TRUE(reader.Read().empty());
+  EXPECT_TRUE(reader.AtEnd());
+  close(fd);
+  close(listen_fd);
+
+  EXPECT_THROW(OpenInputRowStream("unix:" + path + ".missing"),
+               std::runtime_error);
+}
+
+TEST(LatencyStats, Percentiles) {
+  LatencyStats stats;
+  EXPECT_EQ(stats.Summary(), "no samples");
+  for (int i = 100; i >= 1; i--) {
+    stats.Add(absl::Microseconds(i));
+  }
+  EXPECT_EQ(stats.Percentile(0), absl::Microseconds(1));
+  EXPECT_EQ(stats.Percentile(0.5), absl::Microseconds(51));
+  EXPECT_EQ(stats.Percentile(0.99), absl::Microseconds(100));
+  EXPECT_EQ(stats.Percentile(1), absl::Microseconds(100));
+}
@@ -11,6 +11,7 @@
 #include <gtest/gtest.h>
 #include <iomanip>
 #include <iostream>
+#include <stdexcept>
 #include <vector>
 
 #include "partvwap.hh"
@@ -25,6 +26,335 @@ TEST(ComputeTWAP, Basic) {
               testing::ElementsAre(OutputRow{1005000000000, 17, 23, 100.0}));
 };
 
+TEST(ComputeTWAP, ColumnsMatchRows) {
+  InputColumnBuffer input_columns;
+  for (int64_t i = 0; i < 10000; i++) {
+    input_columns.push_back(InputRow{1000000000000 + i * 7000000,
+                                     static_cast<uint32_t>(i % 3),
+                                     static_cast<uint32_t>(i % 17),
+                                     100.0 + (i % 13)});
+  }
+
+  std::vector<OutputRow> row_output;
+  ComputeTWAP(
+      [&](auto &&f) {
+        for (size_t i = 0; i < input_columns.size(); i++) {
+          f(input_columns.View()[i]);
+        }
+      },
+      [&](const OutputRow &output_row) { row_output.push_back(output_row); });
+
+  std::vector<OutputRow> column_output;
+  ComputeTWAP(
+      [&](auto &&f) {
+        InputColumns columns = input_columns.View();
+        // Split into uneven batches so batch edges fall inside windows
+        for (size_t start = 0; start < columns.size(); start += 999) {
+          size_t n = std::min<size_t>(999, columns.size() - start);
+          f(InputColumns{columns.ts_nanos.subspan(start, n),
+                         columns.provider_ids.subspan(start, n),
+                         columns.symbol_ids.subspan(start, n),
+                         columns.prices.subspan(start, n)});
+        }
+      },
+      [&](const OutputRow &output_row) {
+        column_output.push_back(output_row);
+      });
+
+  EXPECT_FALSE(row_output.empty());
+  EXPECT_THAT(column_output, testing::ElementsAreArray(row_output));
+}
+
+TEST(ComputeTWAP, ReportsLiveSeriesInOrder) {
+  std::vector<OutputRow> output_rows;
+  ComputeTWAP(
+      [&](auto &&f) {
+        f(InputRow{1000000000001, 3, 40000, 10.0});
+        f(InputRow{1016000000000, 0, 7, 20.0});
+        f(InputRow{1016000000000, 3, 5, 30.0});
+      },
+      [&](const OutputRow &output_row) { output_rows.push_back(output_row); });
+  EXPECT_THAT(output_rows,
+              testing::ElementsAre(OutputRow{1005000000000, 3, 40000, 10.0},
+                                   OutputRow{1020000000000, 0, 7, 20.0},
+                                   OutputRow{1020000000000, 3, 5, 30.0},
+                                   OutputRow{1020000000000, 3, 40000, 10.0}));
+}
+
+TEST(ComputeTWAP, IdleWindowPolicy) {
+  auto run = [](int64_t max_idle_windows) {
+    std::vector<OutputRow> output_rows;
+    ComputeTWAP(
+        [&](auto &&f) {
+          f(InputRow{1000000000000, 1, 2, 10.0});
+          // Six windows later, with five empty windows in between
+          f(InputRow{1090000000000, 1, 2, 40.0});
+        },
+        [&](const OutputRow &output_row) {
+          output_rows.push_back(output_row);
+        },
+        TWAPOptions{.max_idle_windows = max_idle_windows});
+    return output_rows;
+  };
+
+  std::vector<OutputRow> filled = run(std::numeric_limits<int64_t>::max());
+  ASSERT_EQ(filled.size(), 7);
+  for (size_t i = 0; i < 6; i++) {
+    EXPECT_EQ(filled[i], (OutputRow{1005000000000 + int64_t(i) * 15000000000,
+                                    1, 2, 10.0}));
+  }
+
+  EXPECT_THAT(run(2), testing::ElementsAre(
+                          OutputRow{1005000000000, 1, 2, 10.0},
+                          OutputRow{1020000000000, 1, 2, 10.0},
+                          OutputRow{1035000000000, 1, 2, 10.0},
+                          OutputRow{1095000000000, 1, 2, filled.back().twap}));
+
+  EXPECT_THAT(run(0), testing::ElementsAre(
+                          OutputRow{1005000000000, 1, 2, 10.0},
+                          OutputRow{1095000000000, 1, 2, filled.back().twap}));
+}
+
+TEST(TWAPEngine, CloseWindowsThroughReportsEarly) {
+  std::vector<InputRow> input = {{1000000000000, 1, 2, 10.0},
+                                 {1001000000000, 2, 2, 20.0},
+                                 {1090000000000, 1, 2, 40.0},
+                                 {1091000000000, 2, 2, 30.0}};
+  for (int64_t max_idle_windows :
+       {int64_t(0), int64_t(2), std::numeric_limits<int64_t>::max()}) {
+    TWAPOptions options{.max_idle_windows = max_idle_windows};
+    std::vector<OutputRow> expected;
+    ComputeTWAP(
+        [&](auto &&f) {
+          for (const InputRow &row : input) {
+            f(row);
+          }
+        },
+        [&](const OutputRow &row) { expected.push_back(row); }, options);
+
+    std::vector<OutputRow> output;
+    auto sink = [&](const OutputRow &row) { output.push_back(row); };
+    TWAPEngine<decltype(sink)> engine(sink, options);
+    engine.CloseWindowsThrough(999000000000);
+    engine.AddRow(input[0]);
+    engine.AddRow(input[1]);
+    engine.CloseWindowsThrough(1004999999999);
+    EXPECT_TRUE(output.empty());
+    // The first window closes without waiting for the next row
+    engine.CloseWindowsThrough(1005000000000);
+    ASSERT_EQ(output.size(), 2);
+    EXPECT_EQ(output[0], (OutputRow{1005000000000, 1, 2, 10.0}));
+    EXPECT_EQ(engine.NextReportNanos(), 1020000000000);
+    // Idle windows closed one at a time still honour max_idle_windows
+    for (int64_t ts = 1020000000000; ts < 1090000000000; ts += 15000000000) {
+      engine.CloseWindowsThrough(ts);
+    }
+    engine.AddRow(input[2]);
+    engine.AddRow(input[3]);
+    engine.Finish();
+    EXPECT_EQ(output, expected) << max_idle_windows;
+  }
+}
+
+TEST(ComputeTWAP, SeriesFilter) {
+  std::vector<InputRow> input_rows;
+  for (int64_t i = 0; i < 5000; i++) {
+    input_rows.push_back(InputRow{1000000000000 + i * 7000000,
+                                  static_cast<uint32_t>(i % 3),
+                                  static_cast<uint32_t>(i % 11),
+                                  100.0 + (i % 17)});
+  }
+  TWAPOptions options{.max_idle_windows = 1,
+                      .series_filter =
+                          TWAPSeriesFilter::Only({{1, 4}, {2, 9}, {2, 9}})};
+  std::vector<OutputRow> expected;
+  ComputeTWAP(
+      [&](auto &&f) {
+        for (const auto &row : input_rows) {
+          if (options.series_filter.Matches(row.provider_id, row.symbol_id)) {
+            f(row);
+          }
+        }
+      },
+      [&](const OutputRow &row) { expected.push_back(row); },
+      TWAPOptions{.max_idle_windows = 1});
+  ASSERT_FALSE(expected.empty());
+
+  InputColumnBuffer input_columns;
+  for (const auto &row : input_rows) {
+    input_columns.push_back(row);
+  }
+  std::vector<OutputRow> filtered;
+  ComputeTWAP([&](auto &&f) { f(input_columns.View()); },
+              [&](const OutputRow &row) { filtered.push_back(row); },
+              options);
+  EXPECT_THAT(filtered, testing::ElementsAreArray(expected));
+}
+
+TEST(TWAPSeriesTable, MatchesTWAPStateAcrossGrowth) {
+  TWAPSeriesTable table;
+  std::vector<std::vector<TWAPState>> expected(50, std::vector<TWAPState>(300));
+  for (int64_t i = 0; i < 5000; i++) {
+    uint32_t provider = (i * 7) % 50;
+    uint32_t symbol = (i * 13) % 300;
+    int64_t ts = 1000000000000 + i * 1000;
+    double price = 10.0 + (i % 11);
+    table.AddPrice(table.FindOrAddSeries(provider, symbol), ts, price);
+    expected[provider][symbol].AddPrice(ts, price);
+  }
+
+  std::vector<std::pair<uint32_t, uint32_t>> order;
+  table.ForEachSeries([&](uint32_t series) {
+    order.emplace_back(table.ProviderId(series), table.SymbolId(series));
+    TWAPState state = table.State(series);
+    const TWAPState &want = expected[order.back().first][order.back().second];
+    EXPECT_EQ(state.last_ts_nanos, want.last_ts_nanos);
+    EXPECT_EQ(state.last_price, want.last_price);
+    EXPECT_EQ(state.price_nanos_sum, want.price_nanos_sum);
+    EXPECT_EQ(state.nanos_sum, want.nanos_sum);
+  });
+  EXPECT_TRUE(std::is_sorted(order.begin(), order.end()));
+  EXPECT_EQ(order.size(), table.size());
+  EXPECT_EQ(table.FindSeries(49, 299), TWAPSeriesTable::kNoSeries);
+  EXPECT_EQ(table.FindSeries(1000, 0), TWAPSeriesTable::kNoSeries);
+}
+
+namespace {
+// Rows over a few series, with idle gaps of up to a few minutes
+InputColumnBuffer GappyInput(int64_t n) {
+  InputColumnBuffer input;
+  int64_t ts = 1000000000000;
+  for (int64_t i = 0; i < n; i++) {
+    ts += i % 97 == 0 ? (i % 5) * 61000000000 : 7000000 * (i % 11);
+    input.push_back(InputRow{ts, uint32_t(i % 3), uint32_t(i % 5),
+                             100.0 + (i * 7919) % 13});
+  }
+  return input;
+}
+
+// Each window's output, both from ComputeTWAP with that window alone and
+// from one ComputeMultiWindowTWAP over all of them
+void ExpectMultiWindowMatchesSingle(const InputColumnBuffer &input,
+                                    const std::vector<int64_t> &window_nanos,
+                                    const TWAPOptions &options) {
+  std::vector<std::vector<OutputRow>> multi_output(window_nanos.size());
+  ComputeMultiWindowTWAP(
+      [&](auto &&f) {
+        // Uneven batches, so batch edges fall inside windows
+        for (size_t start = 0; start < input.size(); start += 999) {
+          f(input.View().subspan(start,
+                                 std::min<size_t>(999, input.size() - start)));
+        }
+      },
+      [&](size_t window, const OutputRow &row) {
+        multi_output[window].push_back(row);
+      },
+      window_nanos, options);
+
+  for (size_t window = 0; window < window_nanos.size(); window++) {
+    TWAPOptions window_options = options;
+    window_options.window_nanos = window_nanos[window];
+    std::vector<OutputRow> expected;
+    ComputeTWAP([&](auto &&f) { f(input.View()); },
+                [&](const OutputRow &row) { expected.push_back(row); },
+                window_options);
+    ASSERT_EQ(multi_output[window].size(), expected.size())
+        << window_nanos[window];
+    for (size_t i = 0; i < expected.size(); i++) {
+      const OutputRow &row = multi_output[window][i];
+      EXPECT_EQ(row.ts_nanos, expected[i].ts_nanos);
+      EXPECT_EQ(row.provider_id, expected[i].provider_id);
+      EXPECT_EQ(row.symbol_id, expected[i].symbol_id);
+      // The sums are folded in at more boundaries, so they may round
+      // differently
+      EXPECT_NEAR(row.twap, expected[i].twap, 1e-9 * expected[i].twap);
+    }
+  }
+}
+} // namespace
+
+TEST(ComputeMultiWindowTWAP, MatchesEachWindowAlone) {
+  InputColumnBuffer input = GappyInput(20000);
+  for (int64_t max_idle_windows :
+       {int64_t(0), int64_t(3), std::numeric_limits<int64_t>::max()}) {
+    TWAPOptions options{.max_idle_windows = max_idle_windows};
+    // Nested lengths, as for 1s, 15s, 1m and 5m bars
+    ExpectMultiWindowMatchesSingle(
+        input, {1000000000, 15000000000, 60000000000, 300000000000},
+        options);
+    // Lengths that do not divide each other, given in no particular order
+    ExpectMultiWindowMatchesSingle(
+        input, {15000000000, 7000000000, 10000000000}, options);
+  }
+}
+
+TEST(ComputeMultiWindowTWAP, OneWindowIsComputeTWAP) {
+  InputColumnBuffer input = GappyInput(5000);
+  for (int64_t max_idle_windows :
+       {int64_t(0), int64_t(2), std::numeric_limits<int64_t>::max()}) {
+    TWAPOptions options{.max_idle_windows = max_idle_windows};
+    std::vector<OutputRow> expected;
+    ComputeTWAP(
+        [&](auto &&f) {
+          for (size_t i = 0; i < input.size(); i++) {
+            f(input.View()[i]);
+          }
+        },
+        [&](const OutputRow &row) { expected.push_back(row); }, options);
+    std::vector<OutputRow> output;
+    ComputeMultiWindowTWAP(
+        [&](auto &&f) {
+          for (size_t i = 0; i < input.size(); i++) {
+            f(input.View()[i]);
+          }
+        },
+        [&](size_t window, const OutputRow &row) {
+          EXPECT_EQ(window, 0);
+          output.push_back(row);
+        },
+        {options.window_nanos}, options);
+    EXPECT_EQ(output, expected) << max_idle_windows;
+  }
+}
+
+TEST(ComputeMultiWindowTWAP, ReportsOpenWindowsInTimeOrder) {
+  std::vector<std::pair<size_t, OutputRow>> output;
+  ComputeMultiWindowTWAP(
+      [&](auto &&f) {
+        f(InputRow{1000000000000, 1, 2, 10.0});
+        f(InputRow{1061000000000, 1, 2, 20.0});
+      },
+      [&](size_t window, const OutputRow &row) {
+        output.emplace_back(window, row);
+      },
+      {60000000000, 15000000000}, TWAPOptions{.max_idle_windows = 0});
+  // The last row at 1061s closes the 15s window at 1065s and the 1m window
+  // at 1080s, both carrying its price to their end
+  EXPECT_THAT(output,
+              testing::ElementsAre(
+                  std::pair(size_t(1), OutputRow{1005000000000, 1, 2, 10.0}),
+                  std::pair(size_t(0), OutputRow{1020000000000, 1, 2, 10.0}),
+                  std::pair(size_t(1),
+                            OutputRow{1065000000000, 1, 2,
+                                      (10.0 * 61 + 20.0 * 4) / 65}),
+                  std::pair(size_t(0),
+                            OutputRow{1080000000000, 1, 2,
+                                      (10.0 * 61 + 20.0 * 19) / 80})));
+}
+
+TEST(ComputeMultiWindowTWAP, RejectsBadWindowLengths) {
+  auto compute = [](const std::vector<int64_t> &window_nanos) {
+    ComputeMultiWindowTWAP([](auto &&) {}, [](size_t, const OutputRow &) {},
+                           window_nanos);
+  };
+  EXPECT_THROW(compute({}), std::invalid_argument);
+  EXPECT_THROW(compute({1000000000, 0}), std::invalid_argument);
+  EXPECT_THROW(compute({60000000000, 1000000000, 60000000000}),
+               std::invalid_argument);
+  // Coprime lengths whose common period has too many boundaries
+  EXPECT_THROW(compute({1000000007, 1000000009}), std::invalid_argument);
+}
+
 static void BM_ComputeTWAP(benchmark::State &state) {
   for (auto _ : state) {
     double sum_price = 0;
@@ -45,6 +375,51 @@ static void BM_ComputeTWAP(benchmark::State &state) {
 }
 BENCHMARK(BM_ComputeTWAP);
 
+static void BM_ComputeTWAPColumns(benchmark::State &state) {
+  InputColumnBuffer input_columns;
+  for (int i = 0; i < 1000; i++) {
+    input_columns.push_back(InputRow{1000000000000 + i * 1000000,
+                                     static_cast<uint32_t>(i % 10),
+                                     static_cast<uint32_t>(i % 100),
+                                     100.0 + (i % 10)});
+  }
+  for (auto _ : state) {
+    double sum_price = 0;
+    ComputeTWAP([&](auto &&f) { f(input_columns.View()); },
+                [&](const OutputRow &output_row) {
+                  sum_price += output_row.twap;
+                });
+    benchmark::DoNotOptimize(sum_price);
+  }
+  state.SetItemsProcessed(state.iterations() * 1000);
+}
+BENCHMARK(BM_ComputeTWAPColumns);
+
+static void BM_ComputeMultiWindowTWAP(benchmark::State &state) {
+  InputColumnBuffer input = GappyInput(100000);
+  const std::vector<int64_t> window_nanos = {1000000000, 15000000000,
+                                             60000000000, 300000000000};
+  for (auto _ : state) {
+    double sum_price = 0;
+    if (state.range(0)) {
+      ComputeMultiWindowTWAP(
+          [&](auto &&f) { f(input.View()); },
+          [&](size_t, const OutputRow &row) { sum_price += row.twap; },
+          window_nanos);
+    } else {
+      // A pass per window
+      for (int64_t nanos : window_nanos) {
+        ComputeTWAP([&](auto &&f) { f(input.View()); },
+                    [&](const OutputRow &row) { sum_price += row.twap; },
+                    nanos);
+      }
+    }
+    benchmark::DoNotOptimize(sum_price);
+  }
+  state.SetItemsProcessed(state.iterations() * input.size());
+}
+BENCHMARK(BM_ComputeMultiWindowTWAP)->Arg(0)->Arg(1);
+
 TEST(Benchmarks, RunAll) { ::benchmark::RunSpecifiedBenchmarks("all"); }
 
 int real_main() {
@@ -2,13 +2,31 @@
 
 #include "ic.h"
 #include <absl/cleanup/cleanup.h>
+#include <absl/status/status.h>
 #include <absl/strings/str_cat.h>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cerrno>
 #include <cmath>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fcntl.h>
 #include <fstream>
+#include <future>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <string>
+#include <string_view>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -16,59 +34,217 @@
 
 #include "partvwap.hh"
 
-// Read input rows from a file using TurboPFor compression
-template <typename Decompress64, typename Decompress32, typename RowCallback>
-void ReadTurboPForFromInputRows(Decompress64 &&decompress64,
-                                Decompress32 &&decompress32,
-                                const char *filename,
-                                RowCallback &&row_callback) {
+// A turbo file is
+//   int64 num_rows
+//   chunks: int64 num_rows, then for ts_nanos, prices, provider_ids and
+//           symbol_ids in turn: int64 compressed size, compressed bytes
+//   footer: sections of int64 tag, int64 size, size bytes
+//   int64 footer offset, 8 byte kTurboPForMagic
+// All integers are little endian. Files written before the footer existed
+// end after the chunks, and are read by scanning the chunks.
+inline constexpr char kTurboPForMagic[8] = {'T', 'W', 'A', 'P', 'I', 'D',
+                                            'X', '1'};
+
+enum TurboPForFooterSection : int64_t {
+  // int64 num_chunks, then per chunk: int64 offset, num_rows, min_ts_nanos,
+  // max_ts_nanos
+  kTurboPForChunkIndex = 1,
+  // Per chunk: int64 num_series, then the sorted TWAPSeriesFilter::Key of
+  // each (provider, symbol) series in the chunk
+  kTurboPForChunkSeries = 2,
+  // int64 TurboPForTimestampEncoding of every chunk's ts_nanos column; raw
+  // if absent
+  kTurboPForTimestampEncoding = 3,
+  // Per chunk: int64 number of decimals its prices are stored with, or
+  // kTurboPForRawPrices; every chunk is raw if absent
+  kTurboPForPriceDecimals = 4,
+  // int64 num_names, then per name: int64 size, bytes. Name i is the
+  // provider with id i.
+  kTurboPForProviderNames = 5,
+  // As kTurboPForProviderNames, for symbols
+  kTurboPForSymbolNames = 6,
+};
+
+// Prices stored as the raw doubles, with the writer's compress64
+inline constexpr int64_t kTurboPForRawPrices = -1;
+// Prices with more decimals than this are always stored raw
+inline constexpr int64_t kTurboPForMaxPriceDecimals = 9;
+
+// How the ts_nanos column of each chunk is compressed
+enum class TurboPForTimestampEncoding : int64_t {
+  // The raw values with the writer's compress64
+  kRaw = 0,
+  // bitndpack64 of the differences; needs nondecreasing timestamps
+  kDelta = 1,
+  // bitnzpack64 of the zigzag encoded differences
+  kZigzagDelta = 2,
+  // bitnzpack64 of the differences, i.e. zigzag delta of delta. Smallest
+  // for timestamps that tick at a steady rate.
+  kDeltaOfDelta = 3,
+};
 
-  int fd = open(filename, O_RDONLY);
-  if (fd == -1) {
-    throw std::runtime_error(absl::StrCat("Failed to open file '", filename,
-                                          "': ", strerror(errno)));
+inline std::optional<TurboPForTimestampEncoding>
+ParseTurboPForTimestampEncoding(std::string_view name) {
+  if (name == "raw") {
+    return TurboPForTimestampEncoding::kRaw;
   }
-  absl::Cleanup fd_closer = [fd] { close(fd); };
+  if (name == "delta") {
+    return TurboPForTimestampEncoding::kDelta;
+  }
+  if (name == "zigzag_delta") {
+    return TurboPForTimestampEncoding::kZigzagDelta;
+  }
+  if (name == "delta_of_delta") {
+    return TurboPForTimestampEncoding::kDeltaOfDelta;
+  }
+  return std::nullopt;
+}
 
-  struct stat sb;
-  if (fstat(fd, &sb) == -1) {
-    throw std::runtime_error(absl::StrCat("Failed to fstat file '", filename,
-                                          "': ", strerror(errno)));
+// How a TurboPForFile gets the bytes of the file into memory
+enum class TurboPForIOStrategy {
+  // mmap, leaving page faults to read the file on demand
+  kMmap,
+  // mmap with MADV_SEQUENTIAL, and MADV_WILLNEED over a window of the
+  // chunks ahead of the one being decoded
+  kMmapSequential,
+  // mmap with MAP_POPULATE, reading the whole file before decoding starts
+  kMmapPopulate,
+  // mmap with MADV_HUGEPAGE, for kernels that can back file mappings with
+  // transparent huge pages
+  kMmapHugePages,
+  // pread the footer, then the chunks as they are needed in windows of up
+  // to readahead_bytes, the next window while the current one is decoded,
+  // dropping each from the page cache. Files without a footer index are
+  // read whole.
+  kRead,
+  // As kRead, with O_DIRECT, bypassing the page cache. Falls back to kRead
+  // on filesystems without O_DIRECT.
+  kDirectRead,
+};
+
+inline std::optional<TurboPForIOStrategy>
+ParseTurboPForIOStrategy(std::string_view name) {
+  if (name == "mmap") {
+    return TurboPForIOStrategy::kMmap;
+  }
+  if (name == "mmap_sequential") {
+    return TurboPForIOStrategy::kMmapSequential;
+  }
+  if (name == "mmap_populate") {
+    return TurboPForIOStrategy::kMmapPopulate;
+  }
+  if (name == "mmap_huge_pages") {
+    return TurboPForIOStrategy::kMmapHugePages;
   }
-  const size_t file_size = sb.st_size;
+  if (name == "read") {
+    return TurboPForIOStrategy::kRead;
+  }
+  if (name == "direct_read") {
+    return TurboPForIOStrategy::kDirectRead;
+  }
+  return std::nullopt;
+}
 
-  void *mmap_base_ptr = nullptr;
+inline std::string_view TurboPForIOStrategyName(TurboPForIOStrategy strategy) {
+  switch (strategy) {
+  case TurboPForIOStrategy::kMmap:
+    return "mmap";
+  case TurboPForIOStrategy::kMmapSequential:
+    return "mmap_sequential";
+  case TurboPForIOStrategy::kMmapPopulate:
+    return "mmap_populate";
+  case TurboPForIOStrategy::kMmapHugePages:
+    return "mmap_huge_pages";
+  case TurboPForIOStrategy::kRead:
+    return "read";
+  case TurboPForIOStrategy::kDirectRead:
+    return "direct_read";
+  }
+  return "unknown";
+}
 
-  if (file_size > 0) {
-    mmap_base_ptr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mmap_base_ptr == MAP_FAILED || mmap_base_ptr == nullptr) {
-      throw std::runtime_error(absl::StrCat("Failed to mmap file '", filename,
-                                            "': ", strerror(errno)));
+// Where a chunk is in a turbo file and which timestamps it covers. Without
+// a footer index the time range is unknown and covers everything.
+struct TurboPForChunkInfo {
+  int64_t offset;
+  int64_t num_rows;
+  int64_t min_ts_nanos = std::numeric_limits<int64_t>::min();
+  int64_t max_ts_nanos = std::numeric_limits<int64_t>::max();
+  // Sorted keys of the series in the chunk, if the footer has them
+  std::optional<std::vector<uint64_t>> series_keys;
+  // Prices are stored as round(price * 10^price_decimals) with bitnzpack64
+  int64_t price_decimals = kTurboPForRawPrices;
+
+  bool MayHaveSeries(const TWAPSeriesFilter &series_filter) const {
+    if (!series_keys || !series_filter.keys) {
+      return true;
+    }
+    auto a = series_keys->begin();
+    auto b = series_filter.keys->begin();
+    while (a != series_keys->end() && b != series_filter.keys->end()) {
+      if (*a == *b) {
+        return true;
+      }
+      *a < *b ? ++a : ++b;
     }
+    return false;
   }
+};
 
-  absl::Cleanup unmapper = [&] {
-    if (munmap(mmap_base_ptr, file_size) != 0) {
-      throw std::runtime_error(absl::StrCat("Failed to munmap file '", filename,
-                                            "': ", strerror(errno)));
+struct TurboPForReadOptions {
+  // Only rows in [begin_nanos, end_nanos) are read
+  int64_t begin_nanos = std::numeric_limits<int64_t>::min();
+  int64_t end_nanos = std::numeric_limits<int64_t>::max();
+  // Chunks the footer shows have none of these series are skipped. Other
+  // rows of the chunks that are read are still passed on, to be dropped by
+  // the engine's filter.
+  TWAPSeriesFilter series_filter;
+  // Number of chunks to decompress ahead on background threads
+  int decode_threads = 0;
+  TurboPForIOStrategy io_strategy = TurboPForIOStrategy::kMmap;
+  // Bytes of chunks to advise the kernel to read ahead with
+  // kMmapSequential, or to read at a time with kRead and kDirectRead. A
+  // chunk larger than this is read on its own.
+  size_t readahead_bytes = 64 << 20;
+};
+
+// Where the compressed columns of one chunk lie in a turbo file
+struct TurboPForChunk {
+  int64_t num_rows;
+  TurboPForTimestampEncoding timestamp_encoding =
+      TurboPForTimestampEncoding::kRaw;
+  int64_t price_decimals = kTurboPForRawPrices;
+  // ts_nanos, prices, provider_ids, symbol_ids
+  std::array<std::span<const unsigned char>, 4> columns;
+
+  size_t CompressedSize() const {
+    size_t size = 0;
+    for (const auto &column : columns) {
+      size += column.size();
     }
-  };
+    return size;
+  }
+};
 
-  const char *p = static_cast<const char *>(mmap_base_ptr);
-  size_t remaining = file_size;
+// Bounds-checked little endian reads from part of a mapped file
+struct TurboPForByteReader {
+  const char *p;
+  size_t remaining;
+  const char *filename;
 
-  auto ConsumeBytes = [&](size_t n) {
+  const char *ConsumeBytes(size_t n) {
     if (remaining < n) {
       throw std::runtime_error(absl::StrCat("Needed ", n, " bytes from file '",
-                                            filename, " size ", file_size,
-                                            " remaining ", remaining));
+                                            filename, "' remaining ",
+                                            remaining));
     }
     remaining -= n;
     const char *old_p = p;
     p += n;
     return old_p;
-  };
-  auto ReadLittleEndianInt64 = [&]() {
+  }
+
+  int64_t ReadLittleEndianInt64() {
     const char *data = ConsumeBytes(8);
     int64_t value = 0;
     for (int i = 0; i < 8; ++i) {
@@ -76,130 +252,1120 @@ void ReadTurboPForFromInputRows(Decompress64 &&decompress64,
                << (i * 8);
     }
     return value;
+  }
+
+  // Whether count entries of at least entry_bytes each fit in the bytes
+  // remaining, so that a count read from the file can be trusted to size a
+  // container
+  absl::Status CheckCount(int64_t count, size_t entry_bytes) const {
+    if (count < 0 || uint64_t(count) > remaining / entry_bytes) {
+      return absl::DataLossError(absl::StrCat(
+          "Count ", count, " of ", entry_bytes, " byte entries exceeds the ",
+          remaining, " bytes remaining in '", filename, "'"));
+    }
+    return absl::OkStatus();
+  }
+
+  // Read a count of entries of at least entry_bytes each that follow it
+  size_t ReadCount(size_t entry_bytes) {
+    int64_t count = ReadLittleEndianInt64();
+    if (absl::Status status = CheckCount(count, entry_bytes); !status.ok()) {
+      throw std::runtime_error(std::string(status.message()));
+    }
+    return count;
+  }
+};
+
+// Bytes read from part of a turbo file, in an allocation aligned for
+// O_DIRECT
+struct TurboPForReadBuffer {
+  struct Free {
+    void operator()(char *p) const { std::free(p); }
   };
+  std::unique_ptr<char, Free> allocation;
+  // The bytes asked for, within allocation
+  const char *data = nullptr;
+  size_t size = 0;
+};
+
+// A turbo file, mapped or read as the io_strategy says, with the location of
+// each chunk taken from the footer index, or found by scanning for files
+// without one. With kRead and kDirectRead only the footer is read up front,
+// and chunks are read with ReadChunks as they are needed.
+class TurboPForFile {
+public:
+  explicit TurboPForFile(
+      const char *filename,
+      TurboPForIOStrategy io_strategy = TurboPForIOStrategy::kMmap)
+      : filename(filename), io_strategy(io_strategy) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+      throw std::runtime_error(absl::StrCat("Failed to open file '", filename,
+                                            "': ", strerror(errno)));
+    }
+    absl::Cleanup fd_closer = [fd] { close(fd); };
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+      throw std::runtime_error(absl::StrCat("Failed to fstat file '", filename,
+                                            "': ", strerror(errno)));
+    }
+    file_size = sb.st_size;
+    chunks_end = file_size;
 
-  int64_t num_rows = ReadLittleEndianInt64();
-
-  std::vector<int64_t> timestamp_chunk;
-  std::vector<uint32_t> provider_chunk;
-  std::vector<uint32_t> symbol_chunk;
-  std::vector<double> price_chunk;
-
-  std::vector<unsigned char> buffer;
-  while (num_rows > 0) {
-    int64_t chunk_size = ReadLittleEndianInt64();
-    timestamp_chunk.resize(chunk_size);
-    provider_chunk.resize(chunk_size);
-    symbol_chunk.resize(chunk_size);
-    price_chunk.resize(chunk_size);
-
-    auto read_buffer = [&](auto &chunk) {
-      int64_t ts_actual_size = ReadLittleEndianInt64();
-
-      if constexpr (sizeof(typename std::remove_cvref_t<
-                           decltype(chunk)>::value_type) == 8) {
-        decompress64(reinterpret_cast<unsigned char *>(
-                         const_cast<char *>(ConsumeBytes(ts_actual_size))),
-                     chunk.size(), reinterpret_cast<uint64_t *>(chunk.data()));
-      } else {
-        static_assert(
-            sizeof(typename std::remove_cvref_t<decltype(chunk)>::value_type) ==
-            4);
-        decompress32(reinterpret_cast<unsigned char *>(
-                         const_cast<char *>(ConsumeBytes(ts_actual_size))),
-                     chunk.size(), reinterpret_cast<uint32_t *>(chunk.data()));
+    absl::Cleanup releaser = [&] { Release(); };
+    if (io_strategy == TurboPForIOStrategy::kRead ||
+        io_strategy == TurboPForIOStrategy::kDirectRead) {
+      OpenForReads(fd);
+      ReadIndex();
+    } else {
+      if (file_size > 0) {
+        MapFile(fd);
       }
-    };
+      TurboPForByteReader reader = Reader(0, file_size);
+      num_rows = reader.ReadLittleEndianInt64();
+      if (!ReadFooter()) {
+        ScanChunks(reader);
+      }
+    }
+    std::move(releaser).Cancel();
+  }
+
+  TurboPForFile(const TurboPForFile &) = delete;
+  TurboPForFile &operator=(const TurboPForFile &) = delete;
+
+  ~TurboPForFile() { Release(); }
+
+  int64_t NumRows() const { return num_rows; }
+  bool HasIndex() const { return has_index; }
+  // The strategy actually used, after any fallback
+  TurboPForIOStrategy IOStrategy() const { return io_strategy; }
+  TurboPForTimestampEncoding TimestampEncoding() const {
+    return timestamp_encoding;
+  }
+  const std::vector<TurboPForChunkInfo> &ChunkInfos() const {
+    return chunk_infos;
+  }
+  // Whether the footer has the provider and symbol names, so the file can
+  // be computed over without the input it was converted from
+  bool HasNames() const { return has_names; }
+  const NameToId &Providers() const { return providers; }
+  const NameToId &Symbols() const { return symbols; }
+
+  // Whether chunks are read from the file as they are needed, with
+  // ReadChunks, rather than being in memory for Chunk
+  bool ReadsChunksOnDemand() const { return reads_chunks_on_demand; }
+
+  // Bytes chunk i takes in the file, up to the next chunk or the footer
+  size_t ChunkBytes(size_t i) const {
+    int64_t end = i + 1 < chunk_infos.size() ? chunk_infos[i + 1].offset
+                                             : int64_t(chunks_end);
+    if (end <= chunk_infos[i].offset) {
+      throw std::runtime_error(absl::StrCat("Chunk ", i, " of '", filename,
+                                            "' ends before it starts"));
+    }
+    return end - chunk_infos[i].offset;
+  }
+
+  // Locate the columns of chunk i. Only reads the chunk's length prefixes.
+  TurboPForChunk Chunk(size_t i) const {
+    const TurboPForChunkInfo &info = chunk_infos[i];
+    return ParseChunk(i, Reader(info.offset, file_size - info.offset));
+  }
+
+  // Read the chunks with the given consecutive indices into buffer with one
+  // pread, and locate their columns there
+  std::vector<TurboPForChunk> ReadChunks(std::span<const size_t> chunks,
+                                         TurboPForReadBuffer &buffer) const {
+    assert(!chunks.empty());
+    const size_t begin = chunk_infos[chunks.front()].offset;
+    size_t end = begin;
+    for (size_t i : chunks) {
+      assert(size_t(chunk_infos[i].offset) == end);
+      end += ChunkBytes(i);
+    }
+    buffer = ReadRange(begin, end);
+    std::vector<TurboPForChunk> located;
+    for (size_t i : chunks) {
+      size_t offset = chunk_infos[i].offset - begin;
+      located.push_back(ParseChunk(
+          i, TurboPForByteReader{buffer.data + offset, ChunkBytes(i),
+                                 filename}));
+    }
+    return located;
+  }
+
+  // Ask the kernel to start reading a chunk in, with kMmapSequential
+  void WillNeed(const TurboPForChunk &chunk) const {
+    if (io_strategy != TurboPForIOStrategy::kMmapSequential ||
+        chunk.CompressedSize() == 0) {
+      return;
+    }
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const char *begin =
+        reinterpret_cast<const char *>(chunk.columns.front().data());
+    const char *end = reinterpret_cast<const char *>(
+        chunk.columns.back().data() + chunk.columns.back().size());
+    size_t offset = (begin - data) / page_size * page_size;
+    // Advice is only a hint, so failures are ignored
+    madvise(const_cast<char *>(data) + offset, end - data - offset,
+            MADV_WILLNEED);
+  }
+
+  // Indices of the chunks that may hold rows the options select
+  std::vector<size_t> ChunksToRead(const TurboPForReadOptions &options) const {
+    std::vector<size_t> chunks;
+    for (size_t i = 0; i < chunk_infos.size(); ++i) {
+      if (chunk_infos[i].max_ts_nanos >= options.begin_nanos &&
+          chunk_infos[i].min_ts_nanos < options.end_nanos &&
+          chunk_infos[i].MayHaveSeries(options.series_filter)) {
+        chunks.push_back(i);
+      }
+    }
+    return chunks;
+  }
+
+private:
+  // Bytes read from the end of the file for the footer, which is read again
+  // whole if it is larger
+  static constexpr size_t kFooterReadBytes = 64 << 10;
+
+  const char *filename;
+  TurboPForIOStrategy io_strategy;
+  // The bytes of the file from data_offset on that are in memory: all of it
+  // when mapped, or the part last read
+  const char *data = nullptr;
+  size_t data_offset = 0;
+  size_t data_size = 0;
+  // Owns data when it was read rather than mapped
+  TurboPForReadBuffer read_buffer;
+  // What kRead and kDirectRead read through
+  int read_fd = -1;
+  bool reads_chunks_on_demand = false;
+  size_t file_size = 0;
+  // Where the chunks end: at the footer, or the end of a file without one
+  size_t chunks_end = 0;
+  int64_t num_rows = 0;
+  bool has_index = false;
+  TurboPForTimestampEncoding timestamp_encoding =
+      TurboPForTimestampEncoding::kRaw;
+  std::vector<TurboPForChunkInfo> chunk_infos;
+  bool has_names = false;
+  NameToId providers;
+  NameToId symbols;
+
+  // Locate the columns of chunk i, whose bytes reader starts at
+  TurboPForChunk ParseChunk(size_t i, TurboPForByteReader reader) const {
+    const TurboPForChunkInfo &info = chunk_infos[i];
+    TurboPForChunk chunk{.num_rows = reader.ReadLittleEndianInt64(),
+                         .timestamp_encoding = timestamp_encoding,
+                         .price_decimals = info.price_decimals};
+    if (chunk.num_rows != info.num_rows) {
+      throw std::runtime_error(
+          absl::StrCat("Chunk ", i, " of '", filename, "' has ",
+                       chunk.num_rows, " rows but the index says ",
+                       info.num_rows));
+    }
+    for (auto &column : chunk.columns) {
+      size_t column_size = reader.ReadLittleEndianInt64();
+      column = {reinterpret_cast<const unsigned char *>(
+                    reader.ConsumeBytes(column_size)),
+                column_size};
+    }
+    return chunk;
+  }
+
+  TurboPForByteReader Reader(size_t offset, size_t size) const {
+    if (offset > file_size || size > file_size - offset) {
+      throw std::runtime_error(absl::StrCat("Offset ", offset, " size ", size,
+                                            " is outside file '", filename,
+                                            "' of size ", file_size));
+    }
+    if (offset < data_offset || offset + size > data_offset + data_size) {
+      throw std::runtime_error(absl::StrCat("Offset ", offset, " size ", size,
+                                            " of '", filename,
+                                            "' is not in memory"));
+    }
+    return TurboPForByteReader{data + (offset - data_offset), size, filename};
+  }
+
+  void MapFile(int fd) {
+    int flags = MAP_PRIVATE;
+    if (io_strategy == TurboPForIOStrategy::kMmapPopulate) {
+      flags |= MAP_POPULATE;
+    }
+    void *mmap_base_ptr = mmap(nullptr, file_size, PROT_READ, flags, fd, 0);
+    if (mmap_base_ptr == MAP_FAILED || mmap_base_ptr == nullptr) {
+      throw std::runtime_error(absl::StrCat("Failed to mmap file '", filename,
+                                            "': ", strerror(errno)));
+    }
+    data = static_cast<const char *>(mmap_base_ptr);
+    data_size = file_size;
+    if (io_strategy == TurboPForIOStrategy::kMmapSequential) {
+      if (madvise(mmap_base_ptr, file_size, MADV_SEQUENTIAL) != 0) {
+        io_strategy = TurboPForIOStrategy::kMmap;
+      }
+    } else if (io_strategy == TurboPForIOStrategy::kMmapHugePages) {
+      if (madvise(mmap_base_ptr, file_size, MADV_HUGEPAGE) != 0) {
+        io_strategy = TurboPForIOStrategy::kMmap;
+      }
+    }
+  }
+
+  // Open what kRead and kDirectRead read the file through
+  void OpenForReads(int fd) {
+    if (io_strategy == TurboPForIOStrategy::kDirectRead) {
+      read_fd = open(filename, O_RDONLY | O_DIRECT);
+      if (read_fd != -1) {
+        return;
+      }
+      if (errno != EINVAL) {
+        throw std::runtime_error(absl::StrCat(
+            "Failed to open file '", filename, "': ", strerror(errno)));
+      }
+      io_strategy = TurboPForIOStrategy::kRead;
+    }
+    read_fd = dup(fd);
+    if (read_fd == -1) {
+      throw std::runtime_error(absl::StrCat("Failed to dup file '", filename,
+                                            "': ", strerror(errno)));
+    }
+  }
+
+  // pread bytes [begin, end) of the file. With kRead they are dropped from
+  // the page cache once read.
+  TurboPForReadBuffer ReadRange(size_t begin, size_t end) const {
+    // O_DIRECT needs the buffer, offsets and sizes aligned to the logical
+    // block size, which a page covers
+    constexpr size_t kAlignment = 4096;
+    const size_t aligned_begin = begin / kAlignment * kAlignment;
+    const size_t buffer_size =
+        std::max<size_t>((end - aligned_begin + kAlignment - 1) / kAlignment *
+                             kAlignment,
+                         kAlignment);
+    TurboPForReadBuffer buffer;
+    buffer.allocation.reset(
+        static_cast<char *>(std::aligned_alloc(kAlignment, buffer_size)));
+    if (buffer.allocation == nullptr) {
+      throw std::runtime_error(absl::StrCat(
+          "Failed to allocate ", buffer_size, " bytes for '", filename, "'"));
+    }
+    for (size_t read = 0; aligned_begin + read < end;) {
+      ssize_t n = pread(read_fd, buffer.allocation.get() + read,
+                        buffer_size - read, aligned_begin + read);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        throw std::runtime_error(absl::StrCat(
+            "Failed to read file '", filename, "' at ", aligned_begin + read,
+            ": ", n < 0 ? strerror(errno) : "EOF"));
+      }
+      read += n;
+    }
+    if (io_strategy == TurboPForIOStrategy::kRead) {
+      posix_fadvise(read_fd, aligned_begin, buffer_size, POSIX_FADV_DONTNEED);
+    }
+    buffer.data = buffer.allocation.get() + (begin - aligned_begin);
+    buffer.size = end - begin;
+    return buffer;
+  }
+
+  // Read bytes [begin, end) of the file in place of what is in memory
+  void Load(size_t begin, size_t end) {
+    read_buffer = ReadRange(begin, end);
+    data = read_buffer.data;
+    data_offset = begin;
+    data_size = end - begin;
+  }
+
+  // Read the row count and footer index, or, for files without one, the
+  // whole file to scan for the chunks
+  void ReadIndex() {
+    {
+      TurboPForReadBuffer header = ReadRange(0, std::min<size_t>(8, file_size));
+      TurboPForByteReader reader{header.data, header.size, filename};
+      num_rows = reader.ReadLittleEndianInt64();
+    }
+    Load(file_size - std::min(file_size, kFooterReadBytes), file_size);
+    if (ReadFooter()) {
+      // All the footer holds has been copied out of it
+      Unmap();
+      reads_chunks_on_demand = true;
+      return;
+    }
+    Load(0, file_size);
+    TurboPForByteReader reader = Reader(0, file_size);
+    reader.ReadLittleEndianInt64();
+    ScanChunks(reader);
+  }
+
+  void Unmap() {
+    if (data != nullptr && read_buffer.allocation == nullptr) {
+      munmap(const_cast<char *>(data), file_size);
+    }
+    read_buffer = TurboPForReadBuffer{};
+    data = nullptr;
+    data_offset = 0;
+    data_size = 0;
+  }
+
+  // Unmap, and close what chunks are read through
+  void Release() {
+    Unmap();
+    if (read_fd != -1) {
+      close(read_fd);
+      read_fd = -1;
+    }
+  }
+
+  void ReadNames(TurboPForByteReader &section, NameToId &names) {
+    // Each name is its size followed by its bytes
+    int64_t num_names = section.ReadCount(8);
+    for (int64_t id = 0; id < num_names; ++id) {
+      size_t size = section.ReadLittleEndianInt64();
+      absl::string_view name(section.ConsumeBytes(size), size);
+      if (names.IDFromName(name) != id) {
+        throw std::runtime_error(absl::StrCat("Duplicate name '", name,
+                                              "' in '", filename, "'"));
+      }
+    }
+  }
+
+  bool ReadFooter() {
+    std::vector<std::vector<uint64_t>> chunk_series;
+    bool has_provider_names = false;
+    bool has_symbol_names = false;
+    std::vector<int64_t> chunk_price_decimals;
+    constexpr size_t kTrailerSize = 8 + sizeof(kTurboPForMagic);
+    if (file_size < 8 + kTrailerSize ||
+        memcmp(Reader(file_size - sizeof(kTurboPForMagic),
+                      sizeof(kTurboPForMagic))
+                   .p,
+               kTurboPForMagic, sizeof(kTurboPForMagic)) != 0) {
+      return false;
+    }
+    TurboPForByteReader trailer =
+        Reader(file_size - kTrailerSize, kTrailerSize);
+    size_t footer_offset = trailer.ReadLittleEndianInt64();
+    if (footer_offset > file_size - kTrailerSize) {
+      throw std::runtime_error(absl::StrCat(
+          "Footer offset ", footer_offset, " outside file '", filename, "'"));
+    }
+    if (footer_offset < data_offset) {
+      // Only the end of the file was read, and the footer is larger
+      Load(footer_offset, file_size);
+    }
+    chunks_end = footer_offset;
+    TurboPForByteReader footer =
+        Reader(footer_offset, file_size - kTrailerSize - footer_offset);
+    while (footer.remaining > 0) {
+      int64_t tag = footer.ReadLittleEndianInt64();
+      size_t size = footer.ReadLittleEndianInt64();
+      TurboPForByteReader section{footer.ConsumeBytes(size), size, filename};
+      // Unknown sections are from newer writers and are skipped
+      if (tag == kTurboPForChunkIndex) {
+        chunk_infos.resize(section.ReadCount(4 * 8));
+        for (auto &info : chunk_infos) {
+          info.offset = section.ReadLittleEndianInt64();
+          info.num_rows = section.ReadLittleEndianInt64();
+          info.min_ts_nanos = section.ReadLittleEndianInt64();
+          info.max_ts_nanos = section.ReadLittleEndianInt64();
+          // Chunks lie between the row count and the footer
+          if (info.offset < 8 || size_t(info.offset) >= footer_offset ||
+              info.num_rows < 0) {
+            throw std::runtime_error(
+                absl::StrCat("Bad chunk at offset ", info.offset, " with ",
+                             info.num_rows, " rows in '", filename, "'"));
+          }
+        }
+        has_index = true;
+      } else if (tag == kTurboPForTimestampEncoding) {
+        int64_t encoding = section.ReadLittleEndianInt64();
+        if (encoding < 0 ||
+            encoding > int64_t(TurboPForTimestampEncoding::kDeltaOfDelta)) {
+          throw std::runtime_error(absl::StrCat("Unknown timestamp encoding ",
+                                                encoding, " in '", filename,
+                                                "'"));
+        }
+        timestamp_encoding = TurboPForTimestampEncoding(encoding);
+      } else if (tag == kTurboPForPriceDecimals) {
+        chunk_price_decimals.resize(section.ReadCount(8));
+        for (auto &decimals : chunk_price_decimals) {
+          decimals = section.ReadLittleEndianInt64();
+          if (decimals < kTurboPForRawPrices ||
+              decimals > kTurboPForMaxPriceDecimals) {
+            throw std::runtime_error(absl::StrCat(
+                "Bad price decimals ", decimals, " in '", filename, "'"));
+          }
+        }
+      } else if (tag == kTurboPForProviderNames) {
+        ReadNames(section, providers);
+        has_provider_names = true;
+      } else if (tag == kTurboPForSymbolNames) {
+        ReadNames(section, symbols);
+        has_symbol_names = true;
+      } else if (tag == kTurboPForChunkSeries) {
+        // Each chunk's keys follow their count
+        chunk_series.resize(section.ReadCount(8));
+        for (auto &keys : chunk_series) {
+          keys.resize(section.ReadCount(8));
+          for (auto &key : keys) {
+            key = section.ReadLittleEndianInt64();
+          }
+        }
+      }
+    }
+    has_names = has_provider_names && has_symbol_names;
+    if (has_index && chunk_series.size() == chunk_infos.size()) {
+      for (size_t i = 0; i < chunk_infos.size(); ++i) {
+        chunk_infos[i].series_keys = std::move(chunk_series[i]);
+      }
+    }
+    if (!chunk_price_decimals.empty()) {
+      if (chunk_price_decimals.size() != chunk_infos.size()) {
+        throw std::runtime_error(absl::StrCat(
+            "Price decimals for ", chunk_price_decimals.size(),
+            " chunks but ", chunk_infos.size(), " chunks in '", filename,
+            "'"));
+      }
+      for (size_t i = 0; i < chunk_infos.size(); ++i) {
+        chunk_infos[i].price_decimals = chunk_price_decimals[i];
+      }
+    }
+    return has_index;
+  }
 
-    read_buffer(timestamp_chunk);
-    read_buffer(price_chunk);
-    read_buffer(provider_chunk);
-    read_buffer(symbol_chunk);
+  void ScanChunks(TurboPForByteReader &reader) {
+    for (int64_t rows_left = num_rows; rows_left > 0;) {
+      TurboPForChunkInfo info{.offset = int64_t(reader.p - data),
+                              .num_rows = reader.ReadLittleEndianInt64()};
+      for (int column = 0; column < 4; ++column) {
+        reader.ConsumeBytes(reader.ReadLittleEndianInt64());
+      }
+      chunk_infos.push_back(info);
+      rows_left -= info.num_rows;
+    }
+  }
+};
 
-    for (int64_t j = 0; j < chunk_size; ++j) {
-      row_callback(InputRow{timestamp_chunk[j], provider_chunk[j],
-                            symbol_chunk[j], price_chunk[j]});
+inline constexpr double kPowersOfTen[kTurboPForMaxPriceDecimals + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+
+// Scale prices to integers with the fewest decimals, up to max_decimals,
+// that reconstruct every price bit for bit with the division
+// ReconstructTurboPForPrices does. Returns kTurboPForRawPrices if there are
+// none.
+inline int64_t ScaleTurboPForPrices(std::span<const double> prices,
+                                    int64_t max_decimals,
+                                    std::vector<int64_t> &scaled) {
+  scaled.resize(prices.size());
+  max_decimals = std::min(max_decimals, kTurboPForMaxPriceDecimals);
+  for (int64_t decimals = 0; decimals <= max_decimals; ++decimals) {
+    const double scale = kPowersOfTen[decimals];
+    bool exact = true;
+    for (size_t i = 0; i < prices.size() && exact; ++i) {
+      double price_scaled = prices[i] * scale;
+      // Also rejects NaN and infinities
+      if (!(std::abs(price_scaled) < 0x1p53)) {
+        return kTurboPForRawPrices;
+      }
+      scaled[i] = std::llround(price_scaled);
+      exact = std::bit_cast<uint64_t>(double(scaled[i]) / scale) ==
+              std::bit_cast<uint64_t>(prices[i]);
     }
+    if (exact) {
+      return decimals;
+    }
+  }
+  return kTurboPForRawPrices;
+}
 
-    num_rows -= chunk_size;
+// Turn prices decoded as scaled int64 in place back into doubles
+inline void ReconstructTurboPForPrices(std::span<double> prices,
+                                       int64_t decimals) {
+  const double scale = kPowersOfTen[decimals];
+  double *data = prices.data();
+  for (size_t i = 0; i < prices.size(); ++i) {
+    int64_t scaled;
+    memcpy(&scaled, data + i, sizeof(scaled));
+    data[i] = double(scaled) / scale;
   }
 }
 
+// Decompress one chunk into columns, which is resized to fit
+template <typename Decompress64, typename Decompress32>
+void DecodeTurboPForChunk(Decompress64 &&decompress64,
+                          Decompress32 &&decompress32,
+                          const TurboPForChunk &chunk,
+                          InputColumnBuffer &columns) {
+  columns.resize(chunk.num_rows);
+  auto decode_column = [&](std::span<const unsigned char> in, auto &column) {
+    unsigned char *data = const_cast<unsigned char *>(in.data());
+    if constexpr (sizeof(typename std::remove_cvref_t<
+                         decltype(column)>::value_type) == 8) {
+      decompress64(data, column.size(),
+                   reinterpret_cast<uint64_t *>(column.data()));
+    } else {
+      static_assert(sizeof(typename std::remove_cvref_t<
+                           decltype(column)>::value_type) == 4);
+      decompress32(data, column.size(),
+                   reinterpret_cast<uint32_t *>(column.data()));
+    }
+  };
+  unsigned char *ts_data = const_cast<unsigned char *>(chunk.columns[0].data());
+  uint64_t *ts_nanos = reinterpret_cast<uint64_t *>(columns.ts_nanos.data());
+  switch (chunk.timestamp_encoding) {
+  case TurboPForTimestampEncoding::kRaw:
+    decode_column(chunk.columns[0], columns.ts_nanos);
+    break;
+  case TurboPForTimestampEncoding::kDelta:
+    bitndunpack64(ts_data, chunk.num_rows, ts_nanos);
+    break;
+  case TurboPForTimestampEncoding::kZigzagDelta:
+    bitnzunpack64(ts_data, chunk.num_rows, ts_nanos);
+    break;
+  case TurboPForTimestampEncoding::kDeltaOfDelta:
+    bitnzunpack64(ts_data, chunk.num_rows, ts_nanos);
+    std::partial_sum(columns.ts_nanos.begin(), columns.ts_nanos.end(),
+                     columns.ts_nanos.begin());
+    break;
+  }
+  if (chunk.price_decimals == kTurboPForRawPrices) {
+    decode_column(chunk.columns[1], columns.prices);
+  } else {
+    bitnzunpack64(const_cast<unsigned char *>(chunk.columns[1].data()),
+                  chunk.num_rows,
+                  reinterpret_cast<uint64_t *>(columns.prices.data()));
+    ReconstructTurboPForPrices(columns.prices, chunk.price_decimals);
+  }
+  decode_column(chunk.columns[2], columns.provider_ids);
+  decode_column(chunk.columns[3], columns.symbol_ids);
+}
+
+// Decompress chunks in order, calling columns_callback with an InputColumns
+// view of each. With decode_threads > 0, that many chunks ahead of the one
+// being consumed are decompressed on background threads; the view passed
+// to columns_callback is only valid during the call.
+template <typename Decompress64, typename Decompress32,
+          typename ColumnsCallback>
+void DecodeTurboPForChunks(Decompress64 &&decompress64,
+                           Decompress32 &&decompress32,
+                           const std::vector<TurboPForChunk> &chunks,
+                           ColumnsCallback &&columns_callback,
+                           int decode_threads = 0) {
+  if (decode_threads <= 0) {
+    InputColumnBuffer chunk_columns;
+    for (const TurboPForChunk &chunk : chunks) {
+      DecodeTurboPForChunk(decompress64, decompress32, chunk, chunk_columns);
+      columns_callback(chunk_columns.View());
+    }
+    return;
+  }
+
+  // Chunk i decodes into buffers[i % buffers.size()], which is free again
+  // once chunk i - buffers.size() has been consumed
+  std::vector<InputColumnBuffer> buffers(decode_threads + 1);
+  std::deque<std::future<void>> pending;
+  size_t next_chunk = 0;
+  auto fill = [&] {
+    while (next_chunk < chunks.size() && pending.size() < buffers.size()) {
+      pending.push_back(std::async(
+          std::launch::async,
+          [&, chunk = next_chunk] {
+            DecodeTurboPForChunk(decompress64, decompress32, chunks[chunk],
+                                 buffers[chunk % buffers.size()]);
+          }));
+      ++next_chunk;
+    }
+  };
+  for (size_t chunk = 0; chunk < chunks.size(); ++chunk) {
+    fill();
+    pending.front().get();
+    pending.pop_front();
+    columns_callback(buffers[chunk % buffers.size()].View());
+  }
+}
+
+// Read input rows from a file using TurboPFor compression, calling
+// columns_callback with an InputColumns view of each decompressed chunk,
+// trimmed to the time range in options. With a footer index, only the
+// chunks that may hold selected rows are decompressed. See
+// DecodeTurboPForChunks for decode_threads. Returns the I/O strategy used.
+template <typename Decompress64, typename Decompress32,
+          typename ColumnsCallback>
+TurboPForIOStrategy
+ReadTurboPForColumns(Decompress64 &&decompress64, Decompress32 &&decompress32,
+                     const char *filename, ColumnsCallback &&columns_callback,
+                     const TurboPForReadOptions &options = {}) {
+  TurboPForFile file(filename, options.io_strategy);
+  const bool trim =
+      options.begin_nanos != std::numeric_limits<int64_t>::min() ||
+      options.end_nanos != std::numeric_limits<int64_t>::max();
+  auto trimmed_callback = [&](const InputColumns &columns) {
+    if (!trim) {
+      columns_callback(columns);
+      return;
+    }
+    auto ts_begin = columns.ts_nanos.begin();
+    auto ts_end = columns.ts_nanos.end();
+    size_t begin =
+        std::lower_bound(ts_begin, ts_end, options.begin_nanos) - ts_begin;
+    size_t end =
+        std::lower_bound(ts_begin, ts_end, options.end_nanos) - ts_begin;
+    if (begin < end) {
+      columns_callback(columns.subspan(begin, end - begin));
+    }
+  };
+  const std::vector<size_t> to_read = file.ChunksToRead(options);
+
+  if (file.ReadsChunksOnDemand()) {
+    // Runs of consecutive chunks of up to readahead_bytes, each read with
+    // one pread while the run before it is decoded
+    std::vector<std::span<const size_t>> windows;
+    size_t window_begin = 0;
+    size_t window_bytes = 0;
+    for (size_t j = 0; j < to_read.size(); ++j) {
+      size_t bytes = file.ChunkBytes(to_read[j]);
+      if (j > window_begin &&
+          (to_read[j] != to_read[j - 1] + 1 ||
+           window_bytes + bytes > options.readahead_bytes)) {
+        windows.emplace_back(to_read.data() + window_begin, j - window_begin);
+        window_begin = j;
+        window_bytes = 0;
+      }
+      window_bytes += bytes;
+    }
+    if (window_begin < to_read.size()) {
+      windows.emplace_back(to_read.data() + window_begin,
+                           to_read.size() - window_begin);
+    }
+    struct Window {
+      TurboPForReadBuffer buffer;
+      std::vector<TurboPForChunk> chunks;
+    };
+    auto read_window = [&](size_t w) {
+      Window window;
+      window.chunks = file.ReadChunks(windows[w], window.buffer);
+      return window;
+    };
+    std::future<Window> next_window;
+    if (!windows.empty()) {
+      next_window = std::async(std::launch::async, read_window, 0);
+    }
+    for (size_t w = 0; w < windows.size(); ++w) {
+      Window window = next_window.get();
+      if (w + 1 < windows.size()) {
+        next_window = std::async(std::launch::async, read_window, w + 1);
+      }
+      DecodeTurboPForChunks(decompress64, decompress32, window.chunks,
+                            trimmed_callback, options.decode_threads);
+    }
+    return file.IOStrategy();
+  }
+
+  std::vector<TurboPForChunk> chunks;
+  for (size_t i : to_read) {
+    chunks.push_back(file.Chunk(i));
+  }
+  // Advise the chunks from the one being consumed up to readahead_bytes on
+  size_t consumed = 0;
+  size_t next_advised = 0;
+  size_t advised_bytes = 0;
+  auto advise_ahead = [&] {
+    while (next_advised < chunks.size() &&
+           (next_advised == consumed ||
+            advised_bytes < options.readahead_bytes)) {
+      file.WillNeed(chunks[next_advised]);
+      advised_bytes += chunks[next_advised].CompressedSize();
+      ++next_advised;
+    }
+  };
+  advise_ahead();
+  DecodeTurboPForChunks(
+      decompress64, decompress32, chunks,
+      [&](const InputColumns &columns) {
+        advised_bytes -= chunks[consumed++].CompressedSize();
+        advise_ahead();
+        trimmed_callback(columns);
+      },
+      options.decode_threads);
+  return file.IOStrategy();
+}
+
+// Read input rows from a file using TurboPFor compression
+template <typename Decompress64, typename Decompress32, typename RowCallback>
+void ReadTurboPForFromInputRows(Decompress64 &&decompress64,
+                                Decompress32 &&decompress32,
+                                const char *filename,
+                                RowCallback &&row_callback) {
+  ReadTurboPForColumns(decompress64, decompress32, filename,
+                       [&](const InputColumns &columns) {
+                         for (size_t j = 0; j < columns.size(); ++j) {
+                           row_callback(columns[j]);
+                         }
+                       });
+}
+
 namespace {
 void LittleEndianInt64(std::ostream &os, int64_t value) {
   for (int i = 0; i < 8; ++i) {
     os.put(static_cast<char>((value >> (i * 8)) & 0xFF));
   }
 }
+
+void WriteTurboPForFooterSection(std::ostream &os, int64_t tag,
+                                 const std::string &payload) {
+  LittleEndianInt64(os, tag);
+  LittleEndianInt64(os, payload.size());
+  os.write(payload.data(), payload.size());
+}
+
+void WriteTurboPForNamesSection(std::ostream &os, int64_t tag,
+                                const std::vector<std::string> &id_to_name) {
+  std::ostringstream names;
+  LittleEndianInt64(names, id_to_name.size());
+  for (const std::string &name : id_to_name) {
+    LittleEndianInt64(names, name.size());
+    names.write(name.data(), name.size());
+  }
+  WriteTurboPForFooterSection(os, tag, names.str());
+}
 } // namespace
 
-// Write input rows to a file using TurboPFor compression
+// What a writer records in the footer of a turbo file
+struct TurboPForFooter {
+  std::vector<TurboPForChunkInfo> chunk_infos;
+  TurboPForTimestampEncoding timestamp_encoding =
+      TurboPForTimestampEncoding::kRaw;
+  // Names of the provider and symbol ids, if known
+  std::optional<std::vector<std::string>> provider_names;
+  std::optional<std::vector<std::string>> symbol_names;
+};
+
+// Write the footer at the current end of a turbo file
+inline void WriteTurboPForFooter(std::ostream &os,
+                                 const TurboPForFooter &footer) {
+  const auto &chunk_infos = footer.chunk_infos;
+  int64_t footer_offset = os.tellp();
+  std::ostringstream chunk_index;
+  LittleEndianInt64(chunk_index, chunk_infos.size());
+  for (const auto &info : chunk_infos) {
+    LittleEndianInt64(chunk_index, info.offset);
+    LittleEndianInt64(chunk_index, info.num_rows);
+    LittleEndianInt64(chunk_index, info.min_ts_nanos);
+    LittleEndianInt64(chunk_index, info.max_ts_nanos);
+  }
+  WriteTurboPForFooterSection(os, kTurboPForChunkIndex, chunk_index.str());
+  if (std::all_of(chunk_infos.begin(), chunk_infos.end(),
+                  [](const auto &info) { return info.series_keys; })) {
+    std::ostringstream chunk_series;
+    LittleEndianInt64(chunk_series, chunk_infos.size());
+    for (const auto &info : chunk_infos) {
+      LittleEndianInt64(chunk_series, info.series_keys->size());
+      for (uint64_t key : *info.series_keys) {
+        LittleEndianInt64(chunk_series, key);
+      }
+    }
+    WriteTurboPForFooterSection(os, kTurboPForChunkSeries, chunk_series.str());
+  }
+  if (std::any_of(chunk_infos.begin(), chunk_infos.end(), [](const auto &info) {
+        return info.price_decimals != kTurboPForRawPrices;
+      })) {
+    std::ostringstream price_decimals;
+    LittleEndianInt64(price_decimals, chunk_infos.size());
+    for (const auto &info : chunk_infos) {
+      LittleEndianInt64(price_decimals, info.price_decimals);
+    }
+    WriteTurboPForFooterSection(os, kTurboPForPriceDecimals,
+                                price_decimals.str());
+  }
+  if (footer.timestamp_encoding != TurboPForTimestampEncoding::kRaw) {
+    std::ostringstream timestamp_encoding;
+    LittleEndianInt64(timestamp_encoding, int64_t(footer.timestamp_encoding));
+    WriteTurboPForFooterSection(os, kTurboPForTimestampEncoding,
+                                timestamp_encoding.str());
+  }
+  if (footer.provider_names && footer.symbol_names) {
+    WriteTurboPForNamesSection(os, kTurboPForProviderNames,
+                               *footer.provider_names);
+    WriteTurboPForNamesSection(os, kTurboPForSymbolNames,
+                               *footer.symbol_names);
+  }
+  LittleEndianInt64(os, footer_offset);
+  os.write(kTurboPForMagic, sizeof(kTurboPForMagic));
+}
+
+struct TurboPForWriteOptions {
+  // Rows per chunk, the unit of compression and of skipping on read; must
+  // be positive
+  int64_t chunk_rows = 1024 * 1024;
+  TurboPForTimestampEncoding timestamp_encoding =
+      TurboPForTimestampEncoding::kDelta;
+  // Store each chunk's prices as integers with the fewest decimals up to
+  // this many that represent them exactly, falling back to raw doubles for
+  // chunks with none. kTurboPForRawPrices stores every chunk raw.
+  int64_t max_price_decimals = kTurboPForRawPrices;
+  // Number of chunks to compress concurrently on background threads; 0
+  // compresses on the calling thread. Chunks are still written in order.
+  int compress_threads = 0;
+};
+
+// Compress a ts_nanos column into out, returning the compressed size.
+// ts_nanos is used as scratch space.
+template <typename Compress64>
+size_t CompressTurboPForTimestamps(Compress64 &&compress64,
+                                   TurboPForTimestampEncoding encoding,
+                                   std::vector<int64_t> &ts_nanos,
+                                   unsigned char *out) {
+  uint64_t *in = reinterpret_cast<uint64_t *>(ts_nanos.data());
+  switch (encoding) {
+  case TurboPForTimestampEncoding::kRaw:
+    return compress64(in, ts_nanos.size(), out);
+  case TurboPForTimestampEncoding::kDelta:
+    return bitndpack64(in, ts_nanos.size(), out);
+  case TurboPForTimestampEncoding::kZigzagDelta:
+    return bitnzpack64(in, ts_nanos.size(), out);
+  case TurboPForTimestampEncoding::kDeltaOfDelta:
+    std::adjacent_difference(ts_nanos.begin(), ts_nanos.end(),
+                             ts_nanos.begin());
+    return bitnzpack64(in, ts_nanos.size(), out);
+  }
+  throw std::runtime_error(
+      absl::StrCat("Unknown timestamp encoding ", int64_t(encoding)));
+}
+
+// A chunk compressed in memory, ready to be appended to a turbo file
+struct TurboPForCompressedChunk {
+  // Everything but the offset, which is only known when it is written
+  TurboPForChunkInfo info;
+  std::vector<unsigned char> bytes;
+};
+
+// Compress one chunk in the layout of a turbo file. columns is used as
+// scratch space.
 template <typename Compress64, typename Compress32>
-void WriteTurboPForFromInputRows(Compress64 &&compress64,
-                                 Compress32 &&compress32, const char *filename,
-                                 const std::vector<InputRow> &rows,
-                                 const NameToId &providers,
-                                 const NameToId &symbols,
-                                 int64_t chunk = 1024 * 1024) {
-  std::ofstream f(filename);
-  if (!f.good()) {
-    throw std::runtime_error(absl::StrCat("Failed to open file: ", filename));
-  }
-
-  LittleEndianInt64(f, rows.size());
-  size_t buffer_size =
-      std::max(bitnbound256v32(std::min(chunk, int64_t(rows.size()))),
-               bitnbound128v64(std::min(chunk, int64_t(rows.size()))));
-  std::vector<unsigned char> buffer(buffer_size);
-
-  for (int64_t i = 0; i < rows.size();) {
-    int64_t chunk_size = std::min(chunk, int64_t(rows.size()) - i);
-    LittleEndianInt64(f, chunk_size);
-
-    std::vector<int64_t> timestamp_chunk;
-    std::vector<uint32_t> provider_chunk;
-    std::vector<uint32_t> symbol_chunk;
-    std::vector<double> price_chunk;
-
-    timestamp_chunk.reserve(chunk_size);
-    provider_chunk.reserve(chunk_size);
-    symbol_chunk.reserve(chunk_size);
-    price_chunk.reserve(chunk_size);
-
-    for (int64_t j = 0; j < chunk_size; ++j, ++i) {
-      timestamp_chunk.push_back(rows[i].ts_nanos);
-      provider_chunk.push_back(rows[i].provider_id);
-      symbol_chunk.push_back(rows[i].symbol_id);
-      price_chunk.push_back(rows[i].price);
-    }
-
-    auto write_buffer = [&](auto &chunk) {
-      size_t ts_actual_size;
-      if constexpr (sizeof(typename std::remove_cvref_t<
-                           decltype(chunk)>::value_type) == 8) {
-        ts_actual_size = compress64(reinterpret_cast<uint64_t *>(chunk.data()),
-                                    chunk.size(), buffer.data());
-      } else {
-        ts_actual_size = compress32(reinterpret_cast<uint32_t *>(chunk.data()),
-                                    chunk.size(), buffer.data());
-      }
-      LittleEndianInt64(f, ts_actual_size);
-      f.write(reinterpret_cast<const char *>(buffer.data()), ts_actual_size);
-    };
+TurboPForCompressedChunk
+CompressTurboPForChunk(Compress64 &&compress64, Compress32 &&compress32,
+                       InputColumnBuffer &columns,
+                       const TurboPForWriteOptions &options) {
+  const size_t n = columns.size();
+  TurboPForCompressedChunk chunk{.info = {.offset = 0,
+                                          .num_rows = int64_t(n),
+                                          .min_ts_nanos = columns.ts_nanos[0],
+                                          .max_ts_nanos = columns.ts_nanos[0]}};
+  TurboPForChunkInfo &info = chunk.info;
+  std::vector<uint64_t> series_keys(n);
+  for (size_t i = 0; i < n; ++i) {
+    info.min_ts_nanos = std::min(info.min_ts_nanos, columns.ts_nanos[i]);
+    info.max_ts_nanos = std::max(info.max_ts_nanos, columns.ts_nanos[i]);
+    series_keys[i] =
+        TWAPSeriesFilter::Key(columns.provider_ids[i], columns.symbol_ids[i]);
+  }
+  std::sort(series_keys.begin(), series_keys.end());
+  series_keys.erase(std::unique(series_keys.begin(), series_keys.end()),
+                    series_keys.end());
+  info.series_keys = std::move(series_keys);
+
+  std::vector<unsigned char> buffer(
+      std::max(bitnbound256v32(n), bitnbound128v64(n)));
+  auto append_int64 = [&](int64_t value) {
+    for (int i = 0; i < 8; ++i) {
+      chunk.bytes.push_back((value >> (i * 8)) & 0xFF);
+    }
+  };
+  auto append_compressed = [&](size_t size) {
+    append_int64(size);
+    chunk.bytes.insert(chunk.bytes.end(), buffer.data(),
+                       buffer.data() + size);
+  };
+  auto append_column = [&](auto &column) {
+    if constexpr (sizeof(typename std::remove_cvref_t<
+                         decltype(column)>::value_type) == 8) {
+      append_compressed(compress64(
+          reinterpret_cast<uint64_t *>(column.data()), n, buffer.data()));
+    } else {
+      append_compressed(compress32(
+          reinterpret_cast<uint32_t *>(column.data()), n, buffer.data()));
+    }
+  };
+
+  append_int64(n);
+  append_compressed(CompressTurboPForTimestamps(
+      compress64, options.timestamp_encoding, columns.ts_nanos,
+      buffer.data()));
+  std::vector<int64_t> scaled_prices;
+  info.price_decimals = ScaleTurboPForPrices(
+      columns.prices, options.max_price_decimals, scaled_prices);
+  if (info.price_decimals == kTurboPForRawPrices) {
+    append_column(columns.prices);
+  } else {
+    append_compressed(
+        bitnzpack64(reinterpret_cast<uint64_t *>(scaled_prices.data()), n,
+                    buffer.data()));
+  }
+  append_column(columns.provider_ids);
+  append_column(columns.symbol_ids);
+  return chunk;
+}
 
-    write_buffer(timestamp_chunk);
-    write_buffer(price_chunk);
-    write_buffer(provider_chunk);
-    write_buffer(symbol_chunk);
+// Writes a turbo file incrementally. Rows are buffered until a chunk is
+// full, so memory is bounded by compress_threads + 1 chunks rather than the
+// input.
+// Close() writes the footer and patches the row count at the start of the
+// file; a file that is not closed reads as empty.
+template <typename Compress64, typename Compress32> class TurboPForWriter {
+public:
+  TurboPForWriter(Compress64 compress64, Compress32 compress32,
+                  const char *filename,
+                  const TurboPForWriteOptions &options = {})
+      : compress64(compress64), compress32(compress32), filename(filename),
+        options(CheckOptions(options)), f(filename, std::ios::binary) {
+    if (!f.good()) {
+      throw std::runtime_error(
+          absl::StrCat("Failed to open file: ", filename));
+    }
+    footer.timestamp_encoding = options.timestamp_encoding;
+    // Patched by Close()
+    LittleEndianInt64(f, 0);
   }
 
-  if (!f.good()) {
-    throw std::runtime_error(
-        absl::StrCat("Failed to write TurboPFor data to file: ", filename));
+  TurboPForWriter(const TurboPForWriter &) = delete;
+  TurboPForWriter &operator=(const TurboPForWriter &) = delete;
+
+  void AddRow(const InputRow &row) {
+    pending.push_back(row);
+    if (int64_t(pending.size()) >= options.chunk_rows) {
+      FlushChunk();
+    }
   }
 
-  f.close();
-  if (f.fail()) {
-    throw std::runtime_error(absl::StrCat("Failed to close file: ", filename));
+  void AddColumns(const InputColumns &columns) {
+    for (size_t i = 0; i < columns.size();) {
+      size_t n = std::min<size_t>(options.chunk_rows - pending.size(),
+                                  columns.size() - i);
+      size_t old_size = pending.size();
+      pending.resize(old_size + n);
+      std::copy_n(columns.ts_nanos.begin() + i, n,
+                  pending.ts_nanos.begin() + old_size);
+      std::copy_n(columns.provider_ids.begin() + i, n,
+                  pending.provider_ids.begin() + old_size);
+      std::copy_n(columns.symbol_ids.begin() + i, n,
+                  pending.symbol_ids.begin() + old_size);
+      std::copy_n(columns.prices.begin() + i, n,
+                  pending.prices.begin() + old_size);
+      i += n;
+      if (int64_t(pending.size()) >= options.chunk_rows) {
+        FlushChunk();
+      }
+    }
+  }
+
+  int64_t NumRows() const { return num_rows + pending.size(); }
+
+  // Record the names of the ids in the footer. The ids of a streamed input
+  // are only all known at the end, so this may be called any time before
+  // Close().
+  void SetNames(const NameToId &providers, const NameToId &symbols) {
+    footer.provider_names = providers.id_to_name;
+    footer.symbol_names = symbols.id_to_name;
+  }
+
+  void Close() {
+    if (pending.size() > 0) {
+      FlushChunk();
+    }
+    while (!compressing.empty()) {
+      CommitOldestChunk();
+    }
+    WriteTurboPForFooter(f, footer);
+    f.seekp(0);
+    LittleEndianInt64(f, num_rows);
+    if (!f.good()) {
+      throw std::runtime_error(
+          absl::StrCat("Failed to write TurboPFor data to file: ", filename));
+    }
+    f.close();
+    if (f.fail()) {
+      throw std::runtime_error(
+          absl::StrCat("Failed to close file: ", filename));
+    }
+  }
+
+private:
+  Compress64 compress64;
+  Compress32 compress32;
+  const std::string filename;
+  const TurboPForWriteOptions options;
+  std::ofstream f;
+  TurboPForFooter footer;
+  InputColumnBuffer pending;
+  int64_t num_rows = 0;
+  // Chunks being compressed, oldest first. Declared last so that the
+  // destructor waits for them before anything they use goes away.
+  std::deque<std::future<TurboPForCompressedChunk>> compressing;
+
+  // Throws before the file is created if options cannot be written with
+  static const TurboPForWriteOptions &
+  CheckOptions(const TurboPForWriteOptions &options) {
+    if (options.chunk_rows <= 0) {
+      throw std::runtime_error(absl::StrCat(
+          "Turbo chunk_rows must be positive, got ", options.chunk_rows));
+    }
+    return options;
+  }
+
+  void FlushChunk() {
+    if (options.compress_threads <= 0) {
+      CommitChunk(
+          CompressTurboPForChunk(compress64, compress32, pending, options));
+      pending.clear();
+      return;
+    }
+    compressing.push_back(
+        std::async(std::launch::async,
+                   [this, columns = std::move(pending)]() mutable {
+                     return CompressTurboPForChunk(compress64, compress32,
+                                                   columns, options);
+                   }));
+    pending = InputColumnBuffer{};
+    while (compressing.size() > size_t(options.compress_threads)) {
+      CommitOldestChunk();
+    }
+  }
+
+  void CommitOldestChunk() {
+    TurboPForCompressedChunk chunk = compressing.front().get();
+    compressing.pop_front();
+    CommitChunk(std::move(chunk));
+  }
+
+  void CommitChunk(TurboPForCompressedChunk chunk) {
+    chunk.info.offset = f.tellp();
+    f.write(reinterpret_cast<const char *>(chunk.bytes.data()),
+            chunk.bytes.size());
+    if (!f.good()) {
+      throw std::runtime_error(
+          absl::StrCat("Failed to write TurboPFor data to file: ", filename));
+    }
+    num_rows += chunk.info.num_rows;
+    footer.chunk_infos.push_back(std::move(chunk.info));
+  }
+};
+
+// Write input rows to a file using TurboPFor compression, with the names of
+// their provider and symbol ids
+template <typename Compress64, typename Compress32>
+void WriteTurboPForFromInputRows(Compress64 &&compress64,
+                                 Compress32 &&compress32, const char *filename,
+                                 const std::vector<InputRow> &rows,
+                                 const NameToId &providers,
+                                 const NameToId &symbols,
+                                 const TurboPForWriteOptions &options = {}) {
+  TurboPForWriter writer(compress64, compress32, filename, options);
+  for (const InputRow &row : rows) {
+    writer.AddRow(row);
   }
+  writer.SetNames(providers, symbols);
+  writer.Close();
 }
@@ -0,0 +1,281 @@
+#include "partvwap.hh"
+#include "partvwap_parallel.hh"
+#include "partvwap_parquet.hh"
+#include "partvwap_turbo.hh"
+#include "perf_counter_scope.hh"
+
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_join.h>
+#include <absl/strings/str_split.h>
+#include <absl/time/time.h>
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+ABSL_FLAG(std::vector<std::string>, windows, {},
+          "Comma separated window lengths, e.g. 1s,15s,1m,5m, to compute in "
+          "one pass, each written to its own file named after <output_file> "
+          "with the length added, e.g. twap_1m.parquet. Empty writes 15s "
+          "windows to <output_file>. Lengths must differ, and several lengths "
+          "cannot be combined with --compute_threads.");
+ABSL_FLAG(int64_t, max_idle_windows, std::numeric_limits<int64_t>::max(),
+          "Number of windows without input to report after a window with "
+          "input; the rest of an idle gap is skipped");
+ABSL_FLAG(int, compute_threads, 1,
+          "Number of threads to partition the TWAP series over");
+ABSL_FLAG(absl::Time, query_begin, absl::InfinitePast(),
+          "Only compute over input rows at or after this time");
+ABSL_FLAG(absl::Time, query_end, absl::InfiniteFuture(),
+          "Only compute over input rows before this time");
+ABSL_FLAG(std::vector<std::string>, series, {},
+          "Comma separated provider/symbol series to compute; all series if "
+          "empty");
+ABSL_FLAG(int, turbo_decode_threads, 2,
+          "Number of turbo chunks to decompress ahead on background threads");
+ABSL_FLAG(std::string, turbo_io_strategy, "mmap",
+          "How to read the turbo file: mmap, mmap_sequential, mmap_populate, "
+          "mmap_huge_pages, read or direct_read");
+ABSL_FLAG(int64_t, turbo_readahead_bytes, 64 << 20,
+          "Bytes of turbo chunks to read ahead with mmap_sequential, or to "
+          "read at a time with read and direct_read");
+ABSL_FLAG(std::string, output_compression, "uncompressed",
+          "Compression codec of the output parquet file, e.g. snappy or zstd "
+          "where Arrow was built with it");
+ABSL_FLAG(int64_t, output_row_group_rows, 1024 * 1024,
+          "Rows per row group of the output parquet file");
+ABSL_FLAG(int, output_queue_row_groups, 2,
+          "Number of output row groups queued for the background writer "
+          "before the computation waits for it");
+
+namespace {
+// The output file for one of several window lengths: output_file with the
+// length added before its extension
+std::string WindowOutputFile(const std::string &output_file,
+                             absl::Duration window) {
+  std::filesystem::path path(output_file);
+  path.replace_filename(absl::StrCat(path.stem().string(), "_",
+                                     absl::FormatDuration(window),
+                                     path.extension().string()));
+  return path.string();
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  std::vector<char *> args = absl::ParseCommandLine(argc, argv);
+
+  if (args.size() != 3) {
+    std::cerr << "Usage: " << args[0] << " <input_turbo_file> <output_file>"
+              << std::endl;
+    std::cerr << "This program reads a turbo file written by parquet_to_turbo, "
+                 "computes the TWAP for each provider and symbol combination, "
+                 "and writes the results to <output_file> in parquet format."
+              << std::endl;
+    return 1;
+  }
+  if (absl::GetFlag(FLAGS_max_idle_windows) < 0) {
+    std::cerr << "Error: --max_idle_windows must not be negative" << std::endl;
+    return 1;
+  }
+
+  const char *input_turbo_file = args[1];
+  std::string output_file = args[2];
+
+  if (!std::filesystem::exists(input_turbo_file)) {
+    std::cerr << "Error: Input turbo file does not exist: "
+              << input_turbo_file << std::endl;
+    return 1;
+  }
+
+  NameToId providers;
+  NameToId symbols;
+  try {
+    TurboPForFile turbo_file(input_turbo_file);
+    if (!turbo_file.HasNames()) {
+      std::cerr << "Error: Turbo file '" << input_turbo_file
+                << "' has no provider and symbol names; rewrite it with "
+                   "parquet_to_turbo"
+                << std::endl;
+      return 1;
+    }
+    providers = turbo_file.Providers();
+    symbols = turbo_file.Symbols();
+  } catch (const std::runtime_error &e) {
+    std::cerr << "Error reading turbo file: " << e.what() << std::endl;
+    return 1;
+  }
+
+  TurboPForReadOptions read_options{
+      .begin_nanos = absl::ToUnixNanos(absl::GetFlag(FLAGS_query_begin)),
+      .end_nanos = absl::ToUnixNanos(absl::GetFlag(FLAGS_query_end)),
+      .decode_threads = absl::GetFlag(FLAGS_turbo_decode_threads),
+      .readahead_bytes =
+          size_t(absl::GetFlag(FLAGS_turbo_readahead_bytes))};
+  auto io_strategy =
+      ParseTurboPForIOStrategy(absl::GetFlag(FLAGS_turbo_io_strategy));
+  if (!io_strategy) {
+    std::cerr << "Error: Unknown --turbo_io_strategy "
+              << absl::GetFlag(FLAGS_turbo_io_strategy) << std::endl;
+    return 1;
+  }
+  read_options.io_strategy = *io_strategy;
+  TurboPForIOStrategy used_io_strategy = read_options.io_strategy;
+  if (!absl::GetFlag(FLAGS_series).empty()) {
+    std::vector<std::pair<uint32_t, uint32_t>> series;
+    for (const std::string &name : absl::GetFlag(FLAGS_series)) {
+      std::pair<std::string, std::string> provider_symbol =
+          absl::StrSplit(name, absl::MaxSplits('/', 1));
+      auto provider = providers.name_to_id.find(provider_symbol.first);
+      auto symbol = symbols.name_to_id.find(provider_symbol.second);
+      if (provider == providers.name_to_id.end() ||
+          symbol == symbols.name_to_id.end()) {
+        std::cerr << "Error: Unknown series '" << name << "'" << std::endl;
+        return 1;
+      }
+      series.emplace_back(provider->second, symbol->second);
+    }
+    read_options.series_filter = TWAPSeriesFilter::Only(series);
+  }
+
+  auto output_compression = arrow::util::Codec::GetCompressionType(
+      absl::GetFlag(FLAGS_output_compression));
+  if (!output_compression.ok()) {
+    std::cerr << "Error: Unknown --output_compression: "
+              << output_compression.status().ToString() << std::endl;
+    return 1;
+  }
+  ParquetWriteOptions write_options{
+      .row_group_rows = absl::GetFlag(FLAGS_output_row_group_rows),
+      .compression = *output_compression};
+
+  std::vector<int64_t> window_nanos;
+  std::vector<std::string> output_files;
+  for (const std::string &window : absl::GetFlag(FLAGS_windows)) {
+    absl::Duration duration;
+    if (!absl::ParseDuration(window, &duration) ||
+        duration <= absl::ZeroDuration()) {
+      std::cerr << "Error: Bad window length in --windows: " << window
+                << std::endl;
+      return 1;
+    }
+    // Equal lengths, e.g. 60s and 1m, would share an output file
+    if (std::find(window_nanos.begin(), window_nanos.end(),
+                  absl::ToInt64Nanoseconds(duration)) != window_nanos.end()) {
+      std::cerr << "Error: Window length given twice in --windows: "
+                << window << std::endl;
+      return 1;
+    }
+    window_nanos.push_back(absl::ToInt64Nanoseconds(duration));
+    output_files.push_back(WindowOutputFile(output_file, duration));
+  }
+  if (window_nanos.size() > 1 && absl::GetFlag(FLAGS_compute_threads) > 1) {
+    std::cerr << "Error: Several --windows cannot be computed with "
+                 "--compute_threads"
+              << std::endl;
+    return 1;
+  }
+  if (window_nanos.empty()) {
+    window_nanos.push_back(TWAPOptions{}.window_nanos);
+    output_files.push_back(output_file);
+  }
+  // Checked before any output file is opened, so that lengths the engine
+  // refuses leave no empty files behind
+  try {
+    CheckTWAPWindowLengths(window_nanos);
+  } catch (const std::invalid_argument &e) {
+    std::cerr << "Error: Bad --windows: " << e.what() << std::endl;
+    return 1;
+  }
+  // One writer per window length, each on its own background thread
+  std::vector<std::unique_ptr<AsyncParquetOutputWriter>> writers;
+  for (const std::string &file : output_files) {
+    writers.push_back(std::make_unique<AsyncParquetOutputWriter>(
+        providers, symbols, write_options,
+        absl::GetFlag(FLAGS_output_queue_row_groups)));
+    auto open_status = writers.back()->OpenOutputFile(file);
+    if (!open_status.ok()) {
+      std::cerr << "Error opening output file '" << file
+                << "': " << open_status.ToString() << std::endl;
+      return 1;
+    }
+  }
+
+  arrow::Status write_status;
+  absl::Time start_time = absl::Now();
+  absl::Time end_time;
+  int64_t input_rows = 0;
+  int64_t output_rows = 0;
+  try {
+    PerfCounterScope perf_monitor("ComputeTWAP");
+    auto input_row_provider = [&](auto &&row_acceptor) {
+      used_io_strategy = ReadTurboPForColumns(
+          bitnunpack128v64, bitnxunpack256v32, input_turbo_file,
+          [&](const InputColumns &columns) {
+            row_acceptor(columns);
+            input_rows += columns.size();
+          },
+          read_options);
+    };
+    auto output_row_sink = [&](const OutputRow &row) {
+      output_rows++;
+      write_status &= writers[0]->AppendOutputRow(row);
+    };
+    auto window_output_row_sink = [&](size_t window, const OutputRow &row) {
+      output_rows++;
+      write_status &= writers[window]->AppendOutputRow(row);
+    };
+    TWAPOptions options{.window_nanos = window_nanos[0],
+                        .max_idle_windows =
+                            absl::GetFlag(FLAGS_max_idle_windows),
+                        .series_filter = read_options.series_filter};
+    if (window_nanos.size() > 1) {
+      ComputeMultiWindowTWAP(input_row_provider, window_output_row_sink,
+                             window_nanos, options);
+    } else if (absl::GetFlag(FLAGS_compute_threads) > 1) {
+      ComputeTWAPParallel(input_row_provider, output_row_sink, options,
+                          absl::GetFlag(FLAGS_compute_threads));
+    } else {
+      ComputeTWAP(input_row_provider, output_row_sink, options);
+    }
+    perf_monitor.IncrementNumRows(input_rows);
+    end_time = absl::Now();
+  } catch (const std::runtime_error &e) {
+    std::cerr << "Error reading turbo file: " << e.what() << std::endl;
+    return 1;
+  }
+  if (!write_status.ok()) {
+    std::cerr << "Error writing output file '"
+              << absl::StrJoin(output_files, ", ")
+              << "': " << write_status.ToString() << std::endl;
+    return 1;
+  }
+  for (size_t window = 0; window < writers.size(); window++) {
+    auto close_status = writers[window]->CloseOutputFile();
+    if (!close_status.ok()) {
+      std::cerr << "Error closing output file '" << output_files[window]
+                << "': " << close_status.ToString() << std::endl;
+      return 1;
+    }
+  }
+
+  std::cout << "Successfully processed " << input_rows << " rows; wrote "
+            << output_rows << " results to "
+            << absl::StrJoin(output_files, ", ") << std::endl;
+  std::cout << "Time taken to compute TWAP: "
+            << absl::FormatDuration(end_time - start_time) << std::endl
+            << "Per input row " << (end_time - start_time) / input_rows
+            << std::endl
+            << "Total seconds " << absl::ToDoubleSeconds(end_time - start_time)
+            << std::endl;
+  std::cout << "Read turbo file with I/O strategy "
+            << TurboPForIOStrategyName(used_io_strategy) << std::endl;
+
+  return 0;
+}
@@ -5,13 +5,20 @@
 #include <absl/strings/string_view.h>
 #include <absl/time/time.h>
 #include <benchmark/benchmark.h>
+#include <bit>
 #include <cmath>
 #include <cstdint>
+#include <filesystem>
 #include <fstream>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 #include "partvwap.hh"
@@ -40,6 +47,537 @@ TEST(ComputeTWAP, InputRowsRoundTrip) {
   EXPECT_THAT(out_rows, testing::ElementsAreArray(input_rows));
 }
 
+TEST(ComputeTWAP, InputColumnsRoundTrip) {
+  std::vector<InputRow> input_rows;
+  TempFileForTest tmp_file;
+  for (int64_t i = 0; i < 2500; ++i) {
+    input_rows.push_back(InputRow{1000000000000 + i * 1000000,
+                                  static_cast<uint32_t>(i % 3),
+                                  static_cast<uint32_t>(i % 7),
+                                  100.0 + (i % 10)});
+  }
+  WriteTurboPForFromInputRows(bitnpack128v64, bitnpack256v32,
+                              tmp_file.tmp_filename.c_str(), input_rows,
+                              NameToId{}, NameToId{},
+                              TurboPForWriteOptions{.chunk_rows = 1000});
+  std::vector<InputRow> out_rows;
+  std::vector<size_t> chunk_sizes;
+  ReadTurboPForColumns(bitnunpack128v64, bitnunpack256v32,
+                       tmp_file.tmp_filename.c_str(),
+                       [&](const InputColumns &columns) {
+                         chunk_sizes.push_back(columns.size());
+                         for (size_t i = 0; i < columns.size(); ++i) {
+                           out_rows.push_back(columns[i]);
+                         }
+                       });
+  EXPECT_THAT(chunk_sizes, testing::ElementsAre(1000, 1000, 500));
+  EXPECT_THAT(out_rows, testing::ElementsAreArray(input_rows));
+}
+
+TEST(ComputeTWAP, DecodeThreadsKeepChunkOrder) {
+  std::vector<InputRow> input_rows;
+  TempFileForTest tmp_file;
+  for (int64_t i = 0; i < 10500; ++i) {
+    input_rows.push_back(InputRow{1000000000000 + i * 1000000,
+                                  static_cast<uint32_t>(i % 3),
+                                  static_cast<uint32_t>(i % 7),
+                                  100.0 + (i % 10)});
+  }
+  WriteTurboPForFromInputRows(bitnpack128v64, bitnpack256v32,
+                              tmp_file.tmp_filename.c_str(), input_rows,
+                              NameToId{}, NameToId{},
+                              TurboPForWriteOptions{.chunk_rows = 1000});
+  for (int decode_threads : {1, 2, 4, 16}) {
+    std::vector<InputRow> out_rows;
+    ReadTurboPForColumns(
+        bitnunpack128v64, bitnunpack256v32, tmp_file.tmp_filename.c_str(),
+        [&](const InputColumns &columns) {
+          for (size_t i = 0; i < columns.size(); ++i) {
+            out_rows.push_back(columns[i]);
+          }
+        },
+        TurboPForReadOptions{.decode_threads = decode_threads});
+    EXPECT_THAT(out_rows, testing::ElementsAreArray(input_rows))
+        << decode_threads << " decode threads";
+  }
+}
+
+TEST(TurboPForFile, IOStrategiesReadSameRows) {
+  std::vector<InputRow> input_rows;
+  TempFileForTest tmp_file;
+  for (int64_t i = 0; i < 10500; ++i) {
+    input_rows.push_back(InputRow{1000000000000 + i * 1000000,
+                                  static_cast<uint32_t>(i % 3),
+                                  static_cast<uint32_t>(i % 7),
+                                  100.0 + (i % 10)});
+  }
+  WriteTurboPForFromInputRows(bitnpack128v64, bitnpack256v32,
+                              tmp_file.tmp_filename.c_str(), input_rows,
+                              NameToId{}, NameToId{},
+                              TurboPForWriteOptions{.chunk_rows = 1000});
+  for (auto strategy :
+       {TurboPForIOStrategy::kMmap, TurboPForIOStrategy::kMmapSequential,
+        TurboPForIOStrategy::kMmapPopulate,
+        TurboPForIOStrategy::kMmapHugePages, TurboPForIOStrategy::kRead,
+        TurboPForIOStrategy::kDirectRead}) {
+    auto name = TurboPForIOStrategyName(strategy);
+    EXPECT_EQ(ParseTurboPForIOStrategy(name), strategy);
+    std::vector<InputRow> out_rows;
+    TurboPForIOStrategy used = ReadTurboPForColumns(
+        bitnunpack128v64, bitnunpack256v32, tmp_file.tmp_filename.c_str(),
+        [&](const InputColumns &columns) {
+          for (size_t i = 0; i < columns.size(); ++i) {
+            out_rows.push_back(columns[i]);
+          }
+        },
+        TurboPForReadOptions{.decode_threads = 2,
+                             .io_strategy = strategy,
+                             .readahead_bytes = 1});
+    EXPECT_THAT(out_rows, testing::ElementsAreArray(input_rows)) << name;
+    // Strategies the kernel or filesystem does not support fall back
+    if (strategy == TurboPForIOStrategy::kDirectRead) {
+      EXPECT_THAT(used, testing::AnyOf(TurboPForIOStrategy::kDirectRead,
+                                       TurboPForIOStrategy::kRead));
+    } else if (strategy == TurboPForIOStrategy::kMmapSequential ||
+               strategy == TurboPForIOStrategy::kMmapHugePages) {
+      EXPECT_THAT(used, testing::AnyOf(strategy, TurboPForIOStrategy::kMmap));
+    } else {
+      EXPECT_EQ(used, strategy);
+    }
+  }
+}
+
+TEST(TurboPForFile, ReadsSkippedChunksOnDemand) {
+  std::vector<InputRow> input_rows;
+  TempFileForTest tmp_file;
+  for (int64_t i = 0; i < 20500; ++i) {
+    // Each provider fills two chunks in turn, so a filter skips runs of them
+    input_rows.push_back(InputRow{1000000000000 + i * 1000000,
+                                  static_cast<uint32_t>(i / 2000 % 2),
+                                  static_cast<uint32_t>(i % 7),
+                                  100.0 + (i % 10)});
+  }
+  WriteTurboPForFromInputRows(bitnpack128v64, bitnpack256v32,
+                              tmp_file.tmp_filename.c_str(), input_rows,
+                              NameToId{}, NameToId{},
+                              TurboPForWriteOptions{.chunk_rows = 1000});
+  TurboPForReadOptions options{
+      .begin_nanos = 1000000000000 + 1500 * int64_t(1000000),
+      .end_nanos = 1000000000000 + 19000 * int64_t(1000000),
+      .series_filter = TWAPSeriesFilter::Only({{0, 1}, {0, 3}}),
+      .decode_threads = 2,
+      .readahead_bytes = 4096};
+  auto read = [&](TurboPForIOStrategy strategy) {
+    options.io_strategy = strategy;
+    std::vector<InputRow> out_rows;
+    ReadTurboPForColumns(
+        bitnunpack128v64, bitnunpack256v32, tmp_file.tmp_filename.c_str(),
+        [&](const InputColumns &columns) {
+          for (size_t i = 0; i < columns.size(); ++i) {
+            out_rows.push_back(columns[i]);
+          }
+        },
+        options);
+    return out_rows;
+  };
+  std::vector<InputRow> mapped_rows = read(TurboPForIOStrategy::kMmap);
+  ASSERT_FALSE(mapped_rows.empty());
+  for (auto strategy :
+       {TurboPForIOStrategy::kRead, TurboPForIOStrategy::kDirectRead}) {
+    EXPECT_TRUE(TurboPForFile(tmp_file.tmp_filename.c_str(), strategy)
+                    .ReadsChunksOnDemand());
+    EXPECT_THAT(read(strategy), testing::ElementsAreArray(mapped_rows))
+        << TurboPForIOStrategyName(strategy);
+  }
+}
+
+TEST(TurboPForFile, TimestampEncodingsRoundTrip) {
+  std::vector<InputRow> input_rows;
+  int64_t ts = 1700000000000000000;
+  for (int64_t i = 0; i < 2500; ++i) {
+    // Steady ticks with bursts of equal timestamps and the odd jump
+    ts += i % 5 == 0 ? 0 : i % 97 == 0 ? 3000000000 : 1000000;
+    input_rows.push_back(InputRow{ts, static_cast<uint32_t>(i % 3),
+                                  static_cast<uint32_t>(i % 7),
+                                  100.0 + (i % 10)});
+  }
+  for (auto encoding : {TurboPForTimestampEncoding::kRaw,
+                        TurboPForTimestampEncoding::kDelta,
+                        TurboPForTimestampEncoding::kZigzagDelta,
+                        TurboPForTimestampEncoding::kDeltaOfDelta}) {
+    TempFileForTest tmp_file;
+    WriteTurboPForFromInputRows(
+        bitnpack128v64, bitnpack256v32, tmp_file.tmp_filename.c_str(),
+        input_rows, NameToId{}, NameToId{},
+        TurboPForWriteOptions{.chunk_rows = 1000,
+                              .timestamp_encoding = encoding});
+    EXPECT_EQ(TurboPForFile(tmp_file.tmp_filename.c_str()).TimestampEncoding(),
+              encoding);
+    std::vector<InputRow> out_rows;
+    ReadTurboPForFromInputRows(
+        bitnunpack128v64, bitnunpack256v32, tmp_file.tmp_filename.c_str(),
+        [&](const InputRow &row) { out_rows.push_back(row); });
+    EXPECT_THAT(out_rows, testing::ElementsAreArray(input_rows))
+        << int64_t(encoding);
+  }
+  EXPECT_EQ(ParseTurboPForTimestampEncoding("delta_of_delta"),
+            TurboPForTimestampEncoding::kDeltaOfDelta);
+  EXPECT_EQ(ParseTurboPForTimestampEncoding("zstd"), std::nullopt);
+}
+
+TEST(TurboPForFile, FixedPointPricesRoundTrip) {
+  std::vector<InputRow> input_rows;
+  for (int64_t i = 0; i < 4000; ++i) {
+    // Prices as parsed from decimal text
+    double price = (10000 + i % 1000) / 100.0;
+    if (i >= 1000 && i < 2000) {
+      // Sub-cent ticks
+      price = (12000000 + (i % 37) * 125) / 1e6;
+    } else if (i == 2500) {
+      // Not representable with a few decimals
+      price = M_PI;
+    } else if (i >= 3000) {
+      price = i % 2 ? -0.0 : 7.0;
+    }
+    input_rows.push_back(InputRow{1000000000000 + i * 1000000,
+                                  static_cast<uint32_t>(i % 3),
+                                  static_cast<uint32_t>(i % 7), price});
+  }
+  TempFileForTest tmp_file;
+  WriteTurboPForFromInputRows(
+      bitnpack128v64, bitnpack256v32, tmp_file.tmp_filename.c_str(),
+      input_rows, NameToId{}, NameToId{},
+      TurboPForWriteOptions{.chunk_rows = 1000, .max_price_decimals = 6});
+  {
+    TurboPForFile file(tmp_file.tmp_filename.c_str());
+    ASSERT_EQ(file.ChunkInfos().size(), 4);
+    EXPECT_EQ(file.ChunkInfos()[0].price_decimals, 2);
+    EXPECT_EQ(file.ChunkInfos()[1].price_decimals, 6);
+    EXPECT_EQ(file.ChunkInfos()[2].price_decimals, kTurboPForRawPrices);
+    // -0.0 would come back as 0.0
+    EXPECT_EQ(file.ChunkInfos()[3].price_decimals, kTurboPForRawPrices);
+  }
+  std::vector<InputRow> out_rows;
+  ReadTurboPForFromInputRows(
+      bitnunpack128v64, bitnunpack256v32, tmp_file.tmp_filename.c_str(),
+      [&](const InputRow &row) { out_rows.push_back(row); });
+  ASSERT_EQ(out_rows.size(), input_rows.size());
+  for (size_t i = 0; i < out_rows.size(); ++i) {
+    EXPECT_EQ(std::bit_cast<uint64_t>(out_rows[i].price),
+              std::bit_cast<uint64_t>(input_rows[i].price))
+        << i;
+  }
+
+  std::vector<int64_t> scaled;
+  std::vector<double> prices{1.5, 2.25, std::nan("")};
+  EXPECT_EQ(ScaleTurboPForPrices(std::span(prices).first(2), 6, scaled), 2);
+  EXPECT_THAT(scaled, testing::ElementsAre(150, 225));
+  EXPECT_EQ(ScaleTurboPForPrices(prices, 6, scaled), kTurboPForRawPrices);
+  EXPECT_EQ(ScaleTurboPForPrices(std::span(prices).first(2), 1, scaled),
+            kTurboPForRawPrices);
+}
+
+TEST(TurboPForWriter, StreamsColumnBatches) {
+  std::vector<InputRow> input_rows;
+  InputColumnBuffer input_columns;
+  for (int64_t i = 0; i < 10500; ++i) {
+    input_rows.push_back(InputRow{1000000000000 + i * 1000000,
+                                  static_cast<uint32_t>(i % 3),
+                                  static_cast<uint32_t>(i % 7),
+                                  100.0 + (i % 10)});
+    input_columns.push_back(input_rows.back());
+  }
+  NameToId providers;
+  NameToId symbols;
+  for (absl::string_view name : {"p0", "p1", "p2"}) {
+    providers.IDFromName(name);
+  }
+  for (absl::string_view name : {"s0", "s1", "s2", "s3", "s4", "s5", "s6"}) {
+    symbols.IDFromName(name);
+  }
+  TurboPForWriteOptions options{.chunk_rows = 1000};
+  TempFileForTest expected_file;
+  WriteTurboPForFromInputRows(bitnpack128v64, bitnpack256v32,
+                              expected_file.tmp_filename.c_str(), input_rows,
+                              providers, symbols, options);
+
+  TempFileForTest tmp_file;
+  {
+    TurboPForWriter writer(bitnpack128v64, bitnpack256v32,
+                           tmp_file.tmp_filename.c_str(), options);
+    // Batches that straddle chunk boundaries, and single rows
+    size_t i = 0;
+    for (size_t batch : {size_t(1), size_t(999), size_t(1), size_t(2500),
+                         size_t(0), size_t(3000)}) {
+      writer.AddColumns(input_columns.View().subspan(i, batch));
+      i += batch;
+    }
+    for (; i < input_rows.size(); ++i) {
+      writer.AddRow(input_rows[i]);
+    }
+    EXPECT_EQ(writer.NumRows(), input_rows.size());
+    // An unclosed file reads as empty
+    EXPECT_EQ(TurboPForFile(tmp_file.tmp_filename.c_str()).NumRows(), 0);
+    writer.SetNames(providers, symbols);
+    writer.Close();
+  }
+
+  auto read_file = [](const std::string &filename) {
+    std::ifstream in(filename, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+  };
+  EXPECT_EQ(read_file(tmp_file.tmp_filename),
+            read_file(expected_file.tmp_filename));
+  std::vector<InputRow> out_rows;
+  ReadTurboPForFromInputRows(
+      bitnunpack128v64, bitnunpack256v32, tmp_file.tmp_filename.c_str(),
+      [&](const InputRow &row) { out_rows.push_back(row); });
+  EXPECT_THAT(out_rows, testing::ElementsAreArray(input_rows));
+}
+
+TEST(TurboPForFile, EmbedsNames) {
+  NameToId providers;
+  NameToId symbols;
+  providers.IDFromName("provider");
+  symbols.IDFromName("");
+  symbols.IDFromName("symbol with spaces");
+  std::vector<InputRow> input_rows = {InputRow{1, 0, 1, 2.5}};
+
+  TempFileForTest tmp_file;
+  WriteTurboPForFromInputRows(bitnpack128v64, bitnpack256v32,
+                              tmp_file.tmp_filename.c_str(), input_rows,
+                              providers, symbols);
+  TurboPForFile file(tmp_file.tmp_filename.c_str());
+  ASSERT_TRUE(file.HasNames());
+  EXPECT_EQ(file.Providers().id_to_name, providers.id_to_name);
+  EXPECT_EQ(file.Symbols().id_to_name, symbols.id_to_name);
+  EXPECT_EQ(file.Symbols().name_to_id.find("symbol with spaces")->second, 1);
+
+  // Without SetNames, the file has no names
+  TempFileForTest unnamed_file;
+  {
+    TurboPForWriter writer(bitnpack128v64, bitnpack256v32,
+                           unnamed_file.tmp_filename.c_str());
+    writer.AddRow(input_rows[0]);
+    writer.Close();
+  }
+  EXPECT_FALSE(TurboPForFile(unnamed_file.tmp_filename.c_str()).HasNames());
+}
+
+TEST(TurboPForWriter, CompressThreadsWriteSameFile) {
+  std::vector<InputRow> input_rows;
+  for (int64_t i = 0; i < 10500; ++i) {
+    input_rows.push_back(InputRow{1000000000000 + i * 1000000,
+                                  static_cast<uint32_t>(i % 3),
+                                  static_cast<uint32_t>(i % 7),
+                                  100.0 + (i % 10) / 4.0});
+  }
+  auto write_file = [&](int compress_threads) {
+    TempFileForTest tmp_file;
+    WriteTurboPForFromInputRows(
+        bitnpack128v64, bitnpack256v32, tmp_file.tmp_filename.c_str(),
+        input_rows, NameToId{}, NameToId{},
+        TurboPForWriteOptions{.chunk_rows = 1000,
+                              .max_price_decimals = 2,
+                              .compress_threads = compress_threads});
+    std::ifstream in(tmp_file.tmp_filename, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+  };
+  std::string expected = write_file(0);
+  for (int compress_threads : {1, 3, 32}) {
+    EXPECT_EQ(write_file(compress_threads), expected) << compress_threads;
+  }
+}
+
+TEST(TurboPForWriter, RejectsNonPositiveChunkRows) {
+  TempFileForTest tmp_file;
+  // A name not yet taken, to check that no file is created
+  const std::string filename = tmp_file.tmp_filename + ".turbo";
+  for (int64_t chunk_rows : {int64_t(0), int64_t(-1)}) {
+    TurboPForWriteOptions options{.chunk_rows = chunk_rows};
+    EXPECT_THROW(TurboPForWriter(bitnpack128v64, bitnpack256v32,
+                                 filename.c_str(), options),
+                 std::runtime_error)
+        << chunk_rows;
+    EXPECT_FALSE(std::filesystem::exists(filename));
+  }
+}
+
+TEST(TurboPForFile, FooterIndexAndRangeReads) {
+  std::vector<InputRow> input_rows;
+  TempFileForTest tmp_file;
+  for (int64_t i = 0; i < 10500; ++i) {
+    input_rows.push_back(InputRow{1000000000000 + i * 1000000,
+                                  static_cast<uint32_t>(i % 3),
+                                  static_cast<uint32_t>(i % 7),
+                                  100.0 + (i % 10)});
+  }
+  WriteTurboPForFromInputRows(bitnpack128v64, bitnpack256v32,
+                              tmp_file.tmp_filename.c_str(), input_rows,
+                              NameToId{}, NameToId{},
+                              TurboPForWriteOptions{.chunk_rows = 1000});
+
+  auto read_range = [&](int64_t begin_nanos, int64_t end_nanos) {
+    std::vector<InputRow> out_rows;
+    ReadTurboPForColumns(
+        bitnunpack128v64, bitnunpack256v32, tmp_file.tmp_filename.c_str(),
+        [&](const InputColumns &columns) {
+          for (size_t i = 0; i < columns.size(); ++i) {
+            out_rows.push_back(columns[i]);
+          }
+        },
+        TurboPForReadOptions{.begin_nanos = begin_nanos,
+                             .end_nanos = end_nanos});
+    return out_rows;
+  };
+  auto expected_range = [&](int64_t begin_nanos, int64_t end_nanos) {
+    std::vector<InputRow> rows;
+    for (const auto &row : input_rows) {
+      if (row.ts_nanos >= begin_nanos && row.ts_nanos < end_nanos) {
+        rows.push_back(row);
+      }
+    }
+    return rows;
+  };
+
+  {
+    TurboPForFile file(tmp_file.tmp_filename.c_str());
+    EXPECT_TRUE(file.HasIndex());
+    EXPECT_EQ(file.NumRows(), 10500);
+    ASSERT_EQ(file.ChunkInfos().size(), 11);
+    EXPECT_EQ(file.ChunkInfos()[1].num_rows, 1000);
+    EXPECT_EQ(file.ChunkInfos()[1].min_ts_nanos, input_rows[1000].ts_nanos);
+    EXPECT_EQ(file.ChunkInfos()[1].max_ts_nanos, input_rows[1999].ts_nanos);
+    EXPECT_EQ(file.ChunkInfos()[10].num_rows, 500);
+    // Only the chunks overlapping the range are touched
+    EXPECT_THAT(file.ChunksToRead(TurboPForReadOptions{
+                    .begin_nanos = input_rows[1500].ts_nanos,
+                    .end_nanos = input_rows[2000].ts_nanos + 1}),
+                testing::ElementsAre(1, 2));
+  }
+  EXPECT_THAT(read_range(input_rows[1500].ts_nanos, input_rows[3001].ts_nanos),
+              testing::ElementsAreArray(expected_range(
+                  input_rows[1500].ts_nanos, input_rows[3001].ts_nanos)));
+  EXPECT_TRUE(read_range(0, input_rows[0].ts_nanos).empty());
+  EXPECT_THAT(read_range(std::numeric_limits<int64_t>::min(),
+                         std::numeric_limits<int64_t>::max()),
+              testing::ElementsAreArray(input_rows));
+
+  // Files from before the footer index are scanned instead
+  size_t footer_offset;
+  {
+    std::ifstream in(tmp_file.tmp_filename, std::ios::binary);
+    in.seekg(-16, std::ios::end);
+    in.read(reinterpret_cast<char *>(&footer_offset), 8);
+  }
+  std::filesystem::resize_file(tmp_file.tmp_filename, footer_offset);
+  {
+    TurboPForFile file(tmp_file.tmp_filename.c_str());
+    EXPECT_FALSE(file.HasIndex());
+    EXPECT_EQ(file.ChunkInfos().size(), 11);
+  }
+  {
+    // and read whole with kRead
+    TurboPForFile file(tmp_file.tmp_filename.c_str(),
+                       TurboPForIOStrategy::kRead);
+    EXPECT_FALSE(file.ReadsChunksOnDemand());
+    EXPECT_EQ(file.ChunkInfos().size(), 11);
+  }
+  EXPECT_THAT(read_range(input_rows[1500].ts_nanos, input_rows[3001].ts_nanos),
+              testing::ElementsAreArray(expected_range(
+                  input_rows[1500].ts_nanos, input_rows[3001].ts_nanos)));
+}
+
+TEST(TurboPForFile, RejectsFooterCountsThatDoNotFit) {
+  std::vector<InputRow> input_rows;
+  for (int64_t i = 0; i < 3500; ++i) {
+    input_rows.push_back(InputRow{1000000000000 + i * 1000000,
+                                  static_cast<uint32_t>(i % 3),
+                                  static_cast<uint32_t>(i % 7), 100.0});
+  }
+  TempFileForTest tmp_file;
+  WriteTurboPForFromInputRows(bitnpack128v64, bitnpack256v32,
+                              tmp_file.tmp_filename.c_str(), input_rows,
+                              NameToId{}, NameToId{},
+                              TurboPForWriteOptions{.chunk_rows = 1000});
+  int64_t footer_offset;
+  {
+    std::ifstream in(tmp_file.tmp_filename, std::ios::binary);
+    in.seekg(-16, std::ios::end);
+    in.read(reinterpret_cast<char *>(&footer_offset), 8);
+  }
+  // The chunk index comes first in the footer: its tag and size, then the
+  // chunk count and the offset of the first chunk
+  auto patch = [&](int64_t offset, int64_t value) {
+    std::fstream out(tmp_file.tmp_filename,
+                     std::ios::binary | std::ios::in | std::ios::out);
+    out.seekp(offset);
+    out.write(reinterpret_cast<const char *>(&value), 8);
+  };
+  patch(footer_offset + 16, int64_t(1) << 60);
+  EXPECT_THROW(TurboPForFile(tmp_file.tmp_filename.c_str()),
+               std::runtime_error);
+  patch(footer_offset + 16, -1);
+  EXPECT_THROW(TurboPForFile(tmp_file.tmp_filename.c_str()),
+               std::runtime_error);
+  patch(footer_offset + 16, 4);
+  EXPECT_EQ(TurboPForFile(tmp_file.tmp_filename.c_str()).ChunkInfos().size(),
+            4);
+  patch(footer_offset + 24, footer_offset);
+  EXPECT_THROW(TurboPForFile(tmp_file.tmp_filename.c_str()),
+               std::runtime_error);
+}
+
+TEST(TurboPForFile, SkipsChunksWithoutSelectedSeries) {
+  std::vector<InputRow> input_rows;
+  TempFileForTest tmp_file;
+  for (int64_t i = 0; i < 10000; ++i) {
+    // Symbol 99 only trades in the fourth chunk
+    uint32_t symbol = i >= 3000 && i < 4000 && i % 10 == 0 ? 99 : i % 7;
+    input_rows.push_back(InputRow{1000000000000 + i * 1000000,
+                                  static_cast<uint32_t>(i % 3), symbol,
+                                  100.0 + (i % 10)});
+  }
+  WriteTurboPForFromInputRows(bitnpack128v64, bitnpack256v32,
+                              tmp_file.tmp_filename.c_str(), input_rows,
+                              NameToId{}, NameToId{},
+                              TurboPForWriteOptions{.chunk_rows = 1000});
+
+  TWAPOptions options{
+      .series_filter = TWAPSeriesFilter::Only({{0, 99}, {2, 99}, {5, 5}})};
+  {
+    TurboPForFile file(tmp_file.tmp_filename.c_str());
+    EXPECT_THAT(file.ChunksToRead(
+                    TurboPForReadOptions{.series_filter =
+                                             options.series_filter}),
+                testing::ElementsAre(3));
+  }
+
+  InputColumnBuffer input_columns;
+  for (const auto &row : input_rows) {
+    input_columns.push_back(row);
+  }
+  std::vector<OutputRow> expected;
+  ComputeTWAP([&](auto &&f) { f(input_columns.View()); },
+              [&](const OutputRow &row) { expected.push_back(row); },
+              options);
+  ASSERT_FALSE(expected.empty());
+  std::vector<OutputRow> filtered;
+  ComputeTWAP(
+      [&](auto &&f) {
+        ReadTurboPForColumns(
+            bitnunpack128v64, bitnunpack256v32, tmp_file.tmp_filename.c_str(),
+            f, TurboPForReadOptions{.series_filter = options.series_filter});
+      },
+      [&](const OutputRow &row) { filtered.push_back(row); }, options);
+  EXPECT_THAT(filtered, testing::ElementsAreArray(expected));
+  for (const auto &row : filtered) {
+    EXPECT_EQ(row.symbol_id, 99);
+  }
+}
+
 static void BM_TurboPForCompression(benchmark::State &state) {
   TempFileForTest tmp_file;
   NameToId providers;
@@ -66,8 +604,10 @@ static void BM_TurboPForCompression(benchmark::State &state) {
     double sum_twap = 0;
     ComputeTWAP(
         [&](auto &&f) {
-          ReadTurboPForFromInputRows(bitnunpack128v64, bitnunpack256v32,
-                                     tmp_file.tmp_filename.c_str(), f);
+          ReadTurboPForColumns(bitnunpack128v64, bitnunpack256v32,
+                               tmp_file.tmp_filename.c_str(), f,
+                               TurboPForReadOptions{.decode_threads =
+                                                        int(state.range(0))});
         },
         [&](const OutputRow &output_row) { sum_twap += output_row.twap; });
     benchmark::DoNotOptimize(sum_twap);
@@ -75,6 +615,6 @@ static void BM_TurboPForCompression(benchmark::State &state) {
 
   state.SetItemsProcessed(state.iterations() * input_rows.size());
 }
-BENCHMARK(BM_TurboPForCompression);
+BENCHMARK(BM_TurboPForCompression)->Arg(0)->Arg(2);
 
 TEST(Benchmarks, RunAll) { ::benchmark::RunSpecifiedBenchmarks("all"); }